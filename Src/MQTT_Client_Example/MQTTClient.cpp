@@ -1,541 +1,1823 @@
-/*
-@Date  : 8/11/2021
-@Author: Tan Dung, Tran
-@Brief : MQTT client library
- */
-#include "MQTTClient.h"
-
-#define DEBUG   //If you comment this line, the DPRINT & DPRINTLN lines are defined as blank.
-#ifdef DEBUG    //Macros are usually in all capital letters.
-   #define debug(...)          Serial.print(__VA_ARGS__)     //debug print
-   #define debugx(...)         Serial.println(__VA_ARGS__)   //debug print with new line
-#else
-   #define debug(...)     //now defines a blank line
-   #define debugx(...)   //now defines a blank line
-   #define logxFunc(...)
-#endif
-
-#if 0
-  #define logFunc(...) debugx(__func__)
-#else
-  #define logFunc(...)
-#endif
-
-MQTTClient* MQTTClient::current = NULL;//pointer for MQTTclient
-
-MQTTClient::MQTTClient(CooperativeMultitasking* _tasks, Client* _client, const char* _host, uint16_t _port, const char* _clientid, const char* _username, const char* _password, uint16_t _keepalive) {
-  tasks = _tasks;
-  client = _client;
-  host = strdup(_host);// make sure same format
-  port = _port;
-  clientid = strdup(_clientid);// make sure same format
-  username = strdupOrNull(_username);// can be null
-  password = strdupOrNull(_password);// can be null
-  keepalive = _keepalive;
-  isconnected = false;
-  head = NULL;//head of double linked list
-  tail = NULL;//tail of double linked list
-}
-
-MQTTClient::~MQTTClient() {
-  free(host);
-  free(clientid);
-  free(username);
-  free(password);
-  host = NULL;
-  clientid = NULL;
-  username = NULL;
-  password = NULL;
-  //seeking all the payloads and free them
-  while (head) {
-    PublishPacket* next = head->next;
-    free(head->payload);
-    delete head;
-    head = next;
-  }
-  //
-  tail = NULL;
-  //free the MQTT client pointer
-  if (current == this) current = NULL;
-}
-
-bool MQTTClient::connect() {
-  if (!current) {
-    if (client->connect(host, port)) {
-      if (sendConnectPacket()) {
-        current = this;
-        // in this case, asynchronous is used to avoid delaying the program
-        // a connectpacket will has been then a ackpacket will be expected to run the next step receiveConnectAcknowledgementPacket()
-        // that's why if we call the publish() method immediatelly, it will be canceled b/c it's waiting for connecting
-        // (or we need to delay the program at least 100ms to run publish())
-        auto task1 = tasks->ifThen([] () -> bool { return current ? current->available() >= 4 : true; },
-                                   [] () -> void { if (current) current->receiveConnectAcknowledgementPacket(); });
-        auto task2 = tasks->after(10000, [] () -> void { if (current) current->stop(); });
-        tasks->onlyOneOf(task1, task2);
-        //
-        return true;
-      }
-      //
-      Serial.println("cannot send connect packet");
-      //
-      stop();
-    } else {
-      Serial.print("cannot connect to ");
-      Serial.print(host);
-      Serial.print(":");
-      Serial.println(port);
-    }
-  } else {
-    Serial.println("another mqtt client is connected");
-  }
-  //
-  return false;
-}
-
-bool MQTTClient::connected() {
-  return isconnected;
-}
-
-bool MQTTClient::publishAcknowledged() {
-  return !head;
-}
-
-bool MQTTClient::publish(bool retain, const char* topicname, const char* payload) {
-  logFunc();
-  PublishPacket* packet = new PublishPacket(); // std::nothrow is default
-  current = this;
-  //
-  if (packet) {
-    packet->retain = retain;
-    packet->topicname = topicname;
-    packet->payload = strdup(payload);
-    enqueuePublishPacket(packet);
-    auto taskPub = tasks->ifThen( [] () -> bool {return current->isACKconnected;},
-                                  [] () -> void { if (current) current->transmitPublishPacketsAfter(0); });//waiting for ack connect done
-    current->isACKconnected = false;
-    //
-    /* transmitPublishPacketsAfter(0); */
-    return true;
-  }
-  //
-  Serial.println("cannot enqueue publish packet");
-  //
-  return false;
-}
-
-void MQTTClient::disconnect() {
-  if (isconnected) sendDisconnectPacket();
-  //
-  stop();
-}
-
-void MQTTClient::enqueuePublishPacket(PublishPacket* packet) {
-  logFunc();
-  uint16_t packetid = 1; // 2.3.1 non-zero 16-bit packetid
-  //check if there is another packet
-  if (head) {
-    PublishPacket* packet = head;
-    //
-    while (packet) {
-      if (packet->packetid > packetid) packetid = packet->packetid;
-      //
-      packet = packet->next;
-    }
-    //
-    packetid++; // biggest packetid plus 1
-  }
-  //
-  packet->packetid = packetid;
-  packet->trycount = 0;
-  packet->next = head;
-  head = packet;
-  //
-  if (!tail) tail = head;
-  debug("Number of packet: ");
-  debugx(packet->packetid);
-}
-
-void MQTTClient::transmitPublishPacketsAfter(unsigned long duration) {
-  logFunc();
-  tasks->after(duration, [] () -> void { if (current) current->transmitPublishPackets(); });
-}
-
-void MQTTClient::transmitPublishPackets() {
-  logFunc();
-  if (isconnected && current == this && head) {
-    //if the packet has been delivered well, receive the ACK and recheck after 100ms
-    if (available() >= 4) {
-      debugx("Case1: ");
-      receivePublishAcknowledgementPacket();
-      transmitPublishPacketsAfter(100);
-      //
-      return;
-    }
-    //if the try times >= n times, so give up to deliver the packet
-    if (head->trycount >= TRY_TIME) {
-      Serial.println("discarding packet");
-      //
-      removePublishPacket(head->packetid);
-      transmitPublishPacketsAfter(100);//???
-      //
-      return;
-    }
-    //if the packet has been delivered fail or hasn't delivered, try again after 10s
-    if (sendHeadPublishPacket()) {
-      debugx("Case3: ");
-      head->trycount++;
-      rotatePublishPackets();
-      transmitPublishPacketsAfter(INTERVAL_TO_RETRY);
-      //
-      return;
-    }
-    //
-    Serial.println("cannot send publish packet");
-    //
-    stop();
-  }
-}
-
-void MQTTClient::removePublishPacket(uint16_t packetid) {
-  logFunc();
-  PublishPacket* last = NULL;
-  PublishPacket* packet = head;
-  //
-  while (packet) {
-    if (packet->packetid == packetid) {
-      if (last) last->next = packet->next;
-      //
-      if (packet == head) head = packet->next;
-      //
-      if (packet == tail) tail = last;
-      //
-      free(packet->payload);
-      delete packet;
-      //
-      return;
-    }
-    //
-    last = packet;
-    packet = packet->next;
-  }
-}
-
-void MQTTClient::rotatePublishPackets() {
-  logFunc();
-  if (!head || head == tail) return; // less than 2 packets
-  //
-  tail->next = head;
-  tail = head;
-  head = head->next;
-  tail->next = NULL;
-}
-
-bool MQTTClient::sendConnectPacket() {
-  /* msg format:
-  control field: comand type (4 bits) + control flag (4 bits): 1 
-  remaining length: 1
-  length: 2
-  MQTT (name of protocol): 4
-  protocol level: 1
-  connect flag: 1
-  keep alive: 2
-  client id
-  */
-  logFunc();
-  
-  int packetlength = 2 + 4 + 1 + 1 + 2 + 2 + strlen(clientid);
-  //
-  if (username != NULL) packetlength += (2 + strlen(username));
-  //
-  if (password != NULL) packetlength += (2 + strlen(password));
-  //
-  uint8_t connectflags = 2; // clean session
-  //
-  if (username != NULL) connectflags |= 128;
-  //
-  if (password != NULL) connectflags |= 64;
-  //
-  // Type, Flags, Packet Length
-  writeTypeFlags(1, 0); // connect, 0
-  writePacketLength(packetlength);
-  //
-  // Header
-  writeLengthString("MQTT"); // protocol name
-  writeByte(4); // protocol level
-  writeByte(connectflags);
-  writeShort(keepalive);
-  //
-  // Payload
-  writeLengthString(clientid);
-  //
-  if (username != NULL) writeLengthString(username);
-  //
-  if (password != NULL) writeLengthString(password);
-  //
-  flush();
-  debugx("Send connect ok!");
-  //
-  return !getWriteError();
-}
-
-/* 
-This is the main task of program
-The program will handle the feedback from Server here and decide what to do next
- */
-
-// void MQTTClient::receiveConnectAcknowledgementPacket() {
-void MQTTClient::receiveConnectAcknowledgementPacket() {
-  logFunc();
-
-  uint8_t typeflags = readByte();
-  uint8_t packetlength = readByte();
-  uint8_t sessionpresent = readByte();
-  uint8_t returncode = readByte();
-  //
-  if (typeflags == (2 << 4) && packetlength == 2) {
-    switch (returncode) {
-      case 0: Serial.println("connection accepted"); isconnected = true; isACKconnected = true; /* transmitPublishPacketsAfter(0); */ return;
-      case 1: Serial.println("unacceptable protocol version"); break;
-      case 2: Serial.println("identifier rejected"); break;
-      case 3: Serial.println("server unavailable"); break;
-      case 4: Serial.println("bad user name or password"); break;
-      case 5: Serial.println("not authorized"); break;
-      default: Serial.println(returncode); break;
-    }
-  } else {
-    Serial.println("not a connect acknowledgement");
-  }
-  //
-  stop();
-}
-
-bool MQTTClient::sendHeadPublishPacket() {
-  logFunc();
-
-  int packetlength = 2 + strlen(head->topicname) + 2 + strlen(head->payload);
-  uint8_t flags = 2; // QoS 1
-  //
-  if (head->trycount > 0) flags |= 8; // duplicate
-  //
-  if (head->retain) flags |= 1; // check retain flag
-  //
-  // Type, Flags, Packet Length
-  writeTypeFlags(3, flags); // publish, flags
-  writePacketLength(packetlength);
-  //
-  // Header
-  writeLengthString(head->topicname);
-  writeShort(head->packetid);
-  //
-  // Payload
-  writeString(head->payload, strlen(head->payload));
-  //
-  flush();
-  //
-  return !getWriteError();
-}
-
-void MQTTClient::receivePublishAcknowledgementPacket() {
-  logFunc();
-
-  uint8_t typeflags = readByte();
-  uint8_t packetlength = readByte();
-  uint16_t packetid = readShort();
-  //
-  if (typeflags == (4 << 4) && packetlength == 2) {
-    removePublishPacket(packetid);
-    //
-    Serial.println("publish acknowledged");
-    //
-    return;
-  }
-  //
-  Serial.println("not a publish acknowledgement");
-  disconnect();
-}
-
-void MQTTClient::sendDisconnectPacket() {
-  logFunc();
-
-  // Type, Flags, Packet Length
-  writeTypeFlags(14, 0); // disconnect, 0
-  writePacketLength(0);
-  //
-  flush();
-}
-
-void MQTTClient::writeTypeFlags(uint8_t type, uint8_t flags) {
-  writeByte(type << 4 | flags);
-}
-
-void MQTTClient::writePacketLength(int value) {
-  while (true) {
-    int digit = value & 127;
-    value >>= 7;
-    //
-    if (value > 0) {
-      writeByte(digit | 128);
-    } else {
-      writeByte(digit);
-      //
-      break;
-    }
-  }
-}
-
-void MQTTClient::writeLengthString(const char* value) {
-  size_t len = strlen(value);
-  //
-  if (len > 65535) return;
-  //
-  writeShort(len);
-  writeString(value, len);
-}
-
-void MQTTClient::writeString(const char* value, size_t len) {
-  client->write((uint8_t*) value, len);
-}
-
-void MQTTClient::writeShort(uint16_t value) {
-  writeByte(value >> 8);
-  writeByte(value & 255);
-}
-
-void MQTTClient::writeByte(uint8_t value) {
-  client->write(value);
-}
-
-void MQTTClient::flush() {
-  client->flush();
-}
-
-int MQTTClient::getWriteError() {
-  return client->getWriteError();
-}
-
-int MQTTClient::available() {
-  return client->available();
-}
-
-void MQTTClient::stop() {
-  if (client->connected()) {
-    client->stop();
-    client->clearWriteError();
-  }
-  //
-  isconnected = false;
-  current = NULL;
-}
-
-uint8_t MQTTClient::readByte() {
-  return client->read();
-}
-
-uint16_t MQTTClient::readShort() {
-  uint16_t value = client->read();
-  value <<= 8;
-  value += client->read();
-  //
-  return value;
-}
-
-char* MQTTClient::strdupOrNull(const char* string) {
-  if (string == NULL) return NULL;
-  //
-  return strdup(string);
-}
-
-//Subcribe here
-// SubscribePacket* MQTTClient::SubcribeReceiveHandle() {
-//     uint8_t firstbyte = readByte();//doc byte dau tien
-//     uint8_t flags = firstbyte & 15;//0b1111
-//     uint8_t type = firstbyte >> 4;//
-//     size_t length = readPacketLength();
-//     //check the control header (cmd type + ctrl flag)
-//     switch (type) {
-//         //handle sub here
-//         case 9: //Subcribe ack (S-C)
-//         {
-//             if (length == 3) {
-//                 uint16_t packetid = readShort();
-//                 uint8_t returncode = readByte();
-//                 //
-//                 if (isReadComplete()) return new SubscribeAcknowledgement(flags, type, packetid, returncode);
-//             }
-//             //
-//             break;
-//         }
-//     }
-//     //
-//     while (length > 0) {
-//         readByte();
-//         length--;
-//     }
-//     //
-//     return nullptr;
-// }
-
-// bool MQTTClient::sendSubscribeRequest(const char topicfilter[], uint8_t qos) {
-//     packetid++;
-//     //
-//     if (packetid == 0) packetid = 1;
-//     //
-//     size_t packetlength = 2 + 2 + strlen(topicfilter) + 1;
-//     writeTypeFlags(8, 2);
-//     writePacketLength(packetlength);
-//     writeShort(packetid);
-//     writeLengthString(topicfilter);
-//     writeByte(qos);
-//     flush();
-//     //
-//     return isWriteComplete();
-// }
-
-// size_t MQTTClient::readPacketLength() {
-//     size_t len = 0;
-//     size_t multiplier = 1;
-//     //
-//     while (true) {
-//         uint8_t digit = readByte();
-//         len += (digit & 127) * multiplier;
-//         multiplier <<= 7;
-//         //
-//         if ((digit & 128) == 0) break;
-//     }
-//     //
-//     return len;
-// }
-
-// //this is polling
-// //read all msg from server
-// char* MQTTClient::readString(size_t len) {
-//     char* str = new char[len + 1];
-//     //
-//     if (str) {
-//         for (size_t i = 0; i < len; i++) {
-//             str[i] = (char) readByte();
-//         }
-//         //
-//         str[len] = (char) 0;
-//     }
-//     //
-//     return str;
-// }
-
-/*
- *
- */
-
-MQTTTopic::MQTTTopic(MQTTClient* _client, const char* _topicname) {
-  client = _client;
-  topicname = strdup(_topicname);
-}
-
-MQTTTopic::~MQTTTopic() {
-  free(topicname);
-  topicname = NULL;
-}
-
-bool MQTTTopic::publish(const char* payload, bool retain) {
-  return client->publish(retain, topicname, payload);
+/*
+@Date  : 8/11/2021
+@Author: Tan Dung, Tran
+@Brief : MQTT client library
+ */
+#include "MQTTClient.h"
+#include "MQTTValidate.h"
+#include "MQTTDNSCache.h"
+
+#define __MODULE__ "MQTTClient"
+#ifndef __DEBUG__   //1 errors, 2 warnings, 3 info, 4 debug; lower levels compile to nothing
+   #define __DEBUG__ 3
+#endif
+#include "user_debug.h" // records are formatted later by user_debug_drain()
+
+#if 0
+  #define logFunc(...) DBG("%s\n", __func__)
+#else
+  #define logFunc(...)
+#endif
+
+MQTTClient::MQTTClient(CooperativeMultitasking* _tasks, Client* _client, const char* _host, uint16_t _port, const char* _clientid, const char* _username, const char* _password, uint16_t _keepalive) {
+  tasks = _tasks;
+  client = _client;
+  error = MQTT_ERROR_NONE;
+#ifdef MQTT_STATIC_MEMORY
+  stringslength = 0;
+#endif
+  host = copyString(_host);// make sure same format
+  port = _port;
+  clientid = copyString(_clientid);// make sure same format
+  username = copyString(_username);// can be null
+  password = copyString(_password);// can be null
+  keepalive = _keepalive;
+  isconnected = false;
+  isACKconnected = false;
+  istransmitting = false;
+  streaming = NULL;
+  streamoffset = 0;
+  connectstate = CONNECT_IDLE;
+  connectdeadline = 0;
+  hasaddress = false;
+  weighted = false;
+  queuepolicy = QUEUE_DROP_OLDEST;
+  memset(&queuestats, 0, sizeof queuestats);
+  srtt = 0;
+  rttvar = 0;
+  rto = INTERVAL_TO_RETRY;
+  timetolive = PUBLISH_TIME_TO_LIVE;
+  nextpacketid = 1;
+  freeids = 0;
+  memset(&stats, 0, sizeof stats);
+  statsversion = 0;
+  wasconnected = false;
+  statstopic = TOPIC_NONE;
+  statsinterval = 0;
+  isstatsscheduled = false;
+  memset(topics, 0, sizeof topics);
+  outputlength = 0;
+  corked = false;
+  corkthreshold = OUTPUT_BUFFER_SIZE / 2;
+  corklatency = 0;
+  isflushscheduled = false;
+  observer = NULL;
+  observercontext = NULL;
+  ingress = NULL;
+  ingressowned = false;
+  ingresshead = 0;
+  ingresscount = 0;
+  ingresstail = 0;
+  ingressdropped = 0;
+  isdrainscheduled = false;
+  pooled = false;
+  freepackets = NULL;
+  poolsize = 0;
+  payloadcapacity = 0;
+  footprint = sizeof(MQTTClient);
+  //
+  for (int i = 0; i < PUBLISH_LANES; i++) {
+    Lane& lane = lanes[i];
+    lane.head = NULL;//head of single linked list
+    lane.tail = NULL;//tail of single linked list
+    lane.inflight = NULL;
+    lane.inflighttail = NULL;
+    lane.weight = 1;
+    lane.credit = 0;
+    memset(&lane.stats, 0, sizeof lane.stats);
+  }
+}
+
+MQTTClient::~MQTTClient() {
+  // tasks are bound to the client, also those waiting on connacked
+  tasks->cancelAll(this);
+#ifndef MQTT_STATIC_MEMORY
+  free(host);
+  free(clientid);
+  free(username);
+  free(password);
+#endif
+  statstopic = TOPIC_NONE;
+  host = NULL;
+  clientid = NULL;
+  username = NULL;
+  password = NULL;
+  //seeking all the payloads and free them, pooled ones went with the StaticMQTTClient
+  for (int i = 0; i < PUBLISH_LANES; i++) {
+    Lane& lane = lanes[i];
+    //
+    while (lane.head) {
+      PublishPacket* next = lane.head->next;
+      //
+      if (!pooled) freePublishPacket(lane.head);
+      //
+      lane.head = next;
+    }
+    //
+    while (lane.inflight) {
+      PublishPacket* next = lane.inflight->next;
+      //
+      if (!pooled) freePublishPacket(lane.inflight);
+      //
+      lane.inflight = next;
+    }
+    //
+    lane.tail = NULL;
+    lane.inflighttail = NULL;
+  }
+  //
+#ifndef MQTT_STATIC_MEMORY
+  for (int i = 0; i < TOPIC_HANDLES; i++) {
+    if (topics[i].owned) free((void*) topics[i].bytes);
+  }
+#endif
+  //
+  memset(topics, 0, sizeof topics);
+  //
+  if (ingress) {
+    tasks->cancelWake(this);
+#ifndef MQTT_STATIC_MEMORY
+    for (int i = 0; i < INGRESS_SIZE; i++) free(ingress[i].external);
+    //
+    if (ingressowned) delete[] ingress;
+#endif
+    ingress = NULL;
+  }
+}
+
+// resolve, TCP connect, CONNECT and CONNACK are steps of their own, other tasks run in between
+bool MQTTClient::connect() {
+  if (isconnected || connectstate != CONNECT_IDLE) return false;
+  // the constructor could not copy them, see getError()
+  if (!host || !clientid) return false;
+  //
+  connectstate = CONNECT_RESOLVING;
+  connectdeadline = tasks->millis() + CONNECT_TIMEOUT;
+  tasks->now([] (void* client) -> void { ((MQTTClient*) client)->stepConnect(); }, this);
+  //
+  return true;
+}
+
+void MQTTClient::stepConnect() {
+  if ((long) (tasks->millis() - connectdeadline) >= 0) {
+    expireConnect();
+    //
+    return;
+  }
+  //
+  switch (connectstate) {
+    case CONNECT_RESOLVING:
+      // a cache hit costs nothing, a miss blocks for one lookup
+      hasaddress = mqttResolve(host, address, tasks->millis());
+      connectstate = CONNECT_TCP;
+      break;
+    case CONNECT_TCP:
+      if (!(hasaddress ? client->connect(address, port) : client->connect(host, port))) {
+        ERR("cannot connect to %s:%u\n", host, port);
+        //
+        if (hasaddress) mqttForgetHost(host);
+        //
+        stop();
+        //
+        return;
+      }
+      //
+      connectstate = CONNECT_SENDING;
+      break;
+    case CONNECT_SENDING:
+    {
+      if (!sendConnectPacket()) {
+        ERR("cannot send connect packet\n");
+        stop();
+        //
+        return;
+      }
+      // round trips are measured per connection
+      srtt = 0;
+      rttvar = 0;
+      rto = INTERVAL_TO_RETRY;
+      connectstate = CONNECT_WAITING;
+      // publish() waits for the CONNACK too, see connacked
+      tasks->after(2, [] (void* client) -> void { ((MQTTClient*) client)->awaitConnectAcknowledgement(); }, this);
+      //
+      return;
+    }
+    default:
+      return;
+  }
+  //
+  tasks->now([] (void* client) -> void { ((MQTTClient*) client)->stepConnect(); }, this);
+}
+
+// re-checked at a quarter of the time waited so far, so the CONNACK is read at most 25% late and a slow
+// broker costs few checks; no guard is polled every cycle
+void MQTTClient::awaitConnectAcknowledgement() {
+  if (available() >= 4) {
+    receiveConnectAcknowledgementPacket();
+    //
+    return;
+  }
+  //
+  unsigned long now = tasks->millis();
+  //
+  if ((long) (now - connectdeadline) >= 0) {
+    expireConnect();
+    //
+    return;
+  }
+  //
+  unsigned long wait = (now - (connectdeadline - CONNECT_TIMEOUT)) / 4;
+  //
+  // the scheduler counts 2 ms ticks, a shorter wait would not let time pass
+  if (wait < 2) wait = 2;
+  //
+  if (wait > INTERVAL_TO_POLL) wait = INTERVAL_TO_POLL;
+  //
+  tasks->after(wait, [] (void* client) -> void { ((MQTTClient*) client)->awaitConnectAcknowledgement(); }, this);
+}
+
+// no-op unless an attempt is running and its deadline has passed
+void MQTTClient::expireConnect() {
+  if (connectstate == CONNECT_IDLE || (long) (tasks->millis() - connectdeadline) < 0) return;
+  //
+  ERR("connect timed out\n");
+  stop();
+}
+
+bool MQTTClient::connected() {
+  return isconnected;
+}
+
+bool MQTTClient::publishAcknowledged() {
+  for (int i = 0; i < PUBLISH_LANES; i++) {
+    if (lanes[i].head || lanes[i].inflight) return false;
+  }
+  //
+  return true;
+}
+
+bool MQTTClient::publish(bool retain, const char* topicname, const char* payload, uint8_t lane) {
+  return publish(retain, topicname, (const uint8_t*) payload, strlen(payload), lane);
+}
+
+// the topic is registered for as long as packets to it are queued, an MQTTTopic saves the lookup
+bool MQTTClient::publish(bool retain, const char* topicname, const uint8_t* payload, size_t length, uint8_t lane) {
+  uint8_t topic = acquireTopic(topicname, strlen(topicname), NULL);
+  bool result = publishHandle(retain, topic, payload, length, lane);
+  releaseTopic(topic);
+  //
+  return result;
+}
+
+bool MQTTClient::publishFrom(bool retain, const char* topicname, size_t length, MQTTPayloadSource* source, void* context, uint8_t lane) {
+  if (!source) return false;
+  //
+  uint8_t topic = acquireTopic(topicname, strlen(topicname), NULL);
+  bool result = publishHandle(retain, topic, NULL, length, lane, source, context);
+  releaseTopic(topic);
+  //
+  return result;
+}
+
+uint8_t MQTTClient::acquireTopic(const char* topicname, size_t length, const uint8_t* image) {
+  uint8_t unused = TOPIC_NONE;
+  //
+  // a bad topic makes the broker close the connection; an MQTTTopic is checked once, a publish by name every time
+  if (!mqttIsValidTopicName(topicname, length)) {
+    error = MQTT_ERROR_TOPIC_NAME;
+    ERR("invalid topic name\n");
+    //
+    return TOPIC_NONE;
+  }
+  //
+  for (uint8_t i = 0; i < TOPIC_HANDLES; i++) {
+    TopicHandle& handle = topics[i];
+    //
+    if (handle.refs == 0) {
+      if (unused == TOPIC_NONE) unused = i;
+    } else if (handle.size == length + 2 && memcmp(handle.bytes + 2, topicname, length) == 0) {
+      handle.refs++;
+      //
+      return i;
+    }
+  }
+  //
+  if (unused == TOPIC_NONE) {
+    error = MQTT_ERROR_TOPICS;
+    ERR("too many topics\n");
+    //
+    return TOPIC_NONE;
+  }
+  //
+  TopicHandle& handle = topics[unused];
+  //
+  if (image) {
+    handle.bytes = image;
+    handle.owned = false;
+  } else {
+#ifdef MQTT_STATIC_MEMORY
+    if (length > TOPIC_NAME_SIZE) {
+      error = MQTT_ERROR_TOPICS;
+      ERR("topic name too long\n");
+      //
+      return TOPIC_NONE;
+    }
+    //
+    uint8_t* bytes = topicnames[unused];
+#else
+    uint8_t* bytes = (uint8_t*) malloc(length + 2);
+    //
+    if (!bytes) {
+      error = MQTT_ERROR_NO_MEMORY;
+      ERR("cannot copy topic name\n");
+      //
+      return TOPIC_NONE;
+    }
+#endif
+    //
+    bytes[0] = length >> 8;
+    bytes[1] = length & 255;
+    memcpy(bytes + 2, topicname, length);
+    handle.bytes = bytes;
+    handle.owned = true;
+  }
+  //
+  handle.size = length + 2;
+  handle.refs = 1;
+  //
+  return unused;
+}
+
+void MQTTClient::releaseTopic(uint8_t topic) {
+  if (topic >= TOPIC_HANDLES || topics[topic].refs == 0) return;
+  //
+  TopicHandle& handle = topics[topic];
+  //
+  if (--handle.refs > 0) return;
+  //
+#ifndef MQTT_STATIC_MEMORY
+  if (handle.owned) free((void*) handle.bytes);
+#endif
+  //
+  handle.bytes = NULL;
+  handle.owned = false;
+}
+
+bool MQTTClient::publishHandle(bool retain, uint8_t topic, const uint8_t* payload, size_t length, uint8_t lane, MQTTPayloadSource* source, void* context) {
+  logFunc();
+  //
+  if (topic >= TOPIC_HANDLES) return false;
+  //
+  if ((pooled && !source && length > payloadcapacity) || length > (size_t) MQTT_MAX_PACKET_LENGTH - 2 - topics[topic].size) {
+    error = MQTT_ERROR_PAYLOAD_SIZE;
+    WARN("publish payload too large\n");
+    //
+    return false;
+  }
+  //
+  if (!source && retain && queuepolicy == QUEUE_LAST_VALUE && replacePublishPacket(topic, payload, length)) {
+    beginStats();
+    stats.publishes++;
+    stats.discards++; // the replaced payload
+    endStats();
+    //
+    return true;
+  }
+  //
+  // a streamed payload takes no room in the queue
+  size_t copied = source ? 0 : length;
+  //
+  if (queuepolicy != QUEUE_DROP_NEWEST) {
+    while (!hasRoomFor(copied) && dropOldestPublishPacket()) { }
+  }
+  //
+  if (!hasRoomFor(copied)) {
+    queuestats.droppednewest++;
+    beginStats();
+    stats.discards++;
+    endStats();
+    error = MQTT_ERROR_QUEUE_FULL;
+    WARN("publish queue is full\n");
+    //
+    return false;
+  }
+  //
+  PublishPacket* packet = allocatePublishPacket(length, !source);
+  //
+  if (packet) {
+    packet->retain = retain;
+    packet->topic = topic;
+    //
+    if (source) {
+      packet->source = source;
+      packet->sourcecontext = context;
+    } else {
+      memcpy(packet->payload, payload, length);
+      packet->payload[length] = (char) 0;
+    }
+    //
+    packet->payloadlength = length;
+    retainTopic(topic);
+    packet->lane = lane < PUBLISH_LANES ? lane : PUBLISH_LANES - 1;
+    enqueuePublishPacket(packet);
+    // one transmit chain serves the whole queue, start it unless it is already running
+    if (!istransmitting) {
+      istransmitting = true;
+      //waiting for ack connect done
+      if (isACKconnected) tasks->now([] (void* client) -> void { ((MQTTClient*) client)->transmitPublishPacketsAfter(0); }, this);
+      else tasks->onEvent(&connacked, [] (void* client) -> void { ((MQTTClient*) client)->transmitPublishPacketsAfter(0); }, this);
+    } else if (packet->lane == PUBLISH_LANE_HIGH && isconnected) {
+      // do not wait for the running chain, it may be sleeping between retries
+      tasks->now([] (void* client) -> void { ((MQTTClient*) client)->transmitUrgentPublishPackets(); }, this, 1);
+    }
+    //
+    /* transmitPublishPacketsAfter(0); */
+    return true;
+  }
+  //
+  error = MQTT_ERROR_NO_MEMORY;
+  ERR("cannot enqueue publish packet\n");
+  //
+  return false;
+}
+
+void MQTTClient::addPoolPacket(PublishPacket* packet, char* payload) {
+  packet->payload = payload;
+  packet->next = freepackets;
+  freepackets = packet;
+  pooled = true;
+  poolsize++;
+}
+
+bool MQTTClient::hasRoomFor(size_t length) const {
+  if (queuestats.budget > 0 && queuestats.bytes + costOf(length) > queuestats.budget) return false;
+  //
+  return !pooled || freepackets;
+}
+
+// publishHandle() checked hasRoomFor() and the payload capacity, the payload is not copied yet
+MQTTClient::PublishPacket* MQTTClient::allocatePublishPacket(size_t length, bool copied) {
+  if (pooled) {
+    PublishPacket* packet = freepackets;
+    freepackets = packet->next;
+    char* payload = packet->payload;
+    memset(packet, 0, sizeof(PublishPacket));
+    packet->payload = payload;
+    //
+    return packet;
+  }
+  //
+#ifdef MQTT_STATIC_MEMORY
+  (void) length;
+  (void) copied;
+  //
+  return NULL;
+#else
+  PublishPacket* packet = new PublishPacket(); // std::nothrow is default
+  //
+  if (!packet || !copied) return packet;
+  //
+  packet->payload = (char*) malloc(length + 1);
+  //
+  if (!packet->payload) {
+    delete packet;
+    //
+    return NULL;
+  }
+  //
+  return packet;
+#endif
+}
+
+void MQTTClient::disconnect() {
+  if (isconnected) {
+    sendDisconnectPacket();
+    flushOutput();
+  }
+  //
+  stop();
+}
+
+bool MQTTClient::beginIngress(Ingress* storage) {
+  if (ingress) return true;
+  //
+  return storage && startIngress(storage->slots);
+}
+
+#ifndef MQTT_STATIC_MEMORY
+bool MQTTClient::beginIngress() {
+  if (ingress) return true;
+  //
+  IngressSlot* slots = new IngressSlot[INGRESS_SIZE]; // std::nothrow is default
+  //
+  if (!slots) {
+    error = MQTT_ERROR_NO_MEMORY;
+    //
+    return false;
+  }
+  //
+  if (!startIngress(slots)) {
+    delete[] slots;
+    //
+    return false;
+  }
+  //
+  ingressowned = true;
+  //
+  return true;
+}
+#endif
+
+bool MQTTClient::startIngress(IngressSlot* slots) {
+  if (!tasks->onWake([] (void* client) -> void { ((MQTTClient*) client)->drainIngress(); }, this)) {
+    WARN("no wake listener left for the mqtt ingress\n");
+    //
+    return false;
+  }
+  //
+  memset(slots, 0, INGRESS_SIZE * sizeof(IngressSlot));
+  ingress = slots;
+  //
+  return true;
+}
+
+// Any thread. One increment reserves room, so the slot at the claimed position has been drained,
+// one more claims the position: no loop, wait-free unless the payload needs the heap.
+bool MQTTClient::submit(uint8_t topic, bool retain, const uint8_t* payload, size_t length, uint8_t lane) {
+  if (!ingress || topic >= TOPIC_HANDLES) return false;
+  //
+#ifdef MQTT_STATIC_MEMORY
+  // no heap for larger payloads
+  if (length > INGRESS_INLINE_SIZE) {
+    __atomic_fetch_add(&ingressdropped, 1, __ATOMIC_RELAXED);
+    //
+    return false;
+  }
+  //
+#endif
+  if (__atomic_fetch_add(&ingresscount, 1, __ATOMIC_ACQ_REL) >= INGRESS_SIZE) {
+    __atomic_fetch_sub(&ingresscount, 1, __ATOMIC_ACQ_REL);
+    __atomic_fetch_add(&ingressdropped, 1, __ATOMIC_RELAXED);
+    //
+    return false;
+  }
+  //
+  uint32_t position = __atomic_fetch_add(&ingresshead, 1, __ATOMIC_ACQ_REL);
+  IngressSlot& slot = ingress[position & (INGRESS_SIZE - 1)];
+  slot.topic = topic;
+  slot.retain = retain;
+  slot.lane = lane;
+  slot.length = length;
+  slot.external = NULL;
+  bool copied = true;
+  //
+  if (length <= INGRESS_INLINE_SIZE) {
+    memcpy(slot.payload, payload, length);
+  } else {
+#ifndef MQTT_STATIC_MEMORY
+    slot.external = (uint8_t*) malloc(length);
+    //
+    if (slot.external) memcpy(slot.external, payload, length);
+    else copied = false;
+#endif
+  }
+  //
+  __atomic_store_n(&slot.sequence, position + 1, __ATOMIC_RELEASE);
+  tasks->wake();
+  // the position was claimed, it is published anyway, as a skip
+  if (!copied) {
+    __atomic_fetch_add(&ingressdropped, 1, __ATOMIC_RELAXED);
+    //
+    return false;
+  }
+  //
+  return true;
+}
+
+void MQTTClient::drainIngress() {
+  for (int i = 0; i < INGRESS_BATCH; i++) {
+    IngressSlot& slot = ingress[ingresstail & (INGRESS_SIZE - 1)];
+    // empty, or claimed and still being written
+    if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != ingresstail + 1) break;
+    //
+    if (slot.length <= INGRESS_INLINE_SIZE) publishHandle(slot.retain, slot.topic, slot.payload, slot.length, slot.lane);
+    else if (slot.external) publishHandle(slot.retain, slot.topic, slot.external, slot.length, slot.lane);
+    //
+#ifndef MQTT_STATIC_MEMORY
+    free(slot.external);
+#endif
+    slot.external = NULL;
+    ingresstail++;
+    __atomic_fetch_sub(&ingresscount, 1, __ATOMIC_ACQ_REL);
+  }
+  // more than a batch, or a producer between claiming and publishing its slot
+  if (isdrainscheduled || __atomic_load_n(&ingresscount, __ATOMIC_ACQUIRE) == 0) return;
+  //
+  isdrainscheduled = true;
+  tasks->now([] (void* client) -> void {
+    ((MQTTClient*) client)->isdrainscheduled = false;
+    ((MQTTClient*) client)->drainIngress();
+  }, this);
+}
+
+void MQTTClient::cork(unsigned long latency, size_t threshold) {
+  corked = true;
+  corklatency = latency;
+  corkthreshold = threshold < OUTPUT_BUFFER_SIZE ? threshold : OUTPUT_BUFFER_SIZE;
+}
+
+void MQTTClient::uncork() {
+  corked = false;
+  flushOutput();
+}
+
+void MQTTClient::setQueueBudget(size_t bytes, uint8_t policy) {
+  queuestats.budget = bytes;
+  queuepolicy = policy;
+}
+
+bool MQTTClient::replacePublishPacket(uint8_t topic, const uint8_t* payload, size_t length) {
+  for (int i = 0; i < PUBLISH_LANES; i++) {
+    for (PublishPacket* packet = lanes[i].head; packet; packet = packet->next) {
+      // a packet already sent may be on its way to the broker, it keeps its payload
+      if (packet->trycount > 0 || !packet->retain || packet->topic != topic || packet->source) continue;
+      //
+      if (queuestats.budget > 0 && queuestats.bytes - costOf(packet->payloadlength) + costOf(length) > queuestats.budget) return false;
+      //
+      char* copy = packet->payload; // a pooled payload has room for any length publishHandle() accepts
+#ifndef MQTT_STATIC_MEMORY
+      if (!pooled) copy = (char*) malloc(length + 1);
+      //
+      if (!copy) return false;
+      //
+      if (!pooled) free(packet->payload);
+#endif
+      //
+      memcpy(copy, payload, length);
+      copy[length] = (char) 0;
+      queuestats.bytes += costOf(length);
+      queuestats.bytes -= costOf(packet->payloadlength);
+      packet->payload = copy;
+      packet->payloadlength = length;
+      queuestats.replaced++;
+      //
+      return true;
+    }
+  }
+  //
+  return false;
+}
+
+bool MQTTClient::dropOldestPublishPacket() {
+  for (int i = PUBLISH_LANES - 1; i >= 0; i--) {
+    PublishPacket* oldest = NULL;
+    // packets in flight are ordered by deadline, not by age; the one being streamed is on the wire
+    for (PublishPacket* packet = lanes[i].inflight; packet; packet = packet->next) {
+      if (packet != streaming && (!oldest || (long) (packet->enqueued - oldest->enqueued) < 0)) oldest = packet;
+    }
+    //
+    PublishPacket* head = streaming && lanes[i].head == streaming ? streaming->next : lanes[i].head;
+    //
+    if (head && (!oldest || (long) (head->enqueued - oldest->enqueued) < 0)) oldest = head;
+    //
+    if (oldest) {
+      removePublishPacket(oldest->packetid);
+      queuestats.droppedoldest++;
+      beginStats();
+      stats.discards++;
+      endStats();
+      //
+      return true;
+    }
+  }
+  //
+  return false;
+}
+
+void MQTTClient::freePublishPacket(PublishPacket* packet) {
+  queuestats.bytes -= costOf(packet);
+  releaseTopic(packet->topic);
+  //
+  if (pooled) {
+    packet->next = freepackets;
+    freepackets = packet;
+    //
+    return;
+  }
+  //
+#ifndef MQTT_STATIC_MEMORY
+  free(packet->payload); // NULL if streamed
+  delete packet;
+#endif
+}
+
+static const unsigned long latencybounds[LATENCY_BUCKETS - 1] = { 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000 };
+
+void MQTTClient::countAcknowledgement(unsigned long latency) {
+  uint8_t bucket = 0;
+  //
+  while (bucket < LATENCY_BUCKETS - 1 && latency > latencybounds[bucket]) bucket++;
+  //
+  beginStats();
+  stats.acks++;
+  stats.latency[bucket]++;
+  endStats();
+  //
+  if (observer) observer(observercontext, OBSERVE_ACKNOWLEDGED, latency);
+}
+
+unsigned long MQTTClient::getLatencyBound(uint8_t bucket) {
+  return bucket < LATENCY_BUCKETS - 1 ? latencybounds[bucket] : (unsigned long) -1;
+}
+
+// may be called from another task or an interrupt, retries a bounded number of times while the scheduler writes:
+// an interrupt on the core of the scheduler would wait forever for a write it preempted
+bool MQTTClient::getStats(MQTTClientStats& snapshot) const {
+  for (int i = 0; i < STATS_READ_TRIES; i++) {
+    unsigned long version = statsversion;
+    __sync_synchronize();
+    //
+    if (version & 1) continue;
+    //
+    memcpy(&snapshot, (const void*) &stats, sizeof snapshot);
+    __sync_synchronize();
+    //
+    if (version == statsversion) return true;
+  }
+  //
+  return false;
+}
+
+size_t MQTTClient::formatStats(char* buffer, size_t size) const {
+  MQTTClientStats snapshot;
+  //
+  if (!getStats(snapshot)) return 0;
+  //
+  int len = snprintf(buffer, size, "{\"publishes\":%lu,\"bytes\":%lu,\"acks\":%lu,\"retries\":%lu,\"discards\":%lu,\"reconnects\":%lu,\"queued\":%u,\"inflight\":%u,\"rtt\":%lu,\"latency\":[",
+                     snapshot.publishes, snapshot.bytes, snapshot.acks, snapshot.retries, snapshot.discards, snapshot.reconnects,
+                     (unsigned int) snapshot.queued, (unsigned int) snapshot.inflight, getRoundTripTime());
+  //
+  for (int i = 0; i < LATENCY_BUCKETS && len > 0 && (size_t) len < size; i++) {
+    len += snprintf(buffer + len, size - len, i > 0 ? ",%lu" : "%lu", snapshot.latency[i]);
+  }
+  //
+  if (len > 0 && (size_t) len < size) len += snprintf(buffer + len, size - len, "]}");
+  //
+  if (len < 0 || (size_t) len >= size) return 0; // truncated
+  //
+  return len;
+}
+
+// an interval of 0 stops publishing, queued packets keep their own handle of the old topic
+bool MQTTClient::publishStatsEvery(unsigned long interval, const char* topicname) {
+  uint8_t topic = acquireTopic(topicname, strlen(topicname), NULL);
+  releaseTopic(statstopic);
+  statstopic = topic;
+  statsinterval = interval;
+  //
+  if (isconnected) schedulePublishStats();
+  //
+  return statstopic != TOPIC_NONE;
+}
+
+void MQTTClient::schedulePublishStats() {
+  if (statstopic == TOPIC_NONE || statsinterval == 0 || isstatsscheduled) return;
+  //
+  isstatsscheduled = true;
+  tasks->after(statsinterval, [] (void* context) -> void {
+    MQTTClient* client = (MQTTClient*) context;
+    client->isstatsscheduled = false;
+    client->publishStats();
+    client->schedulePublishStats();
+  }, this);
+}
+
+void MQTTClient::publishStats() {
+  char buffer[STATS_BUFFER_SIZE];
+  size_t len = formatStats(buffer, sizeof buffer);
+  //
+  if (len > 0) publishHandle(false, statstopic, (const uint8_t*) buffer, len, PUBLISH_LANE_LOW);
+}
+
+void MQTTClient::setStrictPriority() {
+  weighted = false;
+}
+
+void MQTTClient::setWeightedPriority(uint8_t high, uint8_t normal, uint8_t low) {
+  weighted = true;
+  lanes[PUBLISH_LANE_HIGH].weight = high > 0 ? high : 1;
+  lanes[PUBLISH_LANE_NORMAL].weight = normal > 0 ? normal : 1;
+  lanes[PUBLISH_LANE_LOW].weight = low > 0 ? low : 1;
+  //
+  for (int i = 0; i < PUBLISH_LANES; i++) {
+    lanes[i].credit = lanes[i].weight;
+  }
+}
+
+const MQTTLaneStats& MQTTClient::getLaneStats(uint8_t lane) const {
+  return lanes[lane < PUBLISH_LANES ? lane : PUBLISH_LANES - 1].stats;
+}
+
+// 2.3.1 non-zero 16-bit packet ids, none held twice. The counter runs ahead of the queued packets, so after
+// a scan for the nearest id still held, that many are handed out without looking: O(1) amortized.
+uint16_t MQTTClient::allocatePacketId() {
+  while (freeids == 0) {
+    uint16_t nearest = 65535; // steps from nextpacketid to the id, ids are 1 to 65535
+    //
+    for (int i = 0; i < PUBLISH_LANES; i++) {
+      PublishPacket* lists[] = { lanes[i].head, lanes[i].inflight };
+      //
+      for (int k = 0; k < 2; k++) {
+        for (PublishPacket* other = lists[k]; other; other = other->next) {
+          uint16_t steps = (uint16_t) ((other->packetid + 65535 - nextpacketid) % 65535);
+          //
+          if (steps < nearest) nearest = steps;
+        }
+      }
+    }
+    //
+    freeids = nearest;
+    // nextpacketid itself is held, skip it
+    if (freeids == 0) nextpacketid = nextpacketid == 65535 ? 1 : nextpacketid + 1;
+  }
+  //
+  uint16_t packetid = nextpacketid;
+  nextpacketid = nextpacketid == 65535 ? 1 : nextpacketid + 1;
+  freeids--;
+  //
+  return packetid;
+}
+
+void MQTTClient::enqueuePublishPacket(PublishPacket* packet) {
+  logFunc();
+  packet->packetid = allocatePacketId();
+  packet->trycount = 0;
+  packet->enqueued = tasks->millis();
+  packet->next = NULL;
+  // first in, first out within a lane
+  Lane& lane = lanes[packet->lane];
+  //
+  if (lane.tail) {
+    lane.tail->next = packet;
+  } else {
+    lane.head = packet;
+  }
+  //
+  lane.tail = packet;
+  lane.stats.depth++;
+  queuestats.bytes += costOf(packet);
+  beginStats();
+  stats.publishes++;
+  stats.queued++;
+  endStats();
+  //
+  if (lane.stats.depth > lane.stats.maxdepth) lane.stats.maxdepth = lane.stats.depth;
+  //
+  DBG("Number of packet: %u\n", packet->packetid);
+}
+
+void MQTTClient::transmitPublishPacketsAfter(unsigned long duration) {
+  logFunc();
+  tasks->after(duration, [] (void* client) -> void { ((MQTTClient*) client)->transmitPublishPackets(); }, this);
+}
+
+void MQTTClient::transmitPublishPackets() {
+  logFunc();
+  //if the packets have been delivered well, receive the ACKs first
+  // one call to the transport for the burst, every ACK is 4 bytes
+  int acks = isconnected ? available() / 4 : 0;
+  //
+  while (isconnected && acks-- > 0) {
+    DBG("Case1: \n");
+    receivePublishAcknowledgementPacket();
+  }
+  //
+  if (isconnected && !publishAcknowledged()) {
+    unsigned long now = tasks->millis();
+    int l = selectLane(now);
+    //
+    if (l < 0) {
+      // nothing is due, poll for ACKs until the next retry
+      transmitPublishPacketsAfter(untilNextRetry(now));
+      //
+      return;
+    }
+    //
+    Lane& lane = lanes[l];
+    // retries are older than packets never sent, they go first
+    PublishPacket* packet = lane.inflight && now - lane.inflight->lastsent >= lane.inflight->timeout ? lane.inflight : lane.head;
+    //if the packet is in flight for too long, give up to deliver it
+    if (packet->trycount > 0 && now - packet->firstsent >= timetolive) {
+      WARN("discarding packet %u\n", packet->packetid);
+      //
+      queuestats.discarded++;
+      beginStats();
+      stats.discards++;
+      endStats();
+      removePublishPacket(packet->packetid);
+      transmitPublishPacketsAfter(0);
+      //
+      return;
+    }
+    // the chain goes on when the payload is out, other packets wait for it
+    if (packet->source) {
+      streaming = packet;
+      streamoffset = 0;
+      writePublishHeader(packet);
+      streamPublishPacket();
+      //
+      return;
+    }
+    //if the packet has been delivered fail or hasn't delivered, send it and retry after its timeout
+    if (sendPublishPacket(packet)) {
+      DBG("Case3: \n");
+      requeuePublishPacket(lane, packet);
+      transmitPublishPacketsAfter(0);
+      //
+      return;
+    }
+    //
+    ERR("cannot send publish packet\n");
+    //
+    stop();
+  }
+  //
+  istransmitting = false;
+}
+
+void MQTTClient::transmitUrgentPublishPackets() {
+  logFunc();
+  Lane& lane = lanes[PUBLISH_LANE_HIGH];
+  //
+  // send what the high lane has never sent, retries and streamed payloads stay with the chain
+  while (isconnected && !streaming && lane.head && !lane.head->source) {
+    PublishPacket* packet = lane.head;
+    //
+    if (!sendPublishPacket(packet)) {
+      ERR("cannot send publish packet\n");
+      //
+      stop();
+      //
+      return;
+    }
+    //
+    requeuePublishPacket(lane, packet);
+  }
+}
+
+bool MQTTClient::isDue(const Lane& lane, unsigned long now) {
+  if (lane.head) return true;
+  //
+  return lane.inflight && now - lane.inflight->lastsent >= lane.inflight->timeout;
+}
+
+int MQTTClient::selectLane(unsigned long now) {
+  if (!weighted) {
+    for (int i = 0; i < PUBLISH_LANES; i++) {
+      if (isDue(lanes[i], now)) return i;
+    }
+    //
+    return -1;
+  }
+  //
+  // weighted round robin, a lane gets weight packets per round
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < PUBLISH_LANES; i++) {
+      if (isDue(lanes[i], now) && lanes[i].credit > 0) {
+        lanes[i].credit--;
+        //
+        return i;
+      }
+    }
+    //
+    for (int i = 0; i < PUBLISH_LANES; i++) {
+      lanes[i].credit = lanes[i].weight;
+    }
+  }
+  //
+  return -1;
+}
+
+unsigned long MQTTClient::untilNextRetry(unsigned long now) {
+  unsigned long wait = INTERVAL_TO_POLL;
+  //
+  for (int i = 0; i < PUBLISH_LANES; i++) {
+    PublishPacket* packet = lanes[i].inflight;
+    //
+    if (packet && packet->timeout - (now - packet->lastsent) < wait) wait = packet->timeout - (now - packet->lastsent);
+  }
+  //
+  return wait;
+}
+
+// RFC 6298, in integer arithmetic as in Jacobson's paper
+void MQTTClient::sampleRoundTripTime(unsigned long rtt) {
+  if (srtt == 0) {
+    srtt = rtt << 3;
+    rttvar = rtt << 1;
+  } else {
+    long delta = (long) rtt - (srtt >> 3);
+    srtt += delta;
+    //
+    if (delta < 0) delta = -delta;
+    //
+    rttvar += delta - (rttvar >> 2);
+  }
+  //
+  rto = (srtt >> 3) + rttvar;
+  //
+  if (rto < RETRY_MIN) rto = RETRY_MIN;
+  //
+  if (rto > RETRY_MAX) rto = RETRY_MAX;
+}
+
+MQTTClient::PublishPacket* MQTTClient::unlinkPublishPacket(uint16_t packetid) {
+  for (int i = 0; i < PUBLISH_LANES; i++) {
+    Lane& lane = lanes[i];
+    PublishPacket** heads[] = { &lane.head, &lane.inflight };
+    PublishPacket** tails[] = { &lane.tail, &lane.inflighttail };
+    //
+    for (int k = 0; k < 2; k++) {
+      PublishPacket* last = NULL;
+      //
+      for (PublishPacket* packet = *heads[k]; packet; last = packet, packet = packet->next) {
+        if (packet->packetid != packetid) continue;
+        //
+        if (last) {
+          last->next = packet->next;
+        } else {
+          *heads[k] = packet->next;
+        }
+        //
+        if (packet == *tails[k]) *tails[k] = last;
+        //
+        beginStats();
+        stats.queued--;
+        //
+        if (k == 1) stats.inflight--;
+        //
+        endStats();
+        packet->next = NULL;
+        //
+        return packet;
+      }
+    }
+  }
+  //
+  return NULL;
+}
+
+void MQTTClient::removePublishPacket(uint16_t packetid) {
+  logFunc();
+  PublishPacket* packet = unlinkPublishPacket(packetid);
+  //
+  if (packet) {
+    lanes[packet->lane].stats.depth--;
+    freePublishPacket(packet);
+  }
+}
+
+void MQTTClient::requeuePublishPacket(Lane& lane, PublishPacket* packet) {
+  logFunc();
+  // the packet just sent is the head of one of the lists
+  if (packet == lane.head) {
+    lane.head = packet->next;
+    //
+    if (packet == lane.tail) lane.tail = NULL;
+    //
+    beginStats();
+    stats.inflight++;
+    endStats();
+  } else if (packet == lane.inflight) {
+    lane.inflight = packet->next;
+    //
+    if (packet == lane.inflighttail) lane.inflighttail = NULL;
+  }
+  //
+  packet->next = NULL;
+  unsigned long deadline = packet->lastsent + packet->timeout;
+  // most of the time the deadline is the latest one
+  if (!lane.inflighttail || (long) (deadline - (lane.inflighttail->lastsent + lane.inflighttail->timeout)) >= 0) {
+    if (lane.inflighttail) {
+      lane.inflighttail->next = packet;
+    } else {
+      lane.inflight = packet;
+    }
+    //
+    lane.inflighttail = packet;
+    //
+    return;
+  }
+  //
+  PublishPacket* last = NULL;
+  PublishPacket* other = lane.inflight;
+  //
+  while ((long) (deadline - (other->lastsent + other->timeout)) >= 0) {
+    last = other;
+    other = other->next;
+  }
+  //
+  packet->next = other;
+  //
+  if (last) {
+    last->next = packet;
+  } else {
+    lane.inflight = packet;
+  }
+}
+
+bool MQTTClient::sendConnectPacket() {
+  /* msg format:
+  control field: comand type (4 bits) + control flag (4 bits): 1 
+  remaining length: 1
+  length: 2
+  MQTT (name of protocol): 4
+  protocol level: 1
+  connect flag: 1
+  keep alive: 2
+  client id
+  */
+  logFunc();
+  
+  int packetlength = 2 + 4 + 1 + 1 + 2 + 2 + strlen(clientid);
+  //
+  if (username != NULL) packetlength += (2 + strlen(username));
+  //
+  if (password != NULL) packetlength += (2 + strlen(password));
+  //
+  uint8_t connectflags = 2; // clean session
+  //
+  if (username != NULL) connectflags |= 128;
+  //
+  if (password != NULL) connectflags |= 64;
+  //
+  // Type, Flags, Packet Length
+  writeTypeFlags(1, 0); // connect, 0
+  writePacketLength(packetlength);
+  //
+  // Header
+  writeString((const char*) MQTT_CONNECT_PREAMBLE, sizeof MQTT_CONNECT_PREAMBLE); // protocol name and level
+  writeByte(connectflags);
+  writeShort(keepalive);
+  //
+  // Payload
+  writeLengthString(clientid);
+  //
+  if (username != NULL) writeLengthString(username);
+  //
+  if (password != NULL) writeLengthString(password);
+  //
+  flush();
+  DBG("Send connect ok!\n");
+  //
+  return !getWriteError();
+}
+
+/* 
+This is the main task of program
+The program will handle the feedback from Server here and decide what to do next
+ */
+
+// void MQTTClient::receiveConnectAcknowledgementPacket() {
+void MQTTClient::receiveConnectAcknowledgementPacket() {
+  logFunc();
+  connectstate = CONNECT_IDLE;
+
+  uint8_t bytes[4] = { 0 }; // type and flags, packet length, session present, return code
+  bool complete = readBytes(bytes, sizeof bytes);
+  uint8_t returncode = bytes[3];
+  //
+  if (complete && bytes[0] == (2 << 4) && bytes[1] == 2) {
+    switch (returncode) {
+      case 0:
+        INFO("connection accepted\n");
+        isconnected = true;
+        isACKconnected = true;
+        beginStats();
+        //
+        if (wasconnected) stats.reconnects++;
+        //
+        endStats();
+        wasconnected = true;
+        tasks->signal(&connacked);
+        //
+        if (observer) observer(observercontext, OBSERVE_CONNECTED, tasks->millis() - (connectdeadline - CONNECT_TIMEOUT));
+        schedulePublishStats();
+        // stop() cancelled the chain of the last connection, resume what it left queued or in flight
+        if (!istransmitting && !publishAcknowledged()) {
+          istransmitting = true;
+          transmitPublishPacketsAfter(0);
+        }
+        //
+        return;
+      case 1: ERR("unacceptable protocol version\n"); break;
+      case 2: ERR("identifier rejected\n"); break;
+      case 3: ERR("server unavailable\n"); break;
+      case 4: ERR("bad user name or password\n"); break;
+      case 5: ERR("not authorized\n"); break;
+      default: ERR("connection refused: %u\n", returncode); break;
+    }
+  } else {
+    ERR("not a connect acknowledgement\n");
+  }
+  //
+  stop();
+}
+
+bool MQTTClient::sendPublishPacket(PublishPacket* packet) {
+  logFunc();
+  writePublishHeader(packet);
+  //
+  // Payload
+  writeString(packet->payload, packet->payloadlength);
+  //
+  flush();
+  //
+  if (getWriteError()) return false;
+  //
+  countPublishPacket(packet);
+  //
+  return true;
+}
+
+void MQTTClient::writePublishHeader(PublishPacket* packet) {
+  const TopicHandle& topic = topics[packet->topic];
+  size_t topicsize = topic.size;
+  int packetlength = topicsize + 2 + packet->payloadlength;
+  uint8_t flags = 2; // QoS 1
+  //
+  if (packet->trycount > 0) flags |= 8; // duplicate
+  //
+  if (packet->retain) flags |= 1; // check retain flag
+  //
+  if (topicsize <= PUBLISH_HEADER_BUFFER_SIZE) {
+    // copy the pre-encoded topic, patch length and packet id
+    uint8_t header[7 + PUBLISH_HEADER_BUFFER_SIZE];
+    size_t len = mqttPublishHeader(header, flags & 9, topic.bytes, topicsize, packet->packetid, packet->payloadlength);
+    writeString((const char*) header, len);
+  } else {
+    // Type, Flags, Packet Length
+    writeTypeFlags(3, flags); // publish, flags
+    writePacketLength(packetlength);
+    //
+    // Header
+    writeString((const char*) topic.bytes, topicsize);
+    writeShort(packet->packetid);
+  }
+}
+
+// the packet is written out, count it and set its retry deadline
+void MQTTClient::countPublishPacket(PublishPacket* packet) {
+  int packetlength = topics[packet->topic].size + 2 + packet->payloadlength;
+  unsigned long now = tasks->millis();
+  //
+  if (packet->trycount == 0) {
+    MQTTLaneStats& stats = lanes[packet->lane].stats;
+    unsigned long latency = now - packet->enqueued;
+    stats.sent++;
+    stats.totallatency += latency;
+    //
+    if (latency > stats.maxlatency) stats.maxlatency = latency;
+    //
+    packet->firstsent = now;
+  }
+  //
+  beginStats();
+  stats.bytes += 1 + (packetlength < 128 ? 1 : packetlength < 16384 ? 2 : packetlength < 2097152 ? 3 : 4) + packetlength;
+  //
+  if (packet->trycount > 0) stats.retries++;
+  //
+  endStats();
+  //
+  // exponential backoff from the current retransmission timeout
+  packet->timeout = rto;
+  //
+  for (uint16_t i = 0; i < packet->trycount && packet->timeout < RETRY_MAX; i++) {
+    packet->timeout <<= 1;
+  }
+  //
+  if (packet->timeout > RETRY_MAX) packet->timeout = RETRY_MAX;
+  //
+  packet->trycount++;
+  packet->lastsent = now;
+}
+
+// a buffer of the payload per scheduler pass, the header is in output already
+void MQTTClient::streamPublishPacket() {
+  PublishPacket* packet = streaming;
+  //
+  if (outputlength == sizeof output) writeOutput();
+  //
+  size_t size = packet->payloadlength - streamoffset;
+  //
+  if (size > sizeof output - outputlength) size = sizeof output - outputlength;
+  //
+  size_t count = size > 0 ? packet->source(packet->sourcecontext, streamoffset, output + outputlength, size) : 0;
+  //
+  if (count > size) count = 0;
+  //
+  outputlength += count;
+  streamoffset += count;
+  writeOutput();
+  //
+  if ((size > 0 && count == 0) || getWriteError()) {
+    // the packet is cut short, only a new connection puts the broker back in step
+    ERR("cannot stream publish packet %u\n", packet->packetid);
+    streaming = NULL;
+    stop();
+    //
+    return;
+  }
+  //
+  if (streamoffset < packet->payloadlength) {
+    tasks->now([] (void* client) -> void { ((MQTTClient*) client)->streamPublishPacket(); }, this);
+    //
+    return;
+  }
+  //
+  streaming = NULL;
+  flushOutput();
+  //
+  if (getWriteError()) {
+    ERR("cannot send publish packet\n");
+    stop();
+    //
+    return;
+  }
+  //
+  countPublishPacket(packet);
+  requeuePublishPacket(lanes[packet->lane], packet);
+  transmitPublishPacketsAfter(0);
+}
+
+void MQTTClient::receivePublishAcknowledgementPacket() {
+  logFunc();
+
+  uint8_t bytes[4] = { 0 }; // type and flags, packet length, packet id
+  bool complete = readBytes(bytes, sizeof bytes);
+  uint16_t packetid = (bytes[2] << 8) | bytes[3];
+  //
+  if (complete && bytes[0] == (4 << 4) && bytes[1] == 2) {
+    PublishPacket* packet = unlinkPublishPacket(packetid);
+    //
+    if (packet) {
+      // Karn's algorithm: an ACK after a retry is ambiguous
+      if (packet->trycount == 1) sampleRoundTripTime(tasks->millis() - packet->lastsent);
+      //
+      countAcknowledgement(tasks->millis() - packet->enqueued);
+      lanes[packet->lane].stats.depth--;
+      freePublishPacket(packet);
+    }
+    //
+    DBG("publish acknowledged %u\n", packetid);
+    //
+    return;
+  }
+  //
+  ERR("not a publish acknowledgement\n");
+  disconnect();
+}
+
+void MQTTClient::sendDisconnectPacket() {
+  logFunc();
+
+  // Type, Flags, Packet Length
+  writeString((const char*) MQTT_DISCONNECT, sizeof MQTT_DISCONNECT); // disconnect, 0
+  //
+  flush();
+}
+
+void MQTTClient::writeTypeFlags(uint8_t type, uint8_t flags) {
+  writeByte(type << 4 | flags);
+}
+
+void MQTTClient::writePacketLength(int value) {
+  while (true) {
+    int digit = value & 127;
+    value >>= 7;
+    //
+    if (value > 0) {
+      writeByte(digit | 128);
+    } else {
+      writeByte(digit);
+      //
+      break;
+    }
+  }
+}
+
+void MQTTClient::writeLengthString(const char* value) {
+  size_t len = strlen(value);
+  //
+  if (len > 65535) return;
+  //
+  writeShort(len);
+  writeString(value, len);
+}
+
+void MQTTClient::writeString(const char* value, size_t len) {
+  if (outputlength + len > sizeof output) writeOutput();
+  //
+  if (len > sizeof output) {
+    client->write((const uint8_t*) value, len);
+    //
+    return;
+  }
+  //
+  memcpy(output + outputlength, value, len);
+  outputlength += len;
+}
+
+void MQTTClient::writeShort(uint16_t value) {
+  writeByte(value >> 8);
+  writeByte(value & 255);
+}
+
+void MQTTClient::writeByte(uint8_t value) {
+  if (outputlength == sizeof output) writeOutput();
+  //
+  output[outputlength++] = value;
+}
+
+void MQTTClient::writeOutput() {
+  if (outputlength == 0) return;
+  //
+  client->write(output, outputlength);
+  outputlength = 0;
+}
+
+// ends a packet, when corked the write is left to a task at the end of the pass
+void MQTTClient::flush() {
+  if (!corked || outputlength >= corkthreshold) {
+    flushOutput();
+    //
+    return;
+  }
+  //
+  if (isflushscheduled) return;
+  //
+  isflushscheduled = true;
+  tasks->after(corklatency, [] (void* client) -> void { ((MQTTClient*) client)->flushOutput(); }, this, OUTPUT_FLUSH_PRIORITY);
+}
+
+void MQTTClient::flushOutput() {
+  isflushscheduled = false;
+  writeOutput();
+  client->flush();
+  //
+  if (corked && getWriteError()) WARN("corked write failed\n"); // the next sendPublishPacket() sees it too
+}
+
+int MQTTClient::getWriteError() {
+  return client->getWriteError();
+}
+
+int MQTTClient::available() {
+  return client->available();
+}
+
+void MQTTClient::stop() {
+  if (client->connected()) {
+    client->stop();
+    client->clearWriteError();
+  }
+  //
+  isconnected = false;
+  isACKconnected = false;
+  istransmitting = false;
+  connectstate = CONNECT_IDLE;
+  isstatsscheduled = false;
+  outputlength = 0;
+  isflushscheduled = false;
+  streaming = NULL;
+  // the connect steps, the transmit chain, the stats and the flush of this connection
+  tasks->cancelAll(this);
+}
+
+// a packet in one call to the transport, not one per byte
+bool MQTTClient::readBytes(uint8_t* value, size_t len) {
+  return client->read(value, len) == (int) len;
+}
+
+char* MQTTClient::copyString(const char* string) {
+  if (string == NULL) return NULL;
+  //
+#ifdef MQTT_STATIC_MEMORY
+  size_t length = strlen(string) + 1;
+  //
+  if (length > MQTT_STRINGS_SIZE - stringslength) {
+    error = MQTT_ERROR_STRINGS;
+    ERR("host, client id, user name and password too long\n");
+    //
+    return NULL;
+  }
+  //
+  char* copy = strings + stringslength;
+  memcpy(copy, string, length);
+  stringslength += length;
+#else
+  char* copy = strdup(string);
+  //
+  if (!copy) error = MQTT_ERROR_NO_MEMORY;
+#endif
+  //
+  return copy;
+}
+
+void MQTTClient::printFootprint(Print& out) const {
+  char line[96];
+  snprintf(line, sizeof line, "mqtt client %u bytes", (unsigned int) footprint);
+  out.println(line);
+  //
+  if (pooled) {
+    snprintf(line, sizeof line, "  %d packets of %u bytes, payloads up to %u bytes", poolsize, (unsigned int) ((footprint - sizeof(MQTTClient)) / poolsize), (unsigned int) payloadcapacity);
+    out.println(line);
+  }
+  //
+  snprintf(line, sizeof line, "  output buffer %u bytes, %u topic handles", (unsigned int) OUTPUT_BUFFER_SIZE, (unsigned int) TOPIC_HANDLES);
+  out.println(line);
+#ifdef MQTT_STATIC_MEMORY
+  snprintf(line, sizeof line, "  strings %u of %u bytes, topic names %u bytes", (unsigned int) stringslength, (unsigned int) MQTT_STRINGS_SIZE, (unsigned int) sizeof topicnames);
+  out.println(line);
+  snprintf(line, sizeof line, "  ingress %u bytes, passed to beginIngress()", (unsigned int) sizeof(Ingress));
+  out.println(line);
+#else
+  // the queue counts payloads plus bookkeeping
+  snprintf(line, sizeof line, "  heap %u bytes of queued packets, more for strings and topic names", pooled ? 0 : (unsigned int) queuestats.bytes);
+  out.println(line);
+#endif
+}
+
+//Subcribe here
+// SubscribePacket* MQTTClient::SubcribeReceiveHandle() {
+//     uint8_t firstbyte = readByte();//doc byte dau tien
+//     uint8_t flags = firstbyte & 15;//0b1111
+//     uint8_t type = firstbyte >> 4;//
+//     size_t length = readPacketLength();
+//     //check the control header (cmd type + ctrl flag)
+//     switch (type) {
+//         //handle sub here
+//         case 9: //Subcribe ack (S-C)
+//         {
+//             if (length == 3) {
+//                 uint16_t packetid = readShort();
+//                 uint8_t returncode = readByte();
+//                 //
+//                 if (isReadComplete()) return new SubscribeAcknowledgement(flags, type, packetid, returncode);
+//             }
+//             //
+//             break;
+//         }
+//     }
+//     //
+//     while (length > 0) {
+//         readByte();
+//         length--;
+//     }
+//     //
+//     return nullptr;
+// }
+
+// bool MQTTClient::sendSubscribeRequest(const char topicfilter[], uint8_t qos) {
+//     packetid++;
+//     //
+//     if (packetid == 0) packetid = 1;
+//     //
+//     size_t packetlength = 2 + 2 + strlen(topicfilter) + 1;
+//     writeTypeFlags(8, 2);
+//     writePacketLength(packetlength);
+//     writeShort(packetid);
+//     writeLengthString(topicfilter);
+//     writeByte(qos);
+//     flush();
+//     //
+//     return isWriteComplete();
+// }
+
+// size_t MQTTClient::readPacketLength() {
+//     size_t len = 0;
+//     size_t multiplier = 1;
+//     //
+//     while (true) {
+//         uint8_t digit = readByte();
+//         len += (digit & 127) * multiplier;
+//         multiplier <<= 7;
+//         //
+//         if ((digit & 128) == 0) break;
+//     }
+//     //
+//     return len;
+// }
+
+// //this is polling
+// //read all msg from server
+// char* MQTTClient::readString(size_t len) {
+//     char* str = new char[len + 1];
+//     //
+//     if (str) {
+//         for (size_t i = 0; i < len; i++) {
+//             str[i] = (char) readByte();
+//         }
+//         //
+//         str[len] = (char) 0;
+//     }
+//     //
+//     return str;
+// }
+
+/*
+ *
+ */
+
+MQTTTopic::MQTTTopic(MQTTClient* _client, const char* _topicname) : MQTTTopic(_client, _topicname, strlen(_topicname), NULL) {
+}
+
+MQTTTopic::MQTTTopic(MQTTClient* _client, const char* topicname, size_t length, const uint8_t* image) {
+  client = _client;
+  topic = client->acquireTopic(topicname, length, image);
+  //
+  retain = false;
+  lane = PUBLISH_LANE_NORMAL;
+  batch = NULL;
+  ownsbatch = false;
+  batchsize = 0;
+  batchlength = 0;
+  window = 0;
+  since = 0;
+  flushtask = 0;
+}
+
+MQTTTopic::~MQTTTopic() {
+  if (batch) {
+    // the batch cannot wait any longer
+    if (!flush()) {
+      client->beginStats();
+      client->stats.discards++;
+      client->endStats();
+    }
+    //
+    client->tasks->cancel(flushtask);
+    //
+#ifndef MQTT_STATIC_MEMORY
+    if (ownsbatch) free(batch);
+#endif
+    batch = NULL;
+  }
+  //
+  client->releaseTopic(topic);
+  topic = TOPIC_NONE;
+}
+
+#ifndef MQTT_STATIC_MEMORY
+bool MQTTTopic::coalesce(unsigned long _window, size_t maxbytes) {
+  if (batch || maxbytes < 2) return false; // already coalescing, or no room for a record
+  //
+  uint8_t* buffer = (uint8_t*) malloc(maxbytes);
+  //
+  if (!buffer) {
+    ERR("cannot allocate coalescing buffer\n");
+    //
+    return false;
+  }
+  //
+  coalesce(_window, buffer, maxbytes);
+  ownsbatch = true;
+  //
+  return true;
+}
+#endif
+
+bool MQTTTopic::coalesce(unsigned long _window, uint8_t* buffer, size_t size) {
+  if (batch || !buffer || size < 2) return false;
+  //
+  batch = buffer;
+  ownsbatch = false;
+  batchsize = size;
+  batchlength = 0;
+  window = _window;
+  //
+  return true;
+}
+
+bool MQTTTopic::publish(const char* payload, bool _retain) {
+  return publish((const uint8_t*) payload, strlen(payload), _retain);
+}
+
+bool MQTTTopic::publish(const uint8_t* payload, size_t length, bool _retain) {
+  if (!batch) return client->publishHandle(_retain, topic, payload, length, lane);
+  //
+  // a batch carries one retain flag
+  if (batchlength > 0 && retain != _retain && !flush()) return false;
+  //
+  if (!append(payload, length)) {
+    if (!flush()) return false;
+    //
+    // unframed records would confuse the reader
+    if (!append(payload, length)) {
+      client->error = MQTT_ERROR_PAYLOAD_SIZE;
+      WARN("record larger than the coalescing buffer\n");
+      //
+      return false;
+    }
+  }
+  //
+  retain = _retain;
+  // the record is taken, a refused batch is tried again when the window is over
+  if (batchlength >= batchsize) flush();
+  //
+  return true;
+}
+
+bool MQTTTopic::append(const uint8_t* payload, size_t length) {
+  uint8_t prefix[4];
+  size_t prefixlength = 0;
+  size_t value = length;
+  //
+  do {
+    uint8_t digit = value & 127;
+    value >>= 7;
+    //
+    if (value > 0) digit |= 128;
+    //
+    prefix[prefixlength++] = digit;
+  } while (value > 0 && prefixlength < sizeof prefix);
+  //
+  if (value > 0 || batchlength + prefixlength + length > batchsize) return false;
+  //
+  if (batchlength == 0) {
+    since = client->tasks->millis();
+    scheduleFlush(window);
+  }
+  //
+  memcpy(batch + batchlength, prefix, prefixlength);
+  batchlength += prefixlength;
+  memcpy(batch + batchlength, payload, length);
+  batchlength += length;
+  //
+  return true;
+}
+
+bool MQTTTopic::submit(const uint8_t* payload, size_t length, bool _retain) {
+  return client->submit(topic, _retain, payload, length, lane);
+}
+
+bool MQTTTopic::flush() {
+  if (!batch || batchlength == 0) return true;
+  //
+  // a refused batch stays, e.g. while the queue is full
+  if (!client->publishHandle(retain, topic, batch, batchlength, lane)) return false;
+  //
+  batchlength = 0;
+  //
+  return true;
+}
+
+// a task still pending from a batch flushed early serves the next batch too
+void MQTTTopic::scheduleFlush(unsigned long duration) {
+  if (client->tasks->isScheduled(flushtask)) return;
+  //
+  flushtask = client->tasks->after(duration, [] (void* topic) -> void { ((MQTTTopic*) topic)->flushExpired(); }, this);
+}
+
+void MQTTTopic::flushExpired() {
+  if (batchlength == 0) return;
+  //
+  unsigned long age = client->tasks->millis() - since;
+  //
+  if (age >= window && flush()) return;
+  // the scheduler ticks every 2 ms, so the window may not be over yet; a refused batch waits another window
+  scheduleFlush(age < window ? window - age : window);
+}
+
+/*
+ *
+ */
+
+bool MQTTCoalescedReader::next(const uint8_t** record, size_t* recordlength) {
+  if (malformed || offset >= length) return false;
+  //
+  size_t value = 0;
+  size_t multiplier = 1;
+  //
+  for (int i = 0; i < 4; i++) {
+    if (offset >= length) break;
+    //
+    uint8_t digit = payload[offset++];
+    value += (digit & 127) * multiplier;
+    multiplier <<= 7;
+    //
+    if ((digit & 128) == 0) {
+      if (value > length - offset) break;
+      //
+      *record = payload + offset;
+      *recordlength = value;
+      offset += value;
+      //
+      return true;
+    }
+  }
+  //
+  malformed = true;
+  //
+  return false;
 }
\ No newline at end of file
@@ -1,131 +1,440 @@
-/*
- * Copyright (C) 2018 Andreas Motzek andreas-motzek@t-online.de
- *
- * This file is part of the MQTT Client package.
- *
- * You can use, redistribute and/or modify this file under the terms of the Modified Artistic License.
- * See http://simplysomethings.de/open+source/modified+artistic+license.html for details.
- *
- * This file is distributed in the hope that it will be useful, but without any warranty; without even
- * the implied warranty of merchantability or fitness for a particular purpose.
- */
-
-#ifndef MQTTClient_h
-#define MQTTClient_h
-
-#include "Client.h"
-#include "Multitasking.h"
-
-#define INTERVAL_TO_RETRY 1000
-#define SUB_BUFFER_SIZE 256
-#define TRY_TIME 10
-// bao gom client co ban + cac thuoc tinh cua MQTT
-class MQTTClient {
-  friend class MQTTTopic;
-
-  private:
-  // this is single linked list
-    struct PublishPacket {
-      bool retain;
-      const char* topicname;
-      char* payload;
-      uint16_t packetid;
-      uint16_t trycount;//so lan thu
-      PublishPacket* next;
-    };
-
-    //DungTT: add new here
-    //define scribe max = 2 topics
-    struct SubscribePacket {
-      bool retain;
-      uint8_t qos;
-      const char* topicname;
-      char buffer[SUB_BUFFER_SIZE];
-      char* payload;
-      uint16_t packetid;
-      uint16_t trycount;//so lan thu
-      SubscribePacket* next;
-    };
-
-    static MQTTClient* current;//con tro noi bo de kiem soat
-
-    CooperativeMultitasking* tasks;
-    Client* client;//client defined by ESP32 lib
-    char* host;
-    uint16_t port;
-    char* clientid;
-    char* username;
-    char* password;
-    uint16_t keepalive;
-    bool isconnected;
-    bool isACKconnected;//DungTT
-    PublishPacket* head;
-    PublishPacket* tail;
-
-    //Publish methods
-    void enqueuePublishPacket(PublishPacket* packet);
-    void transmitPublishPacketsAfter(unsigned long duration);
-    void transmitPublishPackets();
-    void removePublishPacket(uint16_t packetid);
-    void rotatePublishPackets();
-    bool sendHeadPublishPacket();
-    void receivePublishAcknowledgementPacket();
-
-    //DungTT: method for Subscribe
-    void receiveSubscribePacketAfter(unsigned long duration);
-    void receiveSubscribePacket();
-    void removeSubscribePacket(uint16_t packetid);
-    bool sendHeadSubcribePacket();
-    void receiveSubcribeAcknowledgementPacket();
-
-    //connect methods
-    bool sendConnectPacket();
-    void receiveConnectAcknowledgementPacket();
-    void sendDisconnectPacket();
-
-    //utils
-    void writeTypeFlags(uint8_t type, uint8_t flags);
-    void writePacketLength(int value);
-    void writeLengthString(const char* value);
-    void writeString(const char* value, size_t len);
-    void writeShort(uint16_t value);
-    void writeByte(uint8_t value);
-    uint8_t readByte();
-    uint16_t readShort();
-    //DungTT
-    size_t readPacketLength();
-    char* readString(size_t len);
-
-    void flush();
-    int getWriteError();
-    int available();
-    void stop();
-
-    static char* strdupOrNull(const char* string);
-
-  protected:
-    
-
-  public:
-    MQTTClient(CooperativeMultitasking* tasks, Client* client, const char* host, uint16_t port, const char* clientid, const char* username, const char* password, uint16_t keepalive = 300);
-    virtual ~MQTTClient();
-    bool connect();
-    bool connected();
-    bool publishAcknowledged();
-    void disconnect();
-    bool publish(bool retain, const char* topicname, const char* payload);
-};
-
-class MQTTTopic {
-  private:
-    MQTTClient* client;
-    char* topicname;
-    bool retain;
-
-  public:
-    MQTTTopic(MQTTClient* client, const char* topicname);
-    virtual ~MQTTTopic();
-    bool publish(const char* payload, bool retain = true);
-};
-
+/*
+ * Copyright (C) 2018 Andreas Motzek andreas-motzek@t-online.de
+ *
+ * This file is part of the MQTT Client package.
+ *
+ * You can use, redistribute and/or modify this file under the terms of the Modified Artistic License.
+ * See http://simplysomethings.de/open+source/modified+artistic+license.html for details.
+ *
+ * This file is distributed in the hope that it will be useful, but without any warranty; without even
+ * the implied warranty of merchantability or fitness for a particular purpose.
+ */
+
+#ifndef MQTTClient_h
+#define MQTTClient_h
+
+#include "Client.h"
+#include "Multitasking.h"
+#include "MQTTPackets.h"
+
+// #define MQTT_STATIC_MEMORY // no heap, clients are StaticMQTTClient<packets, payload bytes>, see getError()
+
+#define CONNECT_TIMEOUT 10000 // from connect() to the CONNACK, over all steps
+#define INTERVAL_TO_RETRY 1000 // retransmission timeout until the first round trip is measured
+#define RETRY_MIN 200
+#define RETRY_MAX 60000
+#define INTERVAL_TO_POLL 20 // how often ACKs are polled while nothing is due
+#define PUBLISH_TIME_TO_LIVE 60000 // give up on a packet this long after its first transmission
+#define SUB_BUFFER_SIZE 256
+#define COALESCE_BUFFER_SIZE 512
+#define PUBLISH_HEADER_BUFFER_SIZE 64 // pre-encoded topics up to this size go out in one write with the header
+#define TOPIC_HANDLES 16 // registered topics, MQTTTopic instances and topics of queued packets
+#define TOPIC_NONE 255
+#define TOPIC_NAME_SIZE 64 // longest copied topic name with MQTT_STATIC_MEMORY
+#define MQTT_STRINGS_SIZE 128 // host, client id, user name and password with MQTT_STATIC_MEMORY
+#define OUTPUT_BUFFER_SIZE 512 // packets are written to the client from here, larger ones directly
+#define OUTPUT_FLUSH_PRIORITY -128 // a corked flush runs after every other task due at the same time
+#define INGRESS_SIZE 32 // publishes submitted by other threads and not yet drained, power of 2
+#define INGRESS_INLINE_SIZE 48 // larger payloads are copied to the heap by the submitting thread
+#define INGRESS_BATCH 8 // drained per scheduler pass
+#define STATS_READ_TRIES 16 // getStats() gives up after these, e.g. in an interrupt that preempted a writer
+#define PUBLISH_LANES 3 // lane 0 is served first
+#define PUBLISH_LANE_HIGH 0
+#define PUBLISH_LANE_NORMAL 1
+#define PUBLISH_LANE_LOW 2
+
+#define CONNECT_IDLE 0
+#define CONNECT_RESOLVING 1
+#define CONNECT_TCP 2
+#define CONNECT_SENDING 3
+#define CONNECT_WAITING 4 // for the CONNACK
+
+#define QUEUE_DROP_OLDEST 0 // make room by dropping the oldest packet of the lowest lane
+#define QUEUE_DROP_NEWEST 1 // refuse the publish that does not fit
+#define QUEUE_LAST_VALUE 2 // a retained publish replaces an unsent one for the same topic, else drop oldest
+
+// getError(), why the last call failed
+#define MQTT_ERROR_NONE 0
+#define MQTT_ERROR_QUEUE_FULL 1 // the queue budget, or every packet of a StaticMQTTClient, is taken
+#define MQTT_ERROR_PAYLOAD_SIZE 2 // larger than the payloads of a StaticMQTTClient, or than a coalescing buffer
+#define MQTT_ERROR_TOPICS 3 // TOPIC_HANDLES topics are registered, or the name is longer than TOPIC_NAME_SIZE
+#define MQTT_ERROR_STRINGS 4 // host, client id, user name and password are longer than MQTT_STRINGS_SIZE
+#define MQTT_ERROR_NO_MEMORY 5 // the heap is exhausted
+#define MQTT_ERROR_TOPIC_NAME 6 // empty, wildcards or not UTF-8, see mqttIsValidTopicName()
+
+struct MQTTQueueStats {
+  size_t bytes; // payloads plus packet bookkeeping
+  size_t budget; // 0 means unlimited
+  unsigned long droppedoldest;
+  unsigned long droppednewest;
+  unsigned long replaced;
+  unsigned long discarded; // outlived the publish time to live
+};
+
+#define LATENCY_BUCKETS 12 // publish to ACK: <= 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000 ms, more
+#define STATS_BUFFER_SIZE 320
+
+struct MQTTClientStats {
+  unsigned long publishes; // accepted by publish()
+  unsigned long bytes; // PUBLISH packet bytes written, retries included
+  unsigned long acks;
+  unsigned long retries;
+  unsigned long discards; // removed without an ACK: dropped, replaced or outlived
+  unsigned long reconnects; // connections accepted after the first one
+  uint16_t queued; // gauge, packets in all lanes
+  uint16_t inflight; // gauge, packets sent but not acknowledged
+  unsigned long latency[LATENCY_BUCKETS];
+};
+
+struct MQTTLaneStats {
+  uint16_t depth; // packets queued in the lane
+  uint16_t maxdepth;
+  unsigned long sent; // packets transmitted for the first time
+  unsigned long totallatency; // milliseconds from enqueue to first transmission, summed over sent
+  unsigned long maxlatency;
+};
+#define OBSERVE_CONNECTED 0 // duration is from connect() to the CONNACK
+#define OBSERVE_ACKNOWLEDGED 1 // duration is from publish() to the PUBACK
+
+// called on the scheduler, e.g. by a load generator that wants every sample rather than the buckets
+typedef void MQTTObserver(void* context, uint8_t event, unsigned long duration);
+
+// bao gom client co ban + cac thuoc tinh cua MQTT
+class MQTTClient {
+  friend class MQTTTopic;
+  template<int PACKETS, size_t PAYLOAD> friend class StaticMQTTClient;
+
+  private:
+  // this is single linked list
+    struct PublishPacket {
+      bool retain;
+      uint8_t topic; // handle in topics[]
+      char* payload;
+      size_t payloadlength;
+      uint16_t packetid;
+      uint16_t trycount;//so lan thu
+      uint8_t lane;
+      unsigned long enqueued; // millis() at enqueue, for the queueing latency
+      unsigned long firstsent;
+      unsigned long lastsent;
+      unsigned long timeout; // retry when lastsent + timeout has passed
+      MQTTPayloadSource* source; // the payload is pulled from here while it is written, payload is NULL
+      void* sourcecontext;
+      PublishPacket* next;
+    };
+
+    // a registered topic, length-prefixed as it goes on the wire, shared by refs MQTTTopics and packets
+    struct TopicHandle {
+      const uint8_t* bytes;
+      uint16_t size;
+      uint16_t refs;
+      bool owned; // bytes were copied, else they are a compile-time MQTTTopicName
+    };
+
+    // every lane holds two single linked lists, served in turn by transmitPublishPackets():
+    // packets never sent in order of publishing, and packets in flight in order of their retry deadline
+    struct Lane {
+      PublishPacket* head;
+      PublishPacket* tail;
+      PublishPacket* inflight;
+      PublishPacket* inflighttail;
+      uint8_t weight;
+      uint8_t credit; // packets left in the current weighted round
+      MQTTLaneStats stats;
+    };
+
+    // a slot holds a publish when its sequence is its position + 1, see submit()
+    struct IngressSlot {
+      uint32_t sequence;
+      uint8_t topic;
+      bool retain;
+      uint8_t lane;
+      size_t length;
+      uint8_t* external; // the payload, if it did not fit inline
+      uint8_t payload[INGRESS_INLINE_SIZE];
+    };
+
+    //DungTT: add new here
+    //define scribe max = 2 topics
+    struct SubscribePacket {
+      bool retain;
+      uint8_t qos;
+      const char* topicname;
+      char buffer[SUB_BUFFER_SIZE];
+      char* payload;
+      uint16_t packetid;
+      uint16_t trycount;//so lan thu
+      SubscribePacket* next;
+    };
+
+    CooperativeMultitasking* tasks;
+    Client* client;//client defined by ESP32 lib
+    char* host;
+    uint16_t port;
+    char* clientid;
+    char* username;
+    char* password;
+    uint16_t keepalive;
+    bool isconnected;
+    bool isACKconnected;//DungTT
+    CooperativeMultitasking::Event connacked; // signalled when the CONNACK is processed, stop() cancels the waiters
+    bool istransmitting; // a transmitPublishPackets() chain is scheduled
+    PublishPacket* streaming; // its payload is being written, nothing else may be until it is out
+    size_t streamoffset;
+    uint8_t connectstate;
+    unsigned long connectdeadline;
+    IPAddress address;
+    bool hasaddress; // from the DNS cache, else the Client resolves host
+    TopicHandle topics[TOPIC_HANDLES];
+    Lane lanes[PUBLISH_LANES];
+    bool weighted; // weighted round robin across lanes instead of strict priority
+    uint8_t queuepolicy;
+    MQTTQueueStats queuestats;
+    long srtt; // smoothed round trip time, scaled by 8
+    long rttvar; // round trip time variation, scaled by 4
+    unsigned long rto; // retransmission timeout
+    unsigned long timetolive;
+    uint16_t nextpacketid; // handed out in order, never 0; queued packets keep theirs over reconnects
+    uint16_t freeids; // ids from nextpacketid on that no queued packet holds, see allocatePacketId()
+    // the stats are written by the scheduler only, getStats() is a sequence lock reader
+    MQTTClientStats stats;
+    volatile unsigned long statsversion;
+    bool wasconnected;
+    uint8_t statstopic; // handle, TOPIC_NONE while stats are not published
+    unsigned long statsinterval;
+    bool isstatsscheduled;
+    uint8_t output[OUTPUT_BUFFER_SIZE];
+    size_t outputlength;
+    bool corked; // flush() leaves small packets in output until the scheduled flush
+    size_t corkthreshold;
+    unsigned long corklatency;
+    bool isflushscheduled;
+    MQTTObserver* observer;
+    void* observercontext;
+    IngressSlot* ingress; // drained when the scheduler is woken
+    bool ingressowned; // allocated by beginIngress()
+    uint32_t ingresshead; // next position to claim, by producers
+    uint32_t ingresscount; // claimed and not yet drained
+    uint32_t ingresstail; // next position to drain, by the scheduler only
+    unsigned long ingressdropped;
+    bool isdrainscheduled;
+    bool pooled; // packets come from the pool of a StaticMQTTClient, not from the heap
+    PublishPacket* freepackets;
+    int poolsize;
+    size_t payloadcapacity; // of every pooled packet
+    size_t footprint;
+    uint8_t error;
+#ifdef MQTT_STATIC_MEMORY
+    char strings[MQTT_STRINGS_SIZE];
+    size_t stringslength;
+    uint8_t topicnames[TOPIC_HANDLES][TOPIC_NAME_SIZE + 2]; // copies of registered names, length-prefixed
+#endif
+
+    //Publish methods
+    bool publishHandle(bool retain, uint8_t topic, const uint8_t* payload, size_t length, uint8_t lane, MQTTPayloadSource* source = NULL, void* context = NULL);
+    bool submit(uint8_t topic, bool retain, const uint8_t* payload, size_t length, uint8_t lane);
+    bool startIngress(IngressSlot* slots);
+    void drainIngress();
+    uint8_t acquireTopic(const char* topicname, size_t length, const uint8_t* image);
+    void retainTopic(uint8_t topic) { topics[topic].refs++; }
+    void releaseTopic(uint8_t topic);
+    void addPoolPacket(PublishPacket* packet, char* payload);
+    bool hasRoomFor(size_t length) const;
+    PublishPacket* allocatePublishPacket(size_t length, bool copied);
+    uint16_t allocatePacketId();
+    void enqueuePublishPacket(PublishPacket* packet);
+    void transmitPublishPacketsAfter(unsigned long duration);
+    void transmitPublishPackets();
+    void transmitUrgentPublishPackets();
+    int selectLane(unsigned long now);
+    static bool isDue(const Lane& lane, unsigned long now);
+    unsigned long untilNextRetry(unsigned long now);
+    void sampleRoundTripTime(unsigned long rtt);
+    PublishPacket* unlinkPublishPacket(uint16_t packetid);
+    void removePublishPacket(uint16_t packetid);
+    bool replacePublishPacket(uint8_t topic, const uint8_t* payload, size_t length);
+    bool dropOldestPublishPacket();
+    void freePublishPacket(PublishPacket* packet);
+    void beginStats() { statsversion++; __sync_synchronize(); }
+    void endStats() { __sync_synchronize(); statsversion++; }
+    void countAcknowledgement(unsigned long latency);
+    void schedulePublishStats();
+    void publishStats();
+    static size_t costOf(size_t payloadlength) { return sizeof(PublishPacket) + payloadlength + 1; }
+    static size_t costOf(const PublishPacket* packet) { return packet->source ? sizeof(PublishPacket) : costOf(packet->payloadlength); }
+    void requeuePublishPacket(Lane& lane, PublishPacket* packet);
+    bool sendPublishPacket(PublishPacket* packet);
+    void writePublishHeader(PublishPacket* packet);
+    void countPublishPacket(PublishPacket* packet);
+    void streamPublishPacket();
+    void receivePublishAcknowledgementPacket();
+
+    //DungTT: method for Subscribe
+    void receiveSubscribePacketAfter(unsigned long duration);
+    void receiveSubscribePacket();
+    void removeSubscribePacket(uint16_t packetid);
+    bool sendHeadSubcribePacket();
+    void receiveSubcribeAcknowledgementPacket();
+
+    //connect methods
+    void stepConnect();
+    void awaitConnectAcknowledgement();
+    void expireConnect();
+    bool sendConnectPacket();
+    void receiveConnectAcknowledgementPacket();
+    void sendDisconnectPacket();
+
+    //utils
+    void writeTypeFlags(uint8_t type, uint8_t flags);
+    void writePacketLength(int value);
+    void writeLengthString(const char* value);
+    void writeString(const char* value, size_t len);
+    void writeShort(uint16_t value);
+    void writeByte(uint8_t value);
+    bool readBytes(uint8_t* value, size_t len);
+    //DungTT
+    size_t readPacketLength();
+    char* readString(size_t len);
+
+    void flush();
+    void flushOutput();
+    void writeOutput();
+    int getWriteError();
+    int available();
+    void stop();
+
+    char* copyString(const char* string);
+
+  protected:
+#ifdef MQTT_STATIC_MEMORY
+    MQTTClient(CooperativeMultitasking* tasks, Client* client, const char* host, uint16_t port, const char* clientid, const char* username, const char* password, uint16_t keepalive = 300);
+#endif
+
+  public:
+#ifndef MQTT_STATIC_MEMORY
+    MQTTClient(CooperativeMultitasking* tasks, Client* client, const char* host, uint16_t port, const char* clientid, const char* username, const char* password, uint16_t keepalive = 300);
+#endif
+    virtual ~MQTTClient();
+    bool connect(); // starts connecting, see connected() and connecting()
+    bool connected();
+    bool connecting() const { return connectstate != CONNECT_IDLE; }
+    bool publishAcknowledged();
+    void disconnect();
+    bool publish(bool retain, const char* topicname, const char* payload, uint8_t lane = PUBLISH_LANE_NORMAL);
+    bool publish(bool retain, const char* topicname, const uint8_t* payload, size_t length, uint8_t lane = PUBLISH_LANE_NORMAL);
+    // length bytes pulled from source as the packet is written, a buffer per scheduler pass, and again on a retry
+    bool publishFrom(bool retain, const char* topicname, size_t length, MQTTPayloadSource* source, void* context, uint8_t lane = PUBLISH_LANE_NORMAL);
+    void setStrictPriority();
+    void setWeightedPriority(uint8_t high, uint8_t normal, uint8_t low);
+    const MQTTLaneStats& getLaneStats(uint8_t lane) const;
+    void setQueueBudget(size_t bytes, uint8_t policy = QUEUE_DROP_OLDEST);
+    void setPublishTimeToLive(unsigned long duration) { timetolive = duration; }
+    unsigned long getRoundTripTime() const { return srtt >> 3; }
+    unsigned long getRetransmissionTimeout() const { return rto; }
+    bool getStats(MQTTClientStats& snapshot) const; // false if no consistent snapshot could be taken
+    static unsigned long getLatencyBound(uint8_t bucket);
+    bool publishStatsEvery(unsigned long interval, const char* topicname);
+    size_t formatStats(char* buffer, size_t size) const;
+    const MQTTQueueStats& getQueueStats() const { return queuestats; }
+    // packets of one scheduler pass go out in one write, at the latest after latency ms or at threshold bytes
+    void cork(unsigned long latency = 0, size_t threshold = OUTPUT_BUFFER_SIZE / 2);
+    void uncork();
+    void setObserver(MQTTObserver* o, void* context) { observer = o; observercontext = context; }
+    // storage of beginIngress(Ingress*), e.g. static MQTTClient::Ingress ingress;
+    class Ingress {
+      friend class MQTTClient;
+      IngressSlot slots[INGRESS_SIZE];
+    };
+    // call on the scheduler thread before other threads MQTTTopic::submit(), takes one of the scheduler's
+    // COOPERATIVE_MULTITASKING_WAKE_LISTENERS; the storage is used until the client is destroyed
+    bool beginIngress(Ingress* storage);
+#ifndef MQTT_STATIC_MEMORY
+    bool beginIngress();
+#endif
+
+    unsigned long getIngressDropped() const { return __atomic_load_n(&ingressdropped, __ATOMIC_RELAXED); }
+    uint8_t getError() const { return error; } // set when a call fails, see MQTT_ERROR_NONE
+    void clearError() { error = MQTT_ERROR_NONE; }
+    size_t getFootprint() const { return footprint; } // bytes of the instance, the heap it holds is not counted
+    void printFootprint(Print& out) const;
+};
+
+// Every packet and its payload in the instance, StaticMQTTClient<16, 128> queues up to 16 publishes of up to
+// 128 bytes. Queue policy and budget apply as usual when all packets are taken.
+template<int PACKETS, size_t PAYLOAD> class StaticMQTTClient : public MQTTClient {
+  private:
+    struct Slot {
+      PublishPacket packet;
+      char payload[PAYLOAD + 1]; // zero terminated
+    };
+
+    Slot slots[PACKETS];
+
+  public:
+    StaticMQTTClient(CooperativeMultitasking* tasks, Client* client, const char* host, uint16_t port, const char* clientid, const char* username, const char* password, uint16_t keepalive = 300)
+      : MQTTClient(tasks, client, host, port, clientid, username, password, keepalive) {
+      for (int i = PACKETS - 1; i >= 0; i--) addPoolPacket(&slots[i].packet, slots[i].payload);
+      //
+      payloadcapacity = PAYLOAD;
+      footprint = sizeof(StaticMQTTClient<PACKETS, PAYLOAD>);
+    }
+};
+
+// Coalescing: publishes to a topic within a time or size window are framed into one payload.
+// Every record is prefixed with its length, encoded like the MQTT remaining length.
+class MQTTTopic {
+  private:
+    MQTTClient* client;
+    uint8_t topic; // handle registered with the client, TOPIC_NONE if the registry was full
+    bool retain;
+    uint8_t lane;
+    uint8_t* batch;
+    bool ownsbatch; // allocated by coalesce()
+    size_t batchsize;
+    size_t batchlength;
+    unsigned long window;
+    unsigned long since; // millis() of the client's scheduler at the first record of the batch
+    TaskHandle flushtask; // ends the window, at most one per topic
+
+    MQTTTopic(MQTTClient* client, const char* topicname, size_t length, const uint8_t* image);
+    bool append(const uint8_t* payload, size_t length);
+    void scheduleFlush(unsigned long duration);
+    void flushExpired();
+
+  public:
+    MQTTTopic(MQTTClient* client, const char* topicname);
+    // the name must have static storage: static constexpr auto name = mqttTopicName("dung/alarm");
+    template<size_t N> MQTTTopic(MQTTClient* client, const MQTTTopicName<N>& name) : MQTTTopic(client, (const char*) name.bytes + 2, name.length(), name.bytes) { }
+    virtual ~MQTTTopic();
+    // Records are framed for MQTTCoalescedReader and published together once the window is over or the buffer is
+    // full. A record that does not fit the buffer with its length prefix is refused with MQTT_ERROR_PAYLOAD_SIZE.
+    // A batch the client refuses stays buffered and is tried again a window later.
+#ifndef MQTT_STATIC_MEMORY
+    bool coalesce(unsigned long window, size_t maxbytes = COALESCE_BUFFER_SIZE);
+#endif
+    bool coalesce(unsigned long window, uint8_t* buffer, size_t size); // the buffer is used until the topic is destroyed
+    void setLane(uint8_t l) { lane = l < PUBLISH_LANES ? l : PUBLISH_LANES - 1; }
+    bool publish(const char* payload, bool retain = true);
+    bool publish(const uint8_t* payload, size_t length, bool retain = true);
+    bool flush();
+    // any thread, after MQTTClient::beginIngress(): handed to the scheduler, never coalesced
+    bool submit(const uint8_t* payload, size_t length, bool retain = true);
+    bool submit(const char* payload, bool retain = true) { return submit((const uint8_t*) payload, strlen(payload), retain); }
+    uint8_t getHandle() const { return topic; }
+};
+
+// Walks the records of a coalesced payload, e.g. in a subscriber.
+class MQTTCoalescedReader {
+  private:
+    const uint8_t* payload;
+    size_t length;
+    size_t offset;
+    bool malformed;
+
+  public:
+    MQTTCoalescedReader(const uint8_t* p, size_t l) : payload(p), length(l) { offset = 0; malformed = false; }
+    bool next(const uint8_t** record, size_t* recordlength);
+    bool isMalformed() const { return malformed; }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include <Client.h>
+#include "MQTTCodecBenchmark.h"
+#include "MQTTPackets.h"
+#include "MQTTSocket.h"
+#include "MQTTTransport.h"
+#include "MQTTValidate.h"
+
+// swallows everything, so only the encoding is measured
+class NullClient : public Client {
+    public:
+        size_t bytes = 0;
+
+        int connect(IPAddress, uint16_t) { return 1; }
+        int connect(const char*, uint16_t) { return 1; }
+        size_t write(uint8_t) { bytes++; return 1; }
+        size_t write(const uint8_t*, size_t size) { bytes += size; return size; }
+        int available() { return 0; }
+        int read() { return -1; }
+        int read(uint8_t*, size_t) { return -1; }
+        int peek() { return -1; }
+        void flush() { }
+        void stop() { }
+        uint8_t connected() { return 1; }
+        operator bool() { return true; }
+};
+
+static constexpr auto benchmarktopic = mqttTopicName("dung/benchmark");
+static const char benchmarkpayload[] = "{\"temperature\":21.5}";
+
+// the PUBLISH encoding as it was done before the packet images, one byte at a time
+static size_t encodePublishReference(uint8_t* out, const char* topic, const char* payload, uint16_t packetid) {
+    size_t len = 0;
+    size_t topiclength = strlen(topic);
+    size_t payloadlength = strlen(payload);
+    size_t packetlength = 2 + topiclength + 2 + payloadlength;
+    out[len++] = (3 << 4) | 2;
+    //
+    do {
+        uint8_t digit = packetlength & 127;
+        packetlength >>= 7;
+        //
+        if (packetlength > 0) digit |= 128;
+        //
+        out[len++] = digit;
+    } while (packetlength > 0);
+    //
+    out[len++] = topiclength >> 8;
+    out[len++] = topiclength & 255;
+    //
+    for (size_t i = 0; i < topiclength; i++) out[len++] = topic[i];
+    //
+    out[len++] = packetid >> 8;
+    out[len++] = packetid & 255;
+    //
+    for (size_t i = 0; i < payloadlength; i++) out[len++] = payload[i];
+    //
+    return len;
+}
+
+static size_t encodePublishImage(uint8_t* out, uint16_t packetid) {
+    size_t len = mqttPublishHeader(out, 0, benchmarktopic.bytes, benchmarktopic.size(), packetid, sizeof benchmarkpayload - 1);
+    memcpy(out + len, benchmarkpayload, sizeof benchmarkpayload - 1);
+    //
+    return len + sizeof benchmarkpayload - 1;
+}
+
+static void report(Print& out, const char* name, unsigned long start, unsigned long iterations, size_t bytes) {
+    unsigned long elapsed = micros() - start;
+    out.print(name);
+    out.print(": ");
+    out.print((elapsed * 1000UL) / iterations);
+    out.print(" ns/packet, ");
+    out.print(bytes / iterations);
+    out.println(" bytes/packet");
+}
+
+// encode, write, read back and parse; the socket type decides whether the transport calls are virtual
+template<class Socket> static void roundTrips(Print& out, const char* publishname, const char* ackname, Socket& socket, MQTTLoopback& loopback, unsigned long iterations) {
+    volatile uint8_t keep = 0;
+    size_t bytes = 0;
+    unsigned long start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        socket.sendPublishRequest(benchmarktopic, benchmarkpayload, false, false);
+        bytes += loopback.available();
+        const Packet* packet = socket.receive();
+        //
+        if (packet) keep ^= packet->getType();
+    }
+    //
+    report(out, publishname, start, iterations, bytes);
+    bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        socket.sendPublishAcknowledgement(i);
+        bytes += loopback.available();
+        const Packet* packet = socket.receive();
+        //
+        if (packet) keep ^= packet->getType();
+    }
+    //
+    report(out, ackname, start, iterations, bytes);
+    (void) keep;
+}
+
+void runCodecBenchmark(Print& out, unsigned long iterations) {
+    NullClient sink;
+    MQTTSocket socket(&sink);
+    uint8_t buffer[128];
+    volatile uint8_t keep = 0; // keeps the plain encoders from being optimized away
+    size_t bytes = 0;
+    unsigned long start;
+    //
+    if (iterations == 0) return;
+    //
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        bytes += encodePublishReference(buffer, "dung/benchmark", benchmarkpayload, i);
+        keep ^= buffer[i & 31];
+    }
+    //
+    report(out, "PUBLISH encode, byte at a time", start, iterations, bytes);
+    bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        bytes += encodePublishImage(buffer, i);
+        keep ^= buffer[i & 31];
+    }
+    //
+    report(out, "PUBLISH encode, compile-time topic", start, iterations, bytes);
+    sink.bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        socket.sendPublishRequest("dung/benchmark", benchmarkpayload, false, false);
+    }
+    //
+    report(out, "PUBLISH send, runtime topic", start, iterations, sink.bytes);
+    sink.bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        socket.sendPublishRequest(benchmarktopic, benchmarkpayload, false, false);
+    }
+    //
+    report(out, "PUBLISH send, compile-time topic", start, iterations, sink.bytes);
+    sink.bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        socket.sendPublishAcknowledgement(i);
+    }
+    //
+    report(out, "PUBACK send", start, iterations, sink.bytes);
+    sink.bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        socket.sendPingRequest();
+    }
+    //
+    report(out, "PINGREQ send", start, iterations, sink.bytes);
+    //
+    MQTTLoopback loopback;
+    MQTTSocket erased(&loopback);
+    BasicMQTTSocket<MQTTLoopback> direct(&loopback);
+    roundTrips(out, "PUBLISH round trip, through Client", "PUBACK round trip, through Client", erased, loopback, iterations);
+    roundTrips(out, "PUBLISH round trip, MQTTLoopback inlined", "PUBACK round trip, MQTTLoopback inlined", direct, loopback, iterations);
+    bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        keep ^= mqttIsValidUtf8((const uint8_t*) benchmarkpayload, sizeof benchmarkpayload - 1);
+        bytes += sizeof benchmarkpayload - 1;
+    }
+    //
+    report(out, "payload UTF-8 check", start, iterations, bytes);
+    bytes = 0;
+    start = micros();
+    //
+    for (unsigned long i = 0; i < iterations; i++) {
+        memcpy(buffer, benchmarkpayload, sizeof benchmarkpayload - 1);
+        keep ^= buffer[i & 15];
+        bytes += sizeof benchmarkpayload - 1;
+    }
+    //
+    report(out, "payload memcpy", start, iterations, bytes);
+    (void) keep;
+}
@@ -0,0 +1,13 @@
+/*
+@Brief : codec micro-benchmark, nanoseconds per packet for the runtime and the compile-time packet paths,
+          and for a socket through Client against one over a concrete transport
+ */
+
+#ifndef MQTTCodecBenchmark_h
+#define MQTTCodecBenchmark_h
+
+#include <Arduino.h>
+
+void runCodecBenchmark(Print& out, unsigned long iterations);
+
+#endif
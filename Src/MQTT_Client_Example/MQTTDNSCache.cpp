@@ -0,0 +1,76 @@
+#include "MQTTDNSCache.h"
+
+struct DNSCacheEntry {
+  char host[DNS_HOST_SIZE]; // empty if the entry is free
+  IPAddress address;
+  unsigned long resolved; // millis() of the caller's clock
+};
+
+static HostResolver* resolver = NULL;
+static unsigned long timetolive = DNS_CACHE_TTL;
+static DNSCacheEntry entries[DNS_CACHE_SIZE];
+
+void mqttSetResolver(HostResolver* _resolver, unsigned long ttl) {
+  resolver = _resolver;
+  timetolive = ttl;
+}
+
+static DNSCacheEntry* find(const char* host) {
+  for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+    if (entries[i].host[0] && strcmp(entries[i].host, host) == 0) return &entries[i];
+  }
+  //
+  return NULL;
+}
+
+bool mqttResolve(const char* host, IPAddress& address, unsigned long now) {
+  if (!resolver) return false;
+  //
+  DNSCacheEntry* entry = find(host);
+  //
+  if (entry && now - entry->resolved < timetolive) {
+    address = entry->address;
+    //
+    return true;
+  }
+  //
+  if (!resolver(host, address)) {
+    // an expired address is better than none on a bad link
+    if (!entry) return false;
+    //
+    address = entry->address;
+    //
+    return true;
+  }
+  //
+  if (!entry) {
+    if (strlen(host) >= DNS_HOST_SIZE) return true; // resolved, just not cached
+    //
+    entry = &entries[0];
+    // a free entry, or the one resolved longest ago
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+      if (!entries[i].host[0]) {
+        entry = &entries[i];
+        //
+        break;
+      }
+      //
+      if (now - entries[i].resolved > now - entry->resolved) entry = &entries[i];
+    }
+    //
+    strcpy(entry->host, host);
+  }
+  //
+  entry->address = address;
+  entry->resolved = now;
+  //
+  return true;
+}
+
+void mqttForgetHost(const char* host) {
+  DNSCacheEntry* entry = find(host);
+  //
+  if (!entry) return;
+  //
+  entry->host[0] = 0;
+}
@@ -0,0 +1,25 @@
+/*
+@Brief : cached host name resolution for MQTTClient and MQTTSocket
+ */
+
+#ifndef MQTTDNSCache_h
+#define MQTTDNSCache_h
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+#define DNS_CACHE_SIZE 4
+#define DNS_CACHE_TTL 300000 // hostByName() does not tell the record's TTL
+#define DNS_HOST_SIZE 64 // longer names are resolved every time
+
+// e.g. [] (const char* host, IPAddress& address) -> bool { return WiFi.hostByName(host, address) == 1; }
+typedef bool HostResolver(const char* host, IPAddress& address);
+
+void mqttSetResolver(HostResolver* resolver, unsigned long ttl = DNS_CACHE_TTL);
+// false without a resolver, then the Client resolves the name itself; now is millis() of the caller's clock,
+// e.g. tasks->millis(), so entries expire in virtual time too
+bool mqttResolve(const char* host, IPAddress& address, unsigned long now);
+// after a failed connect, the next one resolves again
+void mqttForgetHost(const char* host);
+
+#endif
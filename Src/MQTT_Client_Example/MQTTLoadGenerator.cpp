@@ -0,0 +1,222 @@
+#include "MQTTLoadGenerator.h"
+#include "MQTTClient.h"
+#include "MQTTSimulation.h"
+
+// a host tool, it sizes the scheduler and creates the clients at run time
+#if !defined(MQTT_STATIC_MEMORY) && !defined(COOPERATIVE_MULTITASKING_STATIC)
+
+// log-linear, relative error under 12.5%, so p999 over thousands of devices costs 1 KB
+struct LoadHistogram {
+  unsigned long counts[LOAD_HISTOGRAM_BUCKETS];
+  unsigned long total;
+  unsigned long max;
+};
+
+struct LoadRun {
+  CooperativeMultitasking* tasks;
+  const MQTTLoadProfile* profile;
+  uint8_t* payload;
+  LoadHistogram connects;
+  LoadHistogram acks;
+};
+
+struct LoadDevice {
+  LoadRun* run;
+  MQTTClient* client;
+  Client* transport;
+  char clientid[16];
+  char topic[LOAD_TOPIC_SIZE];
+};
+
+static int bucketOf(unsigned long value) {
+  if (value < 16) return value;
+  //
+  int exponent = 4;
+  //
+  while (exponent < 31 && (value >> (exponent + 1)) > 0) exponent++;
+  //
+  return 16 + (exponent - 4) * 8 + ((value >> (exponent - 3)) & 7);
+}
+
+// the largest value counted in the bucket
+static unsigned long boundOf(int bucket) {
+  if (bucket < 16) return bucket;
+  //
+  int exponent = 4 + (bucket - 16) / 8;
+  unsigned long lower = (unsigned long) (8 + (bucket - 16) % 8) << (exponent - 3);
+  //
+  return lower + ((1UL << (exponent - 3)) - 1);
+}
+
+static void count(LoadHistogram& histogram, unsigned long value) {
+  histogram.counts[bucketOf(value)]++;
+  histogram.total++;
+  //
+  if (value > histogram.max) histogram.max = value;
+}
+
+static unsigned long percentile(const LoadHistogram& histogram, unsigned long permille) {
+  if (histogram.total == 0) return 0;
+  //
+  unsigned long rank = (histogram.total * permille + 999) / 1000;
+  unsigned long seen = 0;
+  //
+  for (int i = 0; i < LOAD_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram.counts[i];
+    //
+    if (seen >= rank) return boundOf(i) < histogram.max ? boundOf(i) : histogram.max;
+  }
+  //
+  return histogram.max;
+}
+
+static void summarize(const LoadHistogram& histogram, MQTTLoadPercentiles& percentiles) {
+  percentiles.p50 = percentile(histogram, 500);
+  percentiles.p99 = percentile(histogram, 990);
+  percentiles.p999 = percentile(histogram, 999);
+  percentiles.max = histogram.max;
+  percentiles.count = histogram.total;
+}
+
+// the pattern becomes a format string, so a single %u is all it may convert
+static bool isTopicPattern(const char* pattern) {
+  const char* conversion = strchr(pattern, '%');
+  //
+  return !conversion || (conversion[1] == 'u' && !strchr(conversion + 2, '%'));
+}
+
+static void observeDevice(void* context, uint8_t event, unsigned long duration) {
+  LoadRun* run = (LoadRun*) context;
+  //
+  if (event == OBSERVE_CONNECTED) count(run->connects, duration);
+  else if (event == OBSERVE_ACKNOWLEDGED) count(run->acks, duration);
+}
+
+// open loop: a device publishes on its interval whether or not earlier publishes were acknowledged
+static void tickDevice(void* context) {
+  LoadDevice* device = (LoadDevice*) context;
+  LoadRun* run = device->run;
+  //
+  if (device->client->connected()) device->client->publish(false, device->topic, run->payload, run->profile->payloadsize);
+  else if (!device->client->connecting()) device->client->connect();
+  //
+  run->tasks->after(run->profile->interval, tickDevice, device);
+}
+
+bool runLoadGenerator(const MQTTLoadProfile& profile, MQTTLoadReport& report, MQTTLoadTransport* transport) {
+  memset(&report, 0, sizeof report);
+  //
+  if (profile.devices == 0 || profile.devices > LOAD_MAX_DEVICES || !profile.topic || !isTopicPattern(profile.topic) || profile.interval == 0) return false;
+  //
+  if (profile.host && !transport) return false;
+  //
+  VirtualClock clock;
+  CooperativeMultitasking tasks(profile.devices * LOAD_TASKS_PER_DEVICE + 16);
+  //
+  if (!profile.host) tasks.setClock(&clock);
+  //
+  LoadRun* run = new LoadRun(); // std::nothrow is default
+  LoadDevice* devices = new LoadDevice[profile.devices];
+  uint8_t* payload = (uint8_t*) malloc(profile.payloadsize > 0 ? profile.payloadsize : 1);
+  //
+  if (!run || !devices || !payload) {
+    delete run;
+    delete[] devices;
+    free(payload);
+    //
+    return false;
+  }
+  //
+  memset(run, 0, sizeof(LoadRun));
+  run->tasks = &tasks;
+  run->profile = &profile;
+  run->payload = payload;
+  //
+  for (size_t i = 0; i < profile.payloadsize; i++) payload[i] = 'a' + i % 26;
+  //
+  for (uint16_t i = 0; i < profile.devices; i++) {
+    LoadDevice& device = devices[i];
+    device.run = run;
+    snprintf(device.clientid, sizeof device.clientid, "load-%u", i);
+    snprintf(device.topic, sizeof device.topic, profile.topic, i);
+    //
+    if (profile.host) {
+      device.transport = transport(i);
+    } else {
+      MQTTSimulatedBroker* broker = new MQTTSimulatedBroker(&clock, i + 1);
+      broker->setLatency(profile.latency);
+      broker->setLoss(profile.loss);
+      device.transport = broker;
+    }
+    //
+    device.client = new MQTTClient(&tasks, device.transport, profile.host ? profile.host : "simulated", profile.port, device.clientid, profile.username, profile.password);
+    device.client->setObserver(observeDevice, run);
+    // spread the connects and publishes over one interval
+    tasks.after((unsigned long) ((uint64_t) profile.interval * i / profile.devices), tickDevice, &device);
+  }
+  //
+  unsigned long started = tasks.millis();
+  //
+  while (tasks.millis() - started < profile.duration) tasks.run();
+  //
+  report.devices = profile.devices;
+  report.elapsed = tasks.millis() - started;
+  //
+  for (uint16_t i = 0; i < profile.devices; i++) {
+    LoadDevice& device = devices[i];
+    MQTTClientStats stats;
+    device.client->getStats(stats);
+    report.publishes += stats.publishes;
+    report.acks += stats.acks;
+    report.retries += stats.retries;
+    report.bytes += stats.bytes;
+    //
+    if (device.client->connected()) report.connected++;
+    //
+    device.client->disconnect();
+    delete device.client;
+    delete device.transport;
+  }
+  //
+  report.throughput = report.elapsed > 0 ? (unsigned long) ((uint64_t) report.acks * 10000 / report.elapsed) : 0;
+  summarize(run->connects, report.connect);
+  summarize(run->acks, report.ack);
+  delete[] devices;
+  delete run;
+  free(payload);
+  //
+  return true;
+}
+
+static void printPercentiles(Print& out, const char* name, const MQTTLoadPercentiles& percentiles) {
+  char line[128];
+  snprintf(line, sizeof line, "%s ms p50 %lu p99 %lu p999 %lu max %lu (%lu samples)", name, percentiles.p50, percentiles.p99, percentiles.p999, percentiles.max, percentiles.count);
+  out.println(line);
+}
+
+void printLoadReport(Print& out, const MQTTLoadReport& report) {
+  char line[160];
+  snprintf(line, sizeof line, "devices %u connected %u in %lu ms", report.devices, report.connected, report.elapsed);
+  out.println(line);
+  snprintf(line, sizeof line, "publishes %lu acks %lu retries %lu bytes %lu, %lu.%lu acks/s", report.publishes, report.acks, report.retries, report.bytes, report.throughput / 10, report.throughput % 10);
+  out.println(line);
+  printPercentiles(out, "connect", report.connect);
+  printPercentiles(out, "ack", report.ack);
+}
+
+static int formatPercentiles(char* buffer, size_t size, const char* name, const MQTTLoadPercentiles& percentiles) {
+  return snprintf(buffer, size, "\"%s\":{\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu,\"count\":%lu}", name, percentiles.p50, percentiles.p99, percentiles.p999, percentiles.max, percentiles.count);
+}
+
+void printLoadReportJson(Print& out, const MQTTLoadReport& report) {
+  char buffer[400];
+  int len = snprintf(buffer, sizeof buffer, "{\"devices\":%u,\"connected\":%u,\"elapsed\":%lu,\"publishes\":%lu,\"acks\":%lu,\"retries\":%lu,\"bytes\":%lu,\"throughput\":%lu.%lu,",
+                     report.devices, report.connected, report.elapsed, report.publishes, report.acks, report.retries, report.bytes, report.throughput / 10, report.throughput % 10);
+  len += formatPercentiles(buffer + len, sizeof buffer - len, "connect", report.connect);
+  len += snprintf(buffer + len, sizeof buffer - len, ",");
+  len += formatPercentiles(buffer + len, sizeof buffer - len, "ack", report.ack);
+  snprintf(buffer + len, sizeof buffer - len, "}");
+  out.println(buffer);
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+@Brief : fleet load generator, N MQTTClient sessions on one scheduler with throughput and latency percentiles
+ */
+
+#ifndef MQTTLoadGenerator_h
+#define MQTTLoadGenerator_h
+
+#include <Client.h>
+
+#define LOAD_MAX_DEVICES 8000 // task handles address 65535 slots
+#define LOAD_TASKS_PER_DEVICE 8 // publish tick, connect steps, transmit chain, flush
+#define LOAD_TOPIC_SIZE 64
+#define LOAD_HISTOGRAM_BUCKETS 240 // 16 exact values, then 8 per power of 2 up to 2^32 ms
+
+struct MQTTLoadProfile {
+  uint16_t devices;
+  const char* host; // NULL runs every device against its own MQTTSimulatedBroker in virtual time
+  uint16_t port;
+  const char* username;
+  const char* password;
+  const char* topic; // %u is the device number, e.g. "fleet/%u/telemetry"; no other % is accepted
+  size_t payloadsize;
+  unsigned long interval; // ms between the publishes of one device
+  unsigned long duration; // ms, virtual when simulated
+  unsigned long latency; // ms of the simulated broker
+  uint8_t loss; // percent of packets the simulated broker loses
+};
+
+struct MQTTLoadPercentiles {
+  unsigned long p50;
+  unsigned long p99;
+  unsigned long p999;
+  unsigned long max;
+  unsigned long count;
+};
+
+struct MQTTLoadReport {
+  uint16_t devices;
+  uint16_t connected; // at the end of the run
+  unsigned long elapsed; // ms
+  unsigned long publishes;
+  unsigned long acks;
+  unsigned long retries;
+  unsigned long bytes;
+  unsigned long throughput; // acks per 10 s, printed as acks per second with one decimal
+  MQTTLoadPercentiles connect; // ms from connect() to the CONNACK
+  MQTTLoadPercentiles ack; // ms from publish() to the PUBACK
+};
+
+// a new, unconnected transport for a device, deleted at the end of the run
+typedef Client* MQTTLoadTransport(uint16_t device);
+
+// QoS 1, the only level MQTTClient publishes at; not built with MQTT_STATIC_MEMORY or COOPERATIVE_MULTITASKING_STATIC.
+// The sketch runs it with RUN_LOAD_GENERATOR, host/mqtt_load_generator.cpp is the command-line target.
+bool runLoadGenerator(const MQTTLoadProfile& profile, MQTTLoadReport& report, MQTTLoadTransport* transport = NULL);
+void printLoadReport(Print& out, const MQTTLoadReport& report);
+void printLoadReportJson(Print& out, const MQTTLoadReport& report);
+
+#endif
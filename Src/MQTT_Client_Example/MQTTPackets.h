@@ -0,0 +1,91 @@
+/*
+@Brief : compile-time MQTT packet images, shared by MQTTClient and MQTTSocket
+ */
+
+#ifndef MQTTPackets_h
+#define MQTTPackets_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// fixed packets, sent as they are
+static constexpr uint8_t MQTT_PINGREQ[] = { 12 << 4, 0 };
+static constexpr uint8_t MQTT_DISCONNECT[] = { 14 << 4, 0 };
+static constexpr uint8_t MQTT_PUBACK_HEADER[] = { 4 << 4, 2 }; // followed by the packet id
+static constexpr uint8_t MQTT_CONNECT_PREAMBLE[] = { 0, 4, 'M', 'Q', 'T', 'T', 4 }; // protocol name and level
+static constexpr uint8_t MQTT_PUBLISH_QOS1 = (3 << 4) | 2; // fixed header skeleton, or 8 for duplicate and 1 for retain
+
+// the remaining length is a varint of 1 to 4 bytes, these are the first values needing one more
+static constexpr size_t MQTT_LENGTH_LIMITS[] = { 128, 16384, 2097152 };
+
+constexpr size_t mqttLengthSize(size_t value) {
+  return value < MQTT_LENGTH_LIMITS[0] ? 1 : value < MQTT_LENGTH_LIMITS[1] ? 2 : value < MQTT_LENGTH_LIMITS[2] ? 3 : 4;
+}
+
+inline size_t mqttEncodeLength(uint8_t* out, size_t value) {
+  size_t len = 0;
+  //
+  do {
+    uint8_t digit = value & 127;
+    value >>= 7;
+    //
+    if (value > 0) digit |= 128;
+    //
+    out[len++] = digit;
+  } while (value > 0 && len < 4);
+  //
+  return len;
+}
+
+// Pulls up to size bytes of a streamed payload from offset into buffer and returns how many, 0 fails the packet.
+// A retry pulls from offset 0 again, so the payload is never held in RAM. A file seeks to offset and reads.
+typedef size_t MQTTPayloadSource(void* context, size_t offset, uint8_t* buffer, size_t size);
+
+// a payload that is already addressable, e.g. a memory-mapped file or flash: the context is its first byte
+inline size_t mqttMemorySource(void* context, size_t offset, uint8_t* buffer, size_t size) {
+  memcpy(buffer, (const uint8_t*) context + offset, size);
+  //
+  return size;
+}
+
+#define MQTT_MAX_PACKET_LENGTH 268435455 // the largest remaining length
+
+// index sequence, C++11 has none
+template<size_t... I> struct MQTTIndices { };
+template<size_t N, size_t... I> struct MQTTMakeIndices : MQTTMakeIndices<N - 1, N - 1, I...> { };
+template<size_t... I> struct MQTTMakeIndices<0, I...> { typedef MQTTIndices<I...> type; };
+
+// a topic name as it goes on the wire: 2 length bytes, then the name without its terminating zero
+template<size_t N> class MQTTTopicName {
+  private:
+    template<size_t... I>
+    constexpr MQTTTopicName(const char (&name)[N], MQTTIndices<I...>) : bytes{ (uint8_t) ((N - 1) >> 8), (uint8_t) ((N - 1) & 255), (uint8_t) name[I]... } { }
+
+  public:
+    const uint8_t bytes[N + 1];
+
+    constexpr MQTTTopicName(const char (&name)[N]) : MQTTTopicName(name, typename MQTTMakeIndices<N - 1>::type()) { }
+    constexpr size_t size() const { return N + 1; }
+    constexpr size_t length() const { return N - 1; }
+};
+
+// static constexpr auto alarm = mqttTopicName("dung/alarm");
+template<size_t N> constexpr MQTTTopicName<N> mqttTopicName(const char (&name)[N]) {
+  return MQTTTopicName<N>(name);
+}
+
+// everything of a QoS 1 PUBLISH in front of the payload, out needs 7 + topiclength bytes
+inline size_t mqttPublishHeader(uint8_t* out, uint8_t flags, const uint8_t* topic, size_t topicsize, uint16_t packetid, size_t payloadlength) {
+  size_t len = 0;
+  out[len++] = MQTT_PUBLISH_QOS1 | flags;
+  len += mqttEncodeLength(out + len, topicsize + 2 + payloadlength);
+  memcpy(out + len, topic, topicsize);
+  len += topicsize;
+  out[len++] = packetid >> 8;
+  out[len++] = packetid & 255;
+  //
+  return len;
+}
+
+#endif
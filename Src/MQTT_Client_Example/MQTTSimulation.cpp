@@ -0,0 +1,421 @@
+#include "MQTTSimulation.h"
+#include "MQTTClient.h"
+
+MQTTSimulatedBroker::MQTTSimulatedBroker(SchedulerClock* _clock, uint32_t seed) {
+  clock = _clock;
+  state = seed ? seed : 1;
+  latency = 0;
+  loss = 0;
+  up = true;
+  open = false;
+  returncode = 0;
+  headerlength = 0;
+  remaining = 0;
+  packetlength = 0;
+  inputlength = 0;
+  outputhead = 0;
+  outputlength = 0;
+  responsehead = 0;
+  responsecount = 0;
+  connects = 0;
+  publishes = 0;
+  duplicates = 0;
+  lost = 0;
+}
+
+unsigned long MQTTSimulatedBroker::now() {
+  return clock ? clock->millis() : millis();
+}
+
+bool MQTTSimulatedBroker::isLost() {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  //
+  return state % 100 < loss;
+}
+
+void MQTTSimulatedBroker::setLinkUp(bool value) {
+  up = value;
+  //
+  if (!up) stop();
+}
+
+int MQTTSimulatedBroker::connect(IPAddress, uint16_t port) {
+  return connect((const char*) NULL, port);
+}
+
+int MQTTSimulatedBroker::connect(const char*, uint16_t) {
+  stop();
+  //
+  if (!up) return 0;
+  //
+  open = true;
+  clearWriteError();
+  //
+  return 1;
+}
+
+void MQTTSimulatedBroker::stop() {
+  open = false;
+  headerlength = 0;
+  remaining = 0;
+  inputlength = 0;
+  outputhead = 0;
+  outputlength = 0;
+  responsehead = 0;
+  responsecount = 0;
+}
+
+size_t MQTTSimulatedBroker::write(uint8_t value) {
+  return write(&value, 1);
+}
+
+size_t MQTTSimulatedBroker::write(const uint8_t* buffer, size_t size) {
+  if (!open) {
+    setWriteError();
+    //
+    return 0;
+  }
+  //
+  for (size_t i = 0; i < size; i++) receive(buffer[i]);
+  //
+  return size;
+}
+
+// one byte at a time, so packets may be split across writes in any way
+void MQTTSimulatedBroker::receive(uint8_t value) {
+  // the type, then the remaining length up to its last digit
+  if (headerlength < 2 || (remaining == 0 && (header[headerlength - 1] & 128))) {
+    header[headerlength++] = value;
+    //
+    if (headerlength == 1 || ((value & 128) && headerlength < sizeof header)) return;
+    // the remaining length is complete
+    packetlength = 0;
+    //
+    for (size_t i = headerlength - 1; i >= 1; i--) packetlength = (packetlength << 7) | (header[i] & 127);
+    //
+    remaining = packetlength;
+    inputlength = 0;
+    header[headerlength - 1] &= 127; // a malformed fifth digit ends the header too
+    //
+    if (remaining > 0) return;
+  } else {
+    if (inputlength < SIMULATION_INPUT_SIZE) input[inputlength++] = value;
+    //
+    if (--remaining > 0) return;
+  }
+  //
+  if (isLost()) lost++;
+  else handlePacket();
+  //
+  headerlength = 0;
+}
+
+void MQTTSimulatedBroker::handlePacket() {
+  uint8_t type = header[0] >> 4;
+  uint8_t flags = header[0] & 15;
+  //
+  switch (type) {
+    case 1: // CONNECT
+    {
+      connects++;
+      const uint8_t connack[] = { 2 << 4, 2, 0, returncode };
+      respond(connack, sizeof connack);
+      break;
+    }
+    case 3: // PUBLISH
+    {
+      publishes++;
+      //
+      if (flags & 8) duplicates++;
+      //
+      if (!(flags & 6) || inputlength < 2) break;
+      //
+      size_t offset = 2 + ((input[0] << 8) | input[1]);
+      //
+      if (offset + 2 > inputlength) break;
+      //
+      const uint8_t puback[] = { 4 << 4, 2, input[offset], input[offset + 1] };
+      respond(puback, sizeof puback);
+      break;
+    }
+    case 8: // SUBSCRIBE
+    {
+      if (inputlength < 2) break;
+      //
+      uint8_t suback[12] = { 9 << 4, 2, input[0], input[1] };
+      size_t offset = 2;
+      // one return code per filter
+      while (offset + 2 < inputlength && suback[1] < sizeof suback - 2) {
+        offset += 2 + ((input[offset] << 8) | input[offset + 1]);
+        //
+        if (offset >= inputlength) break;
+        //
+        uint8_t qos = input[offset++];
+        suback[2 + suback[1]++] = qos > 1 ? 1 : qos; // QoS 2 is granted as 1
+      }
+      //
+      respond(suback, 2 + suback[1]);
+      break;
+    }
+    case 10: // UNSUBSCRIBE
+    {
+      if (inputlength < 2) break;
+      //
+      const uint8_t unsuback[] = { 11 << 4, 2, input[0], input[1] };
+      respond(unsuback, sizeof unsuback);
+      break;
+    }
+    case 12: // PINGREQ
+    {
+      const uint8_t pingresp[] = { 13 << 4, 0 };
+      respond(pingresp, sizeof pingresp);
+      break;
+    }
+    case 14: // DISCONNECT
+      open = false;
+      break;
+  }
+}
+
+void MQTTSimulatedBroker::respond(const uint8_t* bytes, uint8_t length) {
+  if (responsecount == SIMULATION_RESPONSES) return; // lost as well
+  //
+  Response& response = responses[(responsehead + responsecount++) % SIMULATION_RESPONSES];
+  response.due = now() + latency;
+  response.length = length;
+  memcpy(response.bytes, bytes, length);
+}
+
+// answers arrive in order, they all have the same latency
+void MQTTSimulatedBroker::deliver() {
+  while (responsecount > 0) {
+    Response& response = responses[responsehead];
+    //
+    if ((long) (now() - response.due) < 0) return;
+    //
+    if (!emit(response.bytes, response.length)) return;
+    //
+    responsehead = (responsehead + 1) % SIMULATION_RESPONSES;
+    responsecount--;
+  }
+}
+
+bool MQTTSimulatedBroker::emit(const uint8_t* bytes, size_t length) {
+  if (outputlength + length > SIMULATION_OUTPUT_SIZE) return false;
+  //
+  for (size_t i = 0; i < length; i++) output[(outputhead + outputlength++) % SIMULATION_OUTPUT_SIZE] = bytes[i];
+  //
+  return true;
+}
+
+bool MQTTSimulatedBroker::publish(const char* topic, const uint8_t* payload, size_t length) {
+  if (!open) return false;
+  //
+  size_t topiclength = strlen(topic);
+  uint8_t prefix[7];
+  size_t prefixlength = 0;
+  size_t value = 2 + topiclength + length;
+  prefix[prefixlength++] = 3 << 4;
+  //
+  do {
+    uint8_t digit = value & 127;
+    value >>= 7;
+    //
+    if (value > 0) digit |= 128;
+    //
+    prefix[prefixlength++] = digit;
+  } while (value > 0 && prefixlength < 5);
+  //
+  prefix[prefixlength++] = topiclength >> 8;
+  prefix[prefixlength++] = topiclength & 255;
+  deliver(); // answers due before stay in front
+  //
+  if (outputlength + prefixlength + topiclength + length > SIMULATION_OUTPUT_SIZE) return false;
+  //
+  return emit(prefix, prefixlength) && emit((const uint8_t*) topic, topiclength) && emit(payload, length);
+}
+
+int MQTTSimulatedBroker::available() {
+  deliver();
+  //
+  return outputlength;
+}
+
+int MQTTSimulatedBroker::read() {
+  deliver();
+  //
+  if (outputlength == 0) return -1;
+  //
+  uint8_t value = output[outputhead];
+  outputhead = (outputhead + 1) % SIMULATION_OUTPUT_SIZE;
+  outputlength--;
+  //
+  return value;
+}
+
+int MQTTSimulatedBroker::read(uint8_t* buffer, size_t size) {
+  deliver();
+  //
+  if (outputlength == 0) return -1;
+  //
+  size_t count = 0;
+  //
+  while (count < size && outputlength > 0) buffer[count++] = read();
+  //
+  return count;
+}
+
+int MQTTSimulatedBroker::peek() {
+  deliver();
+  //
+  return outputlength > 0 ? output[outputhead] : -1;
+}
+
+/*
+ *
+ */
+
+static CooperativeMultitasking* simulationtasks = NULL;
+static MQTTClient* simulationclient = NULL;
+
+static void simulationTick() {
+  if (!simulationclient) return;
+  //
+  if (!simulationclient->connected() && !simulationclient->connecting()) simulationclient->connect();
+  //
+  simulationclient->publish(false, "simulation/tick", "{\"value\":1}");
+  simulationtasks->after(1000, simulationTick);
+}
+
+void runLinkSimulation(Print& out, unsigned long duration, uint8_t loss) {
+  VirtualClock clock;
+#ifdef COOPERATIVE_MULTITASKING_STATIC
+  StaticMultitasking<32> tasks;
+#else
+  CooperativeMultitasking tasks;
+#endif
+  tasks.setClock(&clock);
+  MQTTSimulatedBroker broker(&clock);
+  broker.setLatency(40);
+  broker.setLoss(loss);
+#ifdef MQTT_STATIC_MEMORY
+  StaticMQTTClient<64, 16> client(&tasks, &broker, "simulation", 1883, "simulation", NULL, NULL);
+#else
+  MQTTClient client(&tasks, &broker, "simulation", 1883, "simulation", NULL, NULL);
+#endif
+  simulationtasks = &tasks;
+  simulationclient = &client;
+  unsigned long started = micros();
+  tasks.now(simulationTick);
+  //
+  while (clock.millis() < duration) tasks.run();
+  //
+  unsigned long elapsed = micros() - started;
+  simulationclient = NULL;
+  simulationtasks = NULL;
+  char stats[STATS_BUFFER_SIZE];
+  client.formatStats(stats, sizeof stats);
+  out.print("simulated ");
+  out.print(duration);
+  out.print(" ms in ");
+  out.print(elapsed);
+  out.print(" us, loss ");
+  out.print(loss);
+  out.print("%, connects ");
+  out.print(broker.getConnects());
+  out.print(", publishes ");
+  out.print(broker.getPublishes());
+  out.print(", duplicates ");
+  out.print(broker.getDuplicates());
+  out.print(", lost ");
+  out.println(broker.getLost());
+  out.println(stats);
+}
+
+// a fresh link, scheduler and client for every check
+struct SimulationRig {
+  VirtualClock clock;
+#ifdef COOPERATIVE_MULTITASKING_STATIC
+  StaticMultitasking<32> tasks;
+#else
+  CooperativeMultitasking tasks;
+#endif
+  MQTTSimulatedBroker broker;
+#ifdef MQTT_STATIC_MEMORY
+  StaticMQTTClient<64, 16> client;
+#else
+  MQTTClient client;
+#endif
+
+  SimulationRig(uint32_t seed) : broker(&clock, seed), client(&tasks, &broker, "simulation", 1883, "simulation", NULL, NULL) {
+    tasks.setClock(&clock);
+    broker.setLatency(40);
+  }
+
+  void runFor(unsigned long duration) {
+    unsigned long started = clock.millis();
+    //
+    while (clock.millis() - started < duration) tasks.run();
+  }
+
+  bool connect() {
+    client.connect();
+    runFor(1000);
+    //
+    return client.connected();
+  }
+};
+
+static bool check(Print& out, const char* name, bool passed) {
+  out.print(passed ? "PASS " : "FAIL ");
+  out.println(name);
+  //
+  return passed;
+}
+
+bool runSimulationChecks(Print& out) {
+  bool passed = true;
+  //
+  {
+    SimulationRig rig(1);
+    bool connected = rig.connect();
+    rig.broker.setLinkUp(false);
+    rig.client.publish(false, "simulation/check", "queued");
+    rig.runFor(3000);
+    rig.broker.setLinkUp(true);
+    rig.client.connect();
+    rig.runFor(5000);
+    // nothing is published after the reconnect, the queued packet must go out by itself
+    passed &= check(out, "queued publish acknowledged after a forced disconnect", connected && rig.client.connected() && rig.client.publishAcknowledged());
+    passed &= check(out, "reconnect after the link drops", rig.broker.getConnects() == 2);
+  }
+  //
+  {
+    SimulationRig rig(2);
+    rig.broker.setLoss(20);
+    MQTTClientStats stats;
+    //
+    for (int i = 0; i < 60; i++) {
+      if (!rig.client.connected() && !rig.client.connecting()) rig.client.connect();
+      //
+      rig.client.publish(false, "simulation/check", "{\"value\":1}");
+      rig.runFor(1000);
+    }
+    //
+    rig.runFor(10000);
+    rig.client.getStats(stats);
+    passed &= check(out, "every publish acknowledged at 20% loss", stats.publishes == 60 && stats.acks == 60 && rig.client.publishAcknowledged());
+    passed &= check(out, "lost packets are retried", stats.retries > 0 && rig.broker.getLost() > 0);
+  }
+  //
+  {
+    SimulationRig rig(3);
+    rig.broker.setReturnCode(5);
+    bool connected = rig.connect();
+    passed &= check(out, "refused connect", !connected && !rig.client.connecting());
+  }
+  //
+  return passed;
+}
@@ -0,0 +1,89 @@
+/*
+@Brief : in-memory broker behind a Client and a virtual time scenario, to run hours of a flaky link in milliseconds
+ */
+
+#ifndef MQTTSimulation_h
+#define MQTTSimulation_h
+
+#include <Client.h>
+#include "Multitasking.h"
+
+#define SIMULATION_INPUT_SIZE 512 // bytes of one inbound packet kept for parsing, the rest is skipped
+#define SIMULATION_OUTPUT_SIZE 1024 // bytes the client has not read yet
+#define SIMULATION_RESPONSES 64 // answers still travelling to the client
+
+// Answers CONNECT, QoS 1 PUBLISH, SUBSCRIBE, UNSUBSCRIBE and PINGREQ like a broker would, after a latency.
+// Packets from the client are lost at random, the generator is seeded, so every run is the same.
+class MQTTSimulatedBroker : public Client {
+  private:
+    struct Response {
+      unsigned long due; // millis() of the clock
+      uint8_t length;
+      uint8_t bytes[12]; // a SUBACK for up to 8 filters
+    };
+
+    SchedulerClock* clock;
+    uint32_t state; // of the xorshift generator
+    unsigned long latency;
+    uint8_t loss; // percent
+    bool up; // the link, connect() fails while it is down
+    bool open;
+    uint8_t returncode;
+    uint8_t header[5]; // of the inbound packet
+    size_t headerlength;
+    size_t remaining; // bytes of the inbound packet still to come
+    size_t packetlength;
+    uint8_t input[SIMULATION_INPUT_SIZE];
+    size_t inputlength;
+    uint8_t output[SIMULATION_OUTPUT_SIZE];
+    size_t outputhead;
+    size_t outputlength;
+    Response responses[SIMULATION_RESPONSES];
+    int responsehead;
+    int responsecount;
+    unsigned long connects;
+    unsigned long publishes;
+    unsigned long duplicates;
+    unsigned long lost;
+
+    unsigned long now();
+    bool isLost();
+    void receive(uint8_t value);
+    void handlePacket();
+    void respond(const uint8_t* bytes, uint8_t length);
+    void deliver();
+    bool emit(const uint8_t* bytes, size_t length);
+
+  public:
+    MQTTSimulatedBroker(SchedulerClock* clock = NULL, uint32_t seed = 1);
+    void setLatency(unsigned long duration) { latency = duration; } // milliseconds, each way together
+    void setLoss(uint8_t percent) { loss = percent; }
+    void setLinkUp(bool value); // down closes the connection
+    void setReturnCode(uint8_t value) { returncode = value; } // of the CONNACK, 0 accepts
+    // a QoS 0 PUBLISH to the client, no latency
+    bool publish(const char* topic, const uint8_t* payload, size_t length);
+    unsigned long getConnects() const { return connects; }
+    unsigned long getPublishes() const { return publishes; } // duplicates included
+    unsigned long getDuplicates() const { return duplicates; }
+    unsigned long getLost() const { return lost; }
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char* host, uint16_t port);
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* buffer, size_t size);
+    int available();
+    int read();
+    int read(uint8_t* buffer, size_t size);
+    int peek();
+    void flush() { }
+    void stop();
+    uint8_t connected() { return open; }
+    operator bool() { return open; }
+};
+
+// publishes once a second for duration ms of virtual time over a link losing loss percent, prints the outcome
+void runLinkSimulation(Print& out, unsigned long duration, uint8_t loss);
+// loss and reconnect scenarios with an expected outcome, prints PASS or FAIL for each, true if all pass
+bool runSimulationChecks(Print& out);
+
+#endif
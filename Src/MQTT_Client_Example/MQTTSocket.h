@@ -1,129 +1,790 @@
-/*
- * Copyright (C) 2021 Andreas Motzek andreas-motzek@t-online.de
- *
- * This file is part of the MQTT Client package.
- *
- * You can use, redistribute and/or modify this file under the terms
- * of the Creative Commons Attribution 4.0 International Public License.
- * See https://creativecommons.org/licenses/by/4.0/ for details.
- *
- * This file is distributed in the hope that it will be useful, but
- * without any warranty; without even the implied warranty of
- * merchantability or fitness for a particular purpose.
- */
-
-#ifndef MQTTSocket_h
-#define MQTTSocket_h
-
-#include <Client.h>
-
-class Packet {
-    private:
-        const uint8_t flags;
-        const uint8_t type;
-
-    protected:
-        Packet(uint8_t f, uint8_t t) : flags(f), type(t) { }
-
-    public:
-        virtual ~Packet() { }
-        uint8_t getFlags() const { return flags; }
-        uint8_t getType() const { return type; }
-};
-
-class ConnectAcknowledgement : public Packet {
-    private:
-        const uint8_t sessionpresent;
-        const uint8_t returncode;
-
-    public:
-        ConnectAcknowledgement(uint8_t f, uint8_t t, uint8_t s, uint8_t r) : Packet(f, t), sessionpresent(s), returncode(r) { }
-        virtual ~ConnectAcknowledgement() { }
-        uint8_t getSessionPresent() const { return sessionpresent; }
-        uint8_t getReturnCode() const { return returncode; }
-        bool isConnectionAccepted() const { return returncode == 0; }
-};
-
-class PublishNotification : public Packet {
-    private:
-        const char* topic;
-        const uint16_t packetid;
-        const char* payload;
-
-    public:
-        PublishNotification(uint8_t f, uint8_t t, char* tc, uint16_t pi, char* pl) : Packet(f, t), topic(tc), packetid(pi), payload(pl) { }
-        virtual ~PublishNotification() { delete topic; delete payload; }
-        const char* getTopic() const { return topic; }
-        uint16_t getPacketId() const { return packetid; }
-        bool isDuplicate() const { return getFlags() & 8 > 0; }
-        const char* getPayload() const { return payload; }
-};
-
-class SubscribeAcknowledgement : public Packet {
-    private:
-        const uint16_t packetid;
-        const uint8_t returncode;
-
-    public:
-        SubscribeAcknowledgement(uint8_t f, uint8_t t, uint16_t p, uint8_t r) : Packet(f, t), packetid(p), returncode(r) { }
-        virtual ~SubscribeAcknowledgement() { }
-        uint16_t getPacketId() const { return packetid; }
-        uint8_t getReturnCode() const { return returncode; }
-        bool hasPacketId(uint16_t p) const { return p == packetid; }
-        bool isSubscriptionAccepted() const { return returncode != 128; }
-};
-
-class PublishAcknowledgement : public Packet {
-    private:
-        const uint16_t packetid;
-
-    public:
-        PublishAcknowledgement(uint8_t f, uint8_t t, uint16_t p) : Packet(f, t), packetid(p) { }
-        virtual ~PublishAcknowledgement() { }
-        uint16_t getPacketId() const { return packetid; }
-        bool hasPacketId(uint16_t p) const { return p == packetid; }
-};
-
-class PingResponse : public Packet {
-    public:
-        PingResponse(uint8_t f, uint8_t t) : Packet(f, t) { }
-        virtual ~PingResponse() { }
-};
-
-class MQTTSocket {
-    private:
-        Client* client;
-        uint16_t packetid;
-        uint8_t writebuffer[256];
-        size_t writebufferlength;
-        bool readerror;
-        bool writeerror;
-        void writeTypeFlags(uint8_t type, uint8_t flags);
-        void writePacketLength(size_t value);
-        void writeLengthString(const char* value);
-        void writeString(const char* value, size_t len);
-        void writeShort(uint16_t value);
-        void writeByte(uint8_t value);
-        void flush();
-        uint8_t readByte();
-        uint16_t readShort();
-        char* readString(size_t len);
-        size_t readPacketLength();
-
-    public:
-        MQTTSocket(Client* c) : client(c) { packetid = 0; writebufferlength = 0; writeerror = false; readerror = false; }
-        bool connect(const char* host, uint16_t port);
-        bool sendConnectRequest(const char clientid[], const char username[], const char password[], uint16_t keepalive);
-        bool sendSubscribeRequest(const char topicfilter[], uint8_t qos);
-        bool sendPublishRequest(const char* topic, const char* payload, bool retain, bool duplicate);
-        bool sendPingRequest();
-        bool sendPublishAcknowledgement(uint16_t packetid);
-        bool canReadSocket();
-        Packet* receive();
-        uint16_t getPacketId() const { return packetid; }
-        bool isWriteComplete() const { return !writeerror; }
-        bool isReadComplete() const { return !readerror; }
-        void close();
-};
-
-#endif
+/*
+ * Copyright (C) 2021 Andreas Motzek andreas-motzek@t-online.de
+ *
+ * This file is part of the MQTT Client package.
+ *
+ * You can use, redistribute and/or modify this file under the terms
+ * of the Creative Commons Attribution 4.0 International Public License.
+ * See https://creativecommons.org/licenses/by/4.0/ for details.
+ *
+ * This file is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of
+ * merchantability or fitness for a particular purpose.
+ */
+
+#ifndef MQTTSocket_h
+#define MQTTSocket_h
+
+#include <Client.h>
+#include "MQTTPackets.h"
+#include "MQTTTransport.h"
+#include "MQTTValidate.h"
+#include "MQTTDNSCache.h"
+
+#define PACKET_CONNACK 2
+#define PACKET_PUBLISH 3
+#define PACKET_PUBACK 4
+#define PACKET_SUBACK 9
+#define PACKET_UNSUBACK 11
+#define PACKET_PINGRESP 13
+
+// the socket has no heap, these are all of its memory; set them with -D to size a device
+#ifndef SOCKET_WRITE_BUFFER_SIZE
+#define SOCKET_WRITE_BUFFER_SIZE 256 // larger packets fail, isWriteComplete() is false
+#endif
+#ifndef SOCKET_READ_BUFFER_SIZE
+#define SOCKET_READ_BUFFER_SIZE 256 // receive() skips larger packets and returns nullptr, unless a payload limit streams them
+#endif
+#ifndef SOCKET_PAYLOAD_LIMITS
+#define SOCKET_PAYLOAD_LIMITS 4 // topic filters with a payload limit, see setPayloadLimit()
+#endif
+
+// Takes an inbound payload in chunks out of the read buffer, in order. begin() may return false to skip the
+// payload; end() tells whether all of it arrived, the socket may be closed before.
+struct MQTTPayloadSink {
+    bool (*begin)(void* context, const char* topic, size_t length);
+    void (*chunk)(void* context, size_t offset, const uint8_t* bytes, size_t size);
+    void (*end)(void* context, bool complete);
+};
+
+// A view of the packet last received, tagged by getType(). Topic and payload point into the
+// read buffer of the socket, so they are valid until the next receive().
+class Packet {
+    private:
+        uint8_t flags;
+        uint8_t type;
+        uint8_t returncode; // CONNACK, and the first of a SUBACK
+        uint8_t sessionpresent;
+        uint16_t packetid; // PUBLISH, PUBACK, SUBACK and UNSUBACK
+        const uint8_t* returncodes; // SUBACK, one per filter in the order subscribed
+        size_t returncodecount;
+        const char* topic;
+        size_t topiclength;
+        const char* payload;
+        size_t payloadlength;
+        bool streamed;
+
+        template<class Transport> friend class BasicMQTTSocket;
+
+    public:
+        uint8_t getFlags() const { return flags; }
+        uint8_t getType() const { return type; }
+        uint8_t getSessionPresent() const { return sessionpresent; }
+        uint8_t getReturnCode() const { return returncode; }
+        bool isConnectionAccepted() const { return type == PACKET_CONNACK && returncode == 0; }
+        bool isSubscriptionAccepted() const { return type == PACKET_SUBACK && !memchr(returncodes, 128, returncodecount); } // all filters
+        size_t getReturnCodeCount() const { return returncodecount; }
+        uint8_t getReturnCode(size_t i) const { return returncodes[i]; } // the granted QoS, or 128 for a refused filter
+        uint16_t getPacketId() const { return packetid; }
+        bool hasPacketId(uint16_t p) const { return p == packetid; }
+        const char* getTopic() const { return topic; } // zero terminated
+        size_t getTopicLength() const { return topiclength; }
+        bool isDuplicate() const { return (flags & 8) > 0; }
+        const char* getPayload() const { return payload; } // zero terminated
+        size_t getPayloadLength() const { return payloadlength; } // payloads may contain zero bytes, e.g. when coalesced
+        bool isStreamed() const { return streamed; } // the payload went to a sink or was skipped, getPayload() is empty
+};
+
+// Transport is a Client, or a concrete one such as WiFiClient or MQTTLoopback for calls that inline,
+// see MQTTTransport. MQTTSocket is the Client form, compiled once in MQTTSocket.cpp.
+template<class Transport> class BasicMQTTSocket {
+    private:
+        struct PayloadLimit {
+            const char* topicfilter;
+            size_t maxsize;
+            const MQTTPayloadSink* sink;
+            void* context;
+        };
+
+        Transport* client;
+        uint16_t packetid;
+        uint8_t writebuffer[SOCKET_WRITE_BUFFER_SIZE];
+        size_t writebufferlength;
+        uint8_t readbuffer[SOCKET_READ_BUFFER_SIZE]; // topic and payload of the packet last received
+        Packet packet;
+        PayloadLimit limits[SOCKET_PAYLOAD_LIMITS];
+        size_t limitcount;
+        const MQTTPayloadSink* streamsink; // of the payload being streamed, nullptr skips it
+        void* streamcontext;
+        size_t streamoffset;
+        size_t streamremaining; // bytes of the payload still to come
+        bool corked;
+        size_t corkthreshold;
+        bool readerror;
+        bool writeerror;
+        void writeTypeFlags(uint8_t type, uint8_t flags);
+        void writePacketLength(size_t value);
+        void writeLengthString(const char* value);
+        void writeString(const char* value, size_t len);
+        void writeBytes(const uint8_t* value, size_t len);
+        void writeShort(uint16_t value);
+        void writeByte(uint8_t value);
+        void flush();
+        void beginPacket(size_t size);
+        uint8_t readByte();
+        uint16_t readShort();
+        bool readBytes(uint8_t* value, size_t len);
+        size_t readPacketLength();
+        size_t fitTopicFilters(const char* const topicfilters[], size_t count, size_t extra, size_t& packetlength) const;
+        const PayloadLimit* findPayloadLimit(const char* topic, size_t topiclength) const;
+        const Packet* receivePayloadChunks();
+
+    public:
+        BasicMQTTSocket(Transport* c) : client(c) { packetid = 0; writebufferlength = 0; writeerror = false; readerror = false; corked = false; corkthreshold = 0; limitcount = 0; streamsink = nullptr; streamcontext = nullptr; streamoffset = 0; streamremaining = 0; }
+        bool connect(const char* host, uint16_t port);
+        bool sendConnectRequest(const char clientid[], const char username[], const char password[], uint16_t keepalive);
+        bool sendSubscribeRequest(const char topicfilter[], uint8_t qos);
+        // the same with a payload limit for the filter, see setPayloadLimit()
+        bool sendSubscribeRequest(const char topicfilter[], uint8_t qos, size_t maxsize, const MQTTPayloadSink* sink, void* context);
+        // As many of the count filters as fit the write buffer, from the first, in one packet. Returns how many,
+        // 0 on failure; the SUBACK of getPacketId() has a return code for each.
+        size_t sendSubscribeRequest(const char* const topicfilters[], const uint8_t qos[], size_t count);
+        size_t sendUnsubscribeRequest(const char* const topicfilters[], size_t count);
+        // All count filters in as few packets as needed, without waiting for the acknowledgements in between, e.g.
+        // to restore the subscriptions after a reconnect. Returns the number of packets, 0 on failure. The SUBACKs
+        // carry the return codes in filter order.
+        size_t sendSubscribeRequests(const char* const topicfilters[], const uint8_t qos[], size_t count);
+        size_t sendUnsubscribeRequests(const char* const topicfilters[], size_t count);
+        // Payloads on topics matching topicfilter that are larger than maxsize or the read buffer go to sink in
+        // chunks, or are skipped without one; receive() returns them as streamed once complete, so QoS 1 can be
+        // acknowledged. Setting the filter again replaces its limit. Filter and sink are not copied.
+        bool setPayloadLimit(const char* topicfilter, size_t maxsize, const MQTTPayloadSink* sink = nullptr, void* context = nullptr);
+        bool sendPublishRequest(const char* topic, const char* payload, bool retain, bool duplicate);
+        bool sendPublishRequest(const uint8_t* topic, size_t topicsize, const uint8_t* payload, size_t payloadlength, bool retain, bool duplicate);
+        // the payload is pulled from source into the write buffer and written out a buffer at a time
+        bool sendPublishRequest(const char* topic, size_t payloadlength, MQTTPayloadSource* source, void* context, bool retain, bool duplicate);
+        template<size_t N> bool sendPublishRequest(const MQTTTopicName<N>& topic, const char* payload, bool retain, bool duplicate) { return sendPublishRequest(topic.bytes, topic.size(), (const uint8_t*) payload, strlen(payload), retain, duplicate); }
+        bool sendPingRequest();
+        bool sendPublishAcknowledgement(uint16_t packetid);
+        bool canReadSocket();
+        const Packet* receive(); // nullptr for malformed, unknown or too large packets
+        uint16_t getPacketId() const { return packetid; }
+        bool isWriteComplete() const { return !writeerror; }
+        bool isReadComplete() const { return !readerror; }
+        // e.g. the PUBACKs of an inbound burst: cork() before the receive loop, uncork() after it
+        void cork(size_t threshold = 128);
+        bool uncork();
+        void close();
+};
+
+typedef BasicMQTTSocket<Client> MQTTSocket;
+
+extern template class BasicMQTTSocket<Client>;
+
+template<class Transport> bool BasicMQTTSocket<Transport>::connect(const char* host, uint16_t port) {
+    IPAddress address;
+    //
+    if (!mqttResolve(host, address, millis())) return MQTTTransport<Transport>::connect(client, host, port);
+    //
+    if (MQTTTransport<Transport>::connect(client, address, port)) return true;
+    //
+    mqttForgetHost(host);
+    //
+    return false;
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendConnectRequest(const char clientid[], const char username[], const char password[], uint16_t keepalive) {
+    size_t packetlength = 2 + 4 + 1 + 1 + 2 + 2 + strlen(clientid);
+    //
+    if (username) packetlength += (2 + strlen(username));
+    //
+    if (password) packetlength += (2 + strlen(password));
+    //
+    uint8_t connectflags = 2; // clean session
+    //
+    if (username) connectflags |= 128;
+    //
+    if (password) connectflags |= 64;
+    //
+    beginPacket(packetlength + 5);
+    writeTypeFlags(1, 0);
+    writePacketLength(packetlength);
+    writeBytes(MQTT_CONNECT_PREAMBLE, sizeof MQTT_CONNECT_PREAMBLE); // protocol name and level
+    writeByte(connectflags);
+    writeShort(keepalive);
+    writeLengthString(clientid);
+    //
+    if (username) writeLengthString(username);
+    //
+    if (password) writeLengthString(password);
+    //
+    flush();
+    //
+    return isWriteComplete();
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendSubscribeRequest(const char topicfilter[], uint8_t qos) {
+    return sendSubscribeRequest(&topicfilter, &qos, 1) == 1;
+}
+
+template<class Transport> size_t BasicMQTTSocket<Transport>::sendSubscribeRequest(const char* const topicfilters[], const uint8_t qos[], size_t count) {
+    size_t packetlength = 2;
+    size_t n = fitTopicFilters(topicfilters, count, 1, packetlength);
+    //
+    if (n == 0) return 0;
+    //
+    packetid++;
+    //
+    if (packetid == 0) packetid = 1;
+    //
+    beginPacket(packetlength + 5);
+    writeTypeFlags(8, 2);
+    writePacketLength(packetlength);
+    writeShort(packetid);
+    //
+    for (size_t i = 0; i < n; i++) {
+        writeLengthString(topicfilters[i]);
+        writeByte(qos[i]);
+    }
+    //
+    flush();
+    //
+    return isWriteComplete() ? n : 0;
+}
+
+template<class Transport> size_t BasicMQTTSocket<Transport>::sendUnsubscribeRequest(const char* const topicfilters[], size_t count) {
+    size_t packetlength = 2;
+    size_t n = fitTopicFilters(topicfilters, count, 0, packetlength);
+    //
+    if (n == 0) return 0;
+    //
+    packetid++;
+    //
+    if (packetid == 0) packetid = 1;
+    //
+    beginPacket(packetlength + 5);
+    writeTypeFlags(10, 2);
+    writePacketLength(packetlength);
+    writeShort(packetid);
+    //
+    for (size_t i = 0; i < n; i++) writeLengthString(topicfilters[i]);
+    //
+    flush();
+    //
+    return isWriteComplete() ? n : 0;
+}
+
+template<class Transport> size_t BasicMQTTSocket<Transport>::sendSubscribeRequests(const char* const topicfilters[], const uint8_t qos[], size_t count) {
+    size_t packets = 0;
+    //
+    for (size_t i = 0; i < count; packets++) {
+        size_t n = sendSubscribeRequest(topicfilters + i, qos + i, count - i);
+        //
+        if (n == 0) return 0;
+        //
+        i += n;
+    }
+    //
+    return packets;
+}
+
+template<class Transport> size_t BasicMQTTSocket<Transport>::sendUnsubscribeRequests(const char* const topicfilters[], size_t count) {
+    size_t packets = 0;
+    //
+    for (size_t i = 0; i < count; packets++) {
+        size_t n = sendUnsubscribeRequest(topicfilters + i, count - i);
+        //
+        if (n == 0) return 0;
+        //
+        i += n;
+    }
+    //
+    return packets;
+}
+
+// how many valid filters from the first fit a packet, each with extra bytes after it; adds their length
+template<class Transport> size_t BasicMQTTSocket<Transport>::fitTopicFilters(const char* const topicfilters[], size_t count, size_t extra, size_t& packetlength) const {
+    size_t n = 0;
+    //
+    for (; n < count; n++) {
+        size_t length = strlen(topicfilters[n]);
+        // a full write buffer reads as an overflow in flush(), 5 bytes for type and packet length
+        if (!mqttIsValidTopicFilter(topicfilters[n], length) || packetlength + 2 + length + extra + 5 >= sizeof writebuffer) break;
+        //
+        packetlength += 2 + length + extra;
+    }
+    //
+    return n;
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendSubscribeRequest(const char topicfilter[], uint8_t qos, size_t maxsize, const MQTTPayloadSink* sink, void* context) {
+    return setPayloadLimit(topicfilter, maxsize, sink, context) && sendSubscribeRequest(topicfilter, qos);
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::setPayloadLimit(const char* topicfilter, size_t maxsize, const MQTTPayloadSink* sink, void* context) {
+    if (!mqttIsValidTopicFilter(topicfilter, strlen(topicfilter))) return false;
+    //
+    size_t i = 0;
+    //
+    while (i < limitcount && strcmp(limits[i].topicfilter, topicfilter) != 0) i++;
+    //
+    if (i == SOCKET_PAYLOAD_LIMITS) return false;
+    //
+    if (i == limitcount) limitcount++;
+    //
+    limits[i].topicfilter = topicfilter;
+    limits[i].maxsize = maxsize;
+    limits[i].sink = sink;
+    limits[i].context = context;
+    //
+    return true;
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendPublishRequest(const char* topic, const char* payload, bool retain, bool duplicate) {
+    uint8_t flags = 2; // QoS 1
+    //
+    if (!mqttIsValidTopicName(topic, strlen(topic))) return false;
+    //
+    if (retain) flags |= 1;
+    //
+    if (duplicate) {
+        flags |= 8;
+    } else {
+        packetid++;
+        //
+        if (packetid == 0) packetid = 1;
+    }
+    //
+    size_t packetlength = 2 + strlen(topic) + 2 + strlen(payload);
+    beginPacket(packetlength + 5);
+    writeTypeFlags(3, flags);
+    writePacketLength(packetlength);
+    writeLengthString(topic);
+    writeShort(packetid);
+    writeString(payload, strlen(payload));
+    flush();
+    //
+    return isWriteComplete();
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendPublishRequest(const uint8_t* topic, size_t topicsize, const uint8_t* payload, size_t payloadlength, bool retain, bool duplicate) {
+    uint8_t flags = 0;
+    //
+    if (topicsize < 2 || !mqttIsValidTopicName((const char*) topic + 2, topicsize - 2)) return false;
+    //
+    if (retain) flags |= 1;
+    //
+    if (duplicate) {
+        flags |= 8;
+    } else {
+        packetid++;
+        //
+        if (packetid == 0) packetid = 1;
+    }
+    //
+    beginPacket(topicsize + 2 + payloadlength + 5);
+    // copy the compile-time topic image, patch length and packet id
+    if (writebufferlength + 7 + topicsize <= sizeof writebuffer) {
+        writebufferlength += mqttPublishHeader(writebuffer + writebufferlength, flags, topic, topicsize, packetid, payloadlength);
+        writeBytes(payload, payloadlength);
+    } else {
+        writebufferlength = sizeof writebuffer; // flush() reports the overflow
+    }
+    //
+    flush();
+    //
+    return isWriteComplete();
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendPublishRequest(const char* topic, size_t payloadlength, MQTTPayloadSource* source, void* context, bool retain, bool duplicate) {
+    uint8_t flags = 2; // QoS 1
+    size_t topiclength = strlen(topic);
+    size_t headerlength = 2 + topiclength + 2 + 5; // at most
+    //
+    if (!source || !mqttIsValidTopicName(topic, topiclength) || payloadlength > MQTT_MAX_PACKET_LENGTH - 4 - topiclength) return false;
+    // the header goes into the buffer in one piece, followed by at least one payload byte
+    if (headerlength + 2 > sizeof writebuffer) return false;
+    //
+    if (retain) flags |= 1;
+    //
+    if (duplicate) {
+        flags |= 8;
+    } else {
+        packetid++;
+        //
+        if (packetid == 0) packetid = 1;
+    }
+    //
+    beginPacket(headerlength + 2);
+    writeTypeFlags(3, flags);
+    writePacketLength(2 + topiclength + 2 + payloadlength);
+    writeLengthString(topic);
+    writeShort(packetid);
+    // no room left for the payload, beginPacket() should have prevented it
+    if (payloadlength > 0 && writebufferlength >= sizeof writebuffer - 1) writeerror = true;
+    //
+    for (size_t offset = 0; offset < payloadlength && !writeerror; ) {
+        // a full buffer would read as an overflow in flush()
+        size_t size = sizeof writebuffer - 1 - writebufferlength;
+        //
+        if (size > payloadlength - offset) size = payloadlength - offset;
+        //
+        size_t count = size > 0 ? source(context, offset, writebuffer + writebufferlength, size) : 0;
+        //
+        if (count == 0 || count > size) {
+            writeerror = true; // the packet is cut short, close the socket
+            //
+            break;
+        }
+        //
+        writebufferlength += count;
+        offset += count;
+        //
+        if (offset < payloadlength) beginPacket(sizeof writebuffer); // writes the buffer out, corked or not
+    }
+    //
+    flush();
+    //
+    return isWriteComplete();
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendPingRequest() {
+    beginPacket(sizeof MQTT_PINGREQ);
+    writeBytes(MQTT_PINGREQ, sizeof MQTT_PINGREQ);
+    flush();
+    //
+    return isWriteComplete();
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::sendPublishAcknowledgement(uint16_t packetid) {
+    beginPacket(sizeof MQTT_PUBACK_HEADER + 2);
+    writeBytes(MQTT_PUBACK_HEADER, sizeof MQTT_PUBACK_HEADER);
+    writeShort(packetid);
+    flush();
+    //
+    return isWriteComplete();
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::writeTypeFlags(uint8_t type, uint8_t flags) {
+    writeByte(type << 4 | flags);
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::writePacketLength(size_t len) {
+    while (true) {
+        uint8_t digit = len & 127;
+        len >>= 7;
+        //
+        if (len > 0) {
+            writeByte(digit | 128);
+        } else {
+            writeByte(digit);
+            //
+            break;
+        }
+    }
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::writeLengthString(const char* value) {
+    size_t len = strlen(value);
+    //
+    if (len > 65535) return;
+    //
+    writeShort(len);
+    writeString(value, len);
+}
+//Utils
+template<class Transport> void BasicMQTTSocket<Transport>::writeString(const char* value, size_t len) {
+    writeBytes((const uint8_t*) value, len);
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::writeBytes(const uint8_t* value, size_t len) {
+    if (writeerror) return;
+    //
+    if (len > sizeof writebuffer - writebufferlength) {
+        writebufferlength = sizeof writebuffer; // flush() reports the overflow
+        //
+        return;
+    }
+    //
+    memcpy(writebuffer + writebufferlength, value, len);
+    writebufferlength += len;
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::writeShort(uint16_t value) {
+    writeByte(value >> 8);
+    writeByte(value & 255);
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::writeByte(uint8_t value) {
+    if (writeerror) return;
+    //
+    if (writebufferlength < sizeof writebuffer) {
+        writebuffer[writebufferlength] = value;
+        writebufferlength++;
+    }
+}
+
+// ends a packet, when corked it stays in the buffer until uncork() or the threshold
+template<class Transport> void BasicMQTTSocket<Transport>::flush() {
+    if (writeerror) return;
+    //
+    if (writebufferlength < sizeof writebuffer) {
+        if (corked && writebufferlength < corkthreshold) return;
+        //
+        client->clearWriteError();
+        MQTTTransport<Transport>::write(client, writebuffer, writebufferlength);
+        MQTTTransport<Transport>::flush(client);
+        writeerror = (client->getWriteError() != 0);
+    } else {
+        writeerror = true;
+    }
+    //
+    writebufferlength = 0;
+}
+
+// makes room for a packet of at most size bytes by writing out the corked ones
+template<class Transport> void BasicMQTTSocket<Transport>::beginPacket(size_t size) {
+    if (writebufferlength == 0 || writebufferlength + size <= sizeof writebuffer) return;
+    //
+    bool wascorked = corked;
+    corked = false;
+    flush();
+    corked = wascorked;
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::cork(size_t threshold) {
+    corked = true;
+    corkthreshold = threshold < sizeof writebuffer ? threshold : sizeof writebuffer;
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::uncork() {
+    corked = false;
+    //
+    if (writebufferlength > 0) flush();
+    //
+    return isWriteComplete();
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::canReadSocket() {
+    return MQTTTransport<Transport>::available(client) >= (streamremaining > 0 ? 1 : 2);
+}
+
+template<class Transport> const Packet* BasicMQTTSocket<Transport>::receive() {
+    if (streamremaining > 0) return receivePayloadChunks();
+    //
+    uint8_t firstbyte = readByte();//doc byte dau tien
+    size_t length = readPacketLength();
+    memset(&packet, 0, sizeof packet);
+    packet.flags = firstbyte & 15;//0b1111
+    packet.type = firstbyte >> 4;//
+    //check the control header (cmd type + ctrl flag)
+    switch (packet.type) {
+        //handle pub here
+        case PACKET_CONNACK: //connect ack (S-C)
+        {
+            if (length == 2) {
+                packet.sessionpresent = readByte();
+                packet.returncode = readByte();
+                //
+                if (isReadComplete()) return &packet;
+            }
+            //
+            break;
+        }
+        case PACKET_PUBLISH: //Publish msg (C-S or S-C)
+        {
+            if (length < 2) break;
+            //
+            size_t topiclength = readShort();
+            size_t idlength = (packet.flags & 6) > 0 ? 2 : 0; // QoS 1 and 2 carry a packet id
+            length -= 2;
+            // topic and payload are zero terminated in place, a streamed payload passes behind the topic
+            if (topiclength + idlength > length || topiclength + 2 > sizeof readbuffer) break;
+            //
+            size_t payloadlength = length - topiclength - idlength;
+            uint8_t* topic = readbuffer;
+            uint8_t* payload = readbuffer + topiclength + 1;
+            readBytes(topic, topiclength);
+            topic[topiclength] = 0;
+            length -= topiclength;
+            // a broker must not send these, skip the packet
+            if (isReadComplete() && !mqttIsValidTopicName((const char*) topic, topiclength)) break;
+            //
+            if (idlength > 0) packet.packetid = readShort();
+            //
+            length -= idlength;
+            const PayloadLimit* limit = isReadComplete() ? findPayloadLimit((const char*) topic, topiclength) : nullptr;
+            //
+            if (topiclength + payloadlength + 2 > sizeof readbuffer || (limit && payloadlength > limit->maxsize)) {
+                if (!limit) break;
+                //
+                packet.topic = (const char*) topic;
+                packet.topiclength = topiclength;
+                packet.payload = "";
+                packet.streamed = true;
+                streamsink = limit->sink;
+                streamcontext = limit->context;
+                streamoffset = 0;
+                streamremaining = payloadlength;
+                //
+                if (streamsink && !streamsink->begin(streamcontext, packet.topic, payloadlength)) streamsink = nullptr;
+                //
+                return receivePayloadChunks();
+            }
+            //
+            readBytes(payload, payloadlength);
+            payload[payloadlength] = 0;
+            length = 0;
+            //
+            if (isReadComplete()) {
+                packet.topic = (const char*) topic;
+                packet.topiclength = topiclength;
+                packet.payload = (const char*) payload;
+                packet.payloadlength = payloadlength;
+                //
+                return &packet;
+            }
+            //
+            break;
+        }
+        case PACKET_PUBACK: //Publish ack (C-S or S-C)
+        {
+            if (length == 2) {
+                packet.packetid = readShort();
+                //
+                if (isReadComplete()) return &packet;
+            }
+            //
+            break;
+        }
+        //handle sub here
+        case PACKET_SUBACK: //Subcribe ack (S-C)
+        {
+            // the return codes are kept in the read buffer
+            if (length >= 3 && length - 2 <= sizeof readbuffer) {
+                packet.packetid = readShort();
+                packet.returncodecount = length - 2;
+                packet.returncodes = readbuffer;
+                readBytes(readbuffer, packet.returncodecount);
+                packet.returncode = readbuffer[0];
+                length = 0;
+                //
+                if (isReadComplete()) return &packet;
+            }
+            //
+            break;
+        }
+        case PACKET_UNSUBACK:
+        {
+            if (length == 2) {
+                packet.packetid = readShort();
+                //
+                if (isReadComplete()) return &packet;
+            }
+            //
+            break;
+        }
+        case PACKET_PINGRESP: //ping response (S-C)
+        {
+            if (length == 0 && isReadComplete()) return &packet;
+            //
+            break;
+        }
+    }
+    //
+    while (length > 0 && !readerror) {
+        readByte();
+        length--;
+    }
+    //
+    return nullptr;
+}
+
+// as much of the streamed payload as has arrived, the packet once all of it has
+template<class Transport> const Packet* BasicMQTTSocket<Transport>::receivePayloadChunks() {
+    uint8_t* chunk = readbuffer + packet.topiclength + 1;
+    size_t room = sizeof readbuffer - packet.topiclength - 1;
+    //
+    while (streamremaining > 0) {
+        int available = MQTTTransport<Transport>::available(client);
+        //
+        if (available <= 0) return nullptr; // the rest comes with a later receive()
+        //
+        size_t size = streamremaining < room ? streamremaining : room;
+        //
+        if ((size_t) available < size) size = available;
+        //
+        if (!readBytes(chunk, size)) {
+            streamremaining = 0;
+            //
+            if (streamsink) streamsink->end(streamcontext, false);
+            //
+            return nullptr;
+        }
+        //
+        if (streamsink) streamsink->chunk(streamcontext, streamoffset, chunk, size);
+        //
+        streamoffset += size;
+        streamremaining -= size;
+    }
+    //
+    if (streamsink) streamsink->end(streamcontext, true);
+    //
+    return &packet;
+}
+
+template<class Transport> const typename BasicMQTTSocket<Transport>::PayloadLimit* BasicMQTTSocket<Transport>::findPayloadLimit(const char* topic, size_t topiclength) const {
+    for (size_t i = 0; i < limitcount; i++) {
+        if (mqttTopicMatches(limits[i].topicfilter, topic, topiclength)) return &limits[i];
+    }
+    //
+    return nullptr;
+}
+
+template<class Transport> void BasicMQTTSocket<Transport>::close() {
+    if (streamremaining > 0 && streamsink) streamsink->end(streamcontext, false);
+    //
+    streamremaining = 0;
+    MQTTTransport<Transport>::stop(client);
+    writebufferlength = 0;
+    writeerror = false;
+    readerror = false;
+    packetid = 0;
+}
+
+template<class Transport> uint8_t BasicMQTTSocket<Transport>::readByte() {
+    if (readerror) return 0;
+    //
+    int i = MQTTTransport<Transport>::read(client);
+    //
+    if (i < 0) {
+        readerror = true;
+        //
+        return 0;
+    }
+    //
+    return i & 255;
+}
+
+template<class Transport> uint16_t BasicMQTTSocket<Transport>::readShort() {
+    uint16_t value = readByte();
+    value <<= 8;
+    value += readByte();
+    //
+    return value;
+}
+
+template<class Transport> bool BasicMQTTSocket<Transport>::readBytes(uint8_t* value, size_t len) {
+    if (readerror) return false;
+    //
+    if (len > 0 && MQTTTransport<Transport>::read(client, value, len) != (int) len) readerror = true;
+    //
+    return !readerror;
+}
+
+template<class Transport> size_t BasicMQTTSocket<Transport>::readPacketLength() {
+    size_t len = 0;
+    size_t multiplier = 1;
+    //
+    while (true) {
+        uint8_t digit = readByte();
+        len += (digit & 127) * multiplier;
+        multiplier <<= 7;
+        //
+        if ((digit & 128) == 0) break;
+    }
+    //
+    return len;
+}
+
+#endif
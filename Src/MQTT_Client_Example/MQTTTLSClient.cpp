@@ -0,0 +1,343 @@
+#include "MQTTTLSClient.h"
+
+#define __MODULE__ "MQTTTLSClient"
+#ifndef __DEBUG__   //1 errors, 2 warnings, 3 info, 4 debug; lower levels compile to nothing
+   #define __DEBUG__ 3
+#endif
+#include "user_debug.h"
+
+// mbedTLS 3 hides the context fields, 2.28 as in ESP-IDF 4.4 does not
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member
+#endif
+
+MQTTTLSClient::MQTTTLSClient(Client* _transport) {
+  transport = _transport;
+  hostname = NULL;
+  issetup = false;
+  isopen = false;
+  hassession = false;
+  hasca = false;
+  insecure = false;
+  resumed = false;
+  peeked = -1;
+  lasterror = 0;
+  handshakemicros = 0;
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_ssl_config_init(&config);
+  mbedtls_ssl_init(&ssl);
+  mbedtls_x509_crt_init(&ca);
+  mbedtls_ssl_session_init(&session);
+}
+
+MQTTTLSClient::~MQTTTLSClient() {
+  stop();
+  free(hostname);
+  mbedtls_ssl_session_free(&session);
+  mbedtls_x509_crt_free(&ca);
+  mbedtls_ssl_free(&ssl);
+  mbedtls_ssl_config_free(&config);
+  mbedtls_ctr_drbg_free(&drbg);
+  mbedtls_entropy_free(&entropy);
+}
+
+bool MQTTTLSClient::setCACert(const char* pem) {
+  mbedtls_x509_crt_free(&ca);
+  mbedtls_x509_crt_init(&ca);
+  lasterror = mbedtls_x509_crt_parse(&ca, (const unsigned char*) pem, strlen(pem) + 1);
+  hasca = lasterror == 0;
+  //
+  if (issetup) mbedtls_ssl_conf_ca_chain(&config, &ca, NULL);
+  //
+  return hasca;
+}
+
+void MQTTTLSClient::setInsecure() {
+  insecure = true;
+  //
+  if (issetup) mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_NONE);
+}
+
+bool MQTTTLSClient::setHostname(const char* host) {
+  free(hostname);
+  hostname = host ? strdup(host) : NULL;
+  //
+  return hostname || !host;
+}
+
+void MQTTTLSClient::forgetSession() {
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  hassession = false;
+}
+
+// once per client, later connections only reset the context and keep its buffers
+bool MQTTTLSClient::setup() {
+  static const char personalization[] = "MQTTTLSClient";
+  //
+  if (issetup) return true;
+  //
+  lasterror = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char*) personalization, sizeof personalization - 1);
+  //
+  if (lasterror == 0) lasterror = mbedtls_ssl_config_defaults(&config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  //
+  if (lasterror != 0) {
+    ERR("cannot configure TLS: -0x%x\n", -lasterror);
+    //
+    return false;
+  }
+  //
+  mbedtls_ssl_conf_rng(&config, mbedtls_ctr_drbg_random, &drbg);
+  mbedtls_ssl_conf_authmode(&config, insecure ? MBEDTLS_SSL_VERIFY_NONE : MBEDTLS_SSL_VERIFY_REQUIRED);
+  //
+  if (hasca) mbedtls_ssl_conf_ca_chain(&config, &ca, NULL);
+  //
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  lasterror = mbedtls_ssl_setup(&ssl, &config);
+  //
+  if (lasterror != 0) {
+    ERR("cannot set up TLS: -0x%x\n", -lasterror);
+    //
+    return false;
+  }
+  //
+  mbedtls_ssl_set_bio(&ssl, this, sendTo, receiveFrom, NULL);
+  issetup = true;
+  //
+  return true;
+}
+
+int MQTTTLSClient::connect(IPAddress ip, uint16_t port) {
+  // an address alone cannot be checked against the certificate
+  if (!hostname && !insecure) {
+    ERR("no host name to verify the broker, see setHostname()\n");
+    //
+    return 0;
+  }
+  //
+  if (!setup() || !transport->connect(ip, port)) return 0;
+  //
+  return handshake(hostname) ? 1 : 0;
+}
+
+int MQTTTLSClient::connect(const char* host, uint16_t port) {
+  if (!setup() || !transport->connect(host, port)) return 0;
+  //
+  return handshake(host) ? 1 : 0;
+}
+
+bool MQTTTLSClient::handshake(const char* host) {
+  bool offered = false;
+  bool full = false;
+  //
+  mbedtls_ssl_session_reset(&ssl);
+  // SNI and certificate name; connect() has one whenever the certificate is verified
+  if (host) mbedtls_ssl_set_hostname(&ssl, host);
+  resumed = false;
+  peeked = -1;
+  //
+  if (hassession) offered = mbedtls_ssl_set_session(&ssl, &session) == 0;
+  //
+  unsigned long started = micros();
+  unsigned long deadline = millis() + TLS_HANDSHAKE_TIMEOUT;
+  lasterror = 0;
+  //
+  // stepwise, a resumed handshake goes from the server hello straight to change cipher spec
+  while (ssl.MBEDTLS_PRIVATE(state) != MBEDTLS_SSL_HANDSHAKE_OVER) {
+    if (ssl.MBEDTLS_PRIVATE(state) == MBEDTLS_SSL_CLIENT_KEY_EXCHANGE) full = true;
+    //
+    lasterror = mbedtls_ssl_handshake_step(&ssl);
+    //
+    if (lasterror == 0) continue;
+    //
+    if (lasterror != MBEDTLS_ERR_SSL_WANT_READ && lasterror != MBEDTLS_ERR_SSL_WANT_WRITE) break;
+    //
+    if ((long) (millis() - deadline) >= 0) break;
+    //
+    delay(1);
+  }
+  //
+  handshakemicros = micros() - started;
+  //
+  if (ssl.MBEDTLS_PRIVATE(state) != MBEDTLS_SSL_HANDSHAKE_OVER) {
+    ERR("TLS handshake failed: -0x%x\n", -lasterror);
+    // a rejected session must not be offered again
+    forgetSession();
+    transport->stop();
+    //
+    return false;
+  }
+  //
+  lasterror = 0;
+  isopen = true;
+  resumed = offered && !full;
+  saveSession();
+  INFO("TLS handshake %lu us, %s\n", handshakemicros, resumed ? "resumed" : "full");
+  //
+  return true;
+}
+
+void MQTTTLSClient::saveSession() {
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  hassession = mbedtls_ssl_get_session(&ssl, &session) == 0;
+}
+
+int MQTTTLSClient::sendTo(void* context, const unsigned char* buffer, size_t length) {
+  Client* transport = ((MQTTTLSClient*) context)->transport;
+  //
+  if (!transport->connected()) return MBEDTLS_ERR_SSL_CONN_EOF;
+  //
+  size_t written = transport->write(buffer, length);
+  //
+  return written > 0 ? (int) written : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int MQTTTLSClient::receiveFrom(void* context, unsigned char* buffer, size_t length) {
+  Client* transport = ((MQTTTLSClient*) context)->transport;
+  //
+  if (transport->available() <= 0) return transport->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_CONN_EOF;
+  //
+  int received = transport->read(buffer, length);
+  //
+  return received > 0 ? received : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+size_t MQTTTLSClient::write(uint8_t value) {
+  return write(&value, 1);
+}
+
+size_t MQTTTLSClient::write(const uint8_t* buffer, size_t size) {
+  size_t written = 0;
+  unsigned long deadline = millis() + TLS_WRITE_TIMEOUT;
+  //
+  if (!isopen) {
+    setWriteError();
+    //
+    return 0;
+  }
+  //
+  while (written < size) {
+    int result = mbedtls_ssl_write(&ssl, buffer + written, size - written);
+    //
+    if (result > 0) {
+      written += result;
+      //
+      continue;
+    }
+    // a transport that takes nothing would block the scheduler for good
+    if ((result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) || (long) (millis() - deadline) >= 0) {
+      lasterror = result;
+      setWriteError();
+      //
+      break;
+    }
+    //
+    delay(1);
+  }
+  //
+  return written;
+}
+
+int MQTTTLSClient::available() {
+  if (!isopen) return 0;
+  //
+  int buffered = peeked >= 0 ? 1 : 0;
+  //
+  if (mbedtls_ssl_get_bytes_avail(&ssl) == 0 && transport->available() > 0) {
+    mbedtls_ssl_read(&ssl, NULL, 0); // decrypts the next record, if it is complete
+  }
+  //
+  return buffered + mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int MQTTTLSClient::read() {
+  uint8_t value;
+  //
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int MQTTTLSClient::read(uint8_t* buffer, size_t size) {
+  size_t offset = 0;
+  //
+  if (size == 0) return 0;
+  //
+  if (peeked >= 0) {
+    buffer[offset++] = peeked;
+    peeked = -1;
+  }
+  //
+  if (offset < size && available() > 0) {
+    int result = mbedtls_ssl_read(&ssl, buffer + offset, size - offset);
+    //
+    if (result > 0) {
+      offset += result;
+    } else if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      lasterror = result;
+    }
+  }
+  //
+  return offset > 0 ? (int) offset : -1;
+}
+
+int MQTTTLSClient::peek() {
+  if (peeked < 0) {
+    uint8_t value;
+    //
+    if (read(&value, 1) == 1) peeked = value;
+  }
+  //
+  return peeked;
+}
+
+void MQTTTLSClient::flush() {
+  transport->flush();
+}
+
+void MQTTTLSClient::stop() {
+  if (isopen) {
+    mbedtls_ssl_close_notify(&ssl);
+    isopen = false;
+  }
+  //
+  peeked = -1;
+  transport->stop();
+}
+
+uint8_t MQTTTLSClient::connected() {
+  return isopen && (transport->connected() || available() > 0);
+}
+
+void runTLSHandshakeReport(Print& out, MQTTTLSClient& client, const char* host, uint16_t port, int rounds) {
+  char line[96];
+  unsigned long resumedmicros = 0;
+  int resumed = 0;
+  //
+  client.stop();
+  client.forgetSession();
+  //
+  for (int i = 0; i <= rounds; i++) {
+    if (!client.connect(host, port)) {
+      snprintf(line, sizeof line, "handshake %d failed: -0x%x", i, -client.getLastError());
+      out.println(line);
+      //
+      return;
+    }
+    //
+    snprintf(line, sizeof line, "handshake %d %s %lu us", i, client.isSessionResumed() ? "resumed" : "full", client.getHandshakeMicros());
+    out.println(line);
+    //
+    if (client.isSessionResumed()) {
+      resumedmicros += client.getHandshakeMicros();
+      resumed++;
+    }
+    //
+    client.stop();
+  }
+  //
+  snprintf(line, sizeof line, "%d of %d resumed, %lu us on average", resumed, rounds, resumed > 0 ? resumedmicros / resumed : 0);
+  out.println(line);
+}
@@ -0,0 +1,75 @@
+/*
+@Brief : TLS over any Client with session resumption, for MQTTClient and MQTTSocket on port 8883
+ */
+
+#ifndef MQTTTLSClient_h
+#define MQTTTLSClient_h
+
+#include <Client.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+#define TLS_HANDSHAKE_TIMEOUT 10000
+#define TLS_WRITE_TIMEOUT 2000 // ms a write may wait for a stalled transport, then it fails
+
+// The mbedTLS context and its record buffers are set up once and reset between connections.
+// The session of the last connection is offered on the next one, by ticket or by session id,
+// so a reconnect costs one round trip and no public key operations when the broker agrees.
+class MQTTTLSClient : public Client {
+  private:
+    Client* transport;
+    char* hostname; // SNI and certificate name when connecting by address
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_ssl_config config;
+    mbedtls_ssl_context ssl;
+    mbedtls_x509_crt ca;
+    mbedtls_ssl_session session;
+    bool issetup;
+    bool isopen;
+    bool hassession;
+    bool hasca;
+    bool insecure;
+    bool resumed;
+    int peeked; // byte read by peek(), or -1
+    int lasterror;
+    unsigned long handshakemicros;
+
+    bool setup();
+    bool handshake(const char* host);
+    void saveSession();
+    static int sendTo(void* context, const unsigned char* buffer, size_t length);
+    static int receiveFrom(void* context, unsigned char* buffer, size_t length);
+
+  public:
+    MQTTTLSClient(Client* transport);
+    virtual ~MQTTTLSClient();
+    bool setCACert(const char* pem);
+    void setInsecure(); // encrypts, but trusts any broker
+    // the broker's name for connect(IPAddress), e.g. after MQTTClient resolved it; without it only setInsecure() connects
+    bool setHostname(const char* host);
+    void forgetSession();
+    bool isSessionResumed() const { return resumed; }
+    unsigned long getHandshakeMicros() const { return handshakemicros; }
+    int getLastError() const { return lasterror; } // mbedTLS error code
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char* host, uint16_t port);
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* buffer, size_t size);
+    int available();
+    int read();
+    int read(uint8_t* buffer, size_t size);
+    int peek();
+    void flush();
+    void stop();
+    uint8_t connected();
+    operator bool() { return connected(); }
+};
+
+// a full handshake, then rounds resumed ones against a broker or a local stand-in such as mosquitto, e.g. on port 8883
+void runTLSHandshakeReport(Print& out, MQTTTLSClient& client, const char* host, uint16_t port, int rounds);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+@Brief : static dispatch to the transport of a BasicMQTTSocket, and an in-memory loopback transport
+ */
+
+#ifndef MQTTTransport_h
+#define MQTTTransport_h
+
+#include <Client.h>
+
+#define LOOPBACK_SIZE 1024 // bytes written and not read yet, power of 2
+
+// Calls on a concrete transport are qualified, so they bind at compile time and the write and read paths
+// inline. The object must be exactly a Transport, not of a class derived from it.
+template<class Transport> struct MQTTTransport {
+  static int connect(Transport* t, IPAddress ip, uint16_t port) { return t->Transport::connect(ip, port); }
+  static int connect(Transport* t, const char* host, uint16_t port) { return t->Transport::connect(host, port); }
+  static size_t write(Transport* t, const uint8_t* buffer, size_t size) { return t->Transport::write(buffer, size); }
+  static void flush(Transport* t) { t->Transport::flush(); }
+  static int available(Transport* t) { return t->Transport::available(); }
+  static int read(Transport* t) { return t->Transport::read(); }
+  static int read(Transport* t, uint8_t* buffer, size_t size) { return t->Transport::read(buffer, size); }
+  static void stop(Transport* t) { t->Transport::stop(); }
+};
+
+// the type-erased form, any Client through its virtual calls
+template<> struct MQTTTransport<Client> {
+  static int connect(Client* t, IPAddress ip, uint16_t port) { return t->connect(ip, port); }
+  static int connect(Client* t, const char* host, uint16_t port) { return t->connect(host, port); }
+  static size_t write(Client* t, const uint8_t* buffer, size_t size) { return t->write(buffer, size); }
+  static void flush(Client* t) { t->flush(); }
+  static int available(Client* t) { return t->available(); }
+  static int read(Client* t) { return t->read(); }
+  static int read(Client* t, uint8_t* buffer, size_t size) { return t->read(buffer, size); }
+  static void stop(Client* t) { t->stop(); }
+};
+
+// Reads back what was written, e.g. to measure a codec without a network. Writes beyond LOOPBACK_SIZE unread
+// bytes are cut short.
+class MQTTLoopback final : public Client {
+  private:
+    uint8_t buffer[LOOPBACK_SIZE];
+    size_t head; // next byte to read
+    size_t length;
+    bool open;
+
+  public:
+    MQTTLoopback() : head(0), length(0), open(false) { }
+    int connect(IPAddress, uint16_t) { open = true; return 1; }
+    int connect(const char*, uint16_t) { open = true; return 1; }
+    size_t write(uint8_t value) { return write(&value, 1); }
+    size_t write(const uint8_t* bytes, size_t size) {
+      if (size > LOOPBACK_SIZE - length) size = LOOPBACK_SIZE - length;
+      //
+      for (size_t i = 0; i < size; i++) buffer[(head + length + i) & (LOOPBACK_SIZE - 1)] = bytes[i];
+      //
+      length += size;
+      //
+      return size;
+    }
+    int available() { return length; }
+    int read() {
+      if (length == 0) return -1;
+      //
+      uint8_t value = buffer[head];
+      head = (head + 1) & (LOOPBACK_SIZE - 1);
+      length--;
+      //
+      return value;
+    }
+    int read(uint8_t* bytes, size_t size) {
+      if (length == 0) return -1;
+      //
+      if (size > length) size = length;
+      //
+      for (size_t i = 0; i < size; i++) bytes[i] = buffer[(head + i) & (LOOPBACK_SIZE - 1)];
+      //
+      head = (head + size) & (LOOPBACK_SIZE - 1);
+      length -= size;
+      //
+      return size;
+    }
+    int peek() { return length > 0 ? buffer[head] : -1; }
+    void flush() { }
+    void stop() { open = false; head = 0; length = 0; }
+    uint8_t connected() { return open; }
+    operator bool() { return open; }
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include <string.h>
+#include "MQTTValidate.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// byte-wise tests on a whole word, e.g. 4 bytes on the ESP32
+static const size_t ONES = (size_t) -1 / 255;
+static const size_t HIGHS = ONES * 128;
+
+static inline size_t hasZeroByte(size_t word) {
+  return (word - ONES) & ~word & HIGHS;
+}
+
+// length of the leading run of ASCII bytes that need no further check: no NUL, and no wildcard if rejected
+static size_t plainPrefix(const uint8_t* value, size_t length, bool rejectwildcards) {
+  size_t i = 0;
+  //
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i plus = _mm_set1_epi8('+');
+  const __m128i hash = _mm_set1_epi8('#');
+  //
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*) (value + i));
+    __m128i stop = _mm_cmpeq_epi8(chunk, zero);
+    //
+    if (rejectwildcards) stop = _mm_or_si128(stop, _mm_or_si128(_mm_cmpeq_epi8(chunk, plus), _mm_cmpeq_epi8(chunk, hash)));
+    // the sign bits are the non-ASCII bytes
+    if (_mm_movemask_epi8(_mm_or_si128(stop, chunk)) != 0) return i;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 16 <= length; i += 16) {
+    uint8x16_t chunk = vld1q_u8(value + i);
+    uint8x16_t stop = vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(0)), vcgeq_u8(chunk, vdupq_n_u8(128)));
+    //
+    if (rejectwildcards) stop = vorrq_u8(stop, vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('+')), vceqq_u8(chunk, vdupq_n_u8('#'))));
+    //
+    if (vmaxvq_u8(stop) != 0) return i;
+  }
+#endif
+  //
+  for (; i + sizeof(size_t) <= length; i += sizeof(size_t)) {
+    size_t word;
+    memcpy(&word, value + i, sizeof word);
+    size_t stop = (word & HIGHS) | hasZeroByte(word);
+    //
+    if (rejectwildcards) stop |= hasZeroByte(word ^ (ONES * '+')) | hasZeroByte(word ^ (ONES * '#'));
+    //
+    if (stop != 0) return i;
+  }
+  //
+  return i;
+}
+
+static bool isValid(const uint8_t* value, size_t length, bool rejectwildcards) {
+  size_t i = 0;
+  //
+  while (i < length) {
+    i += plainPrefix(value + i, length - i, rejectwildcards);
+    //
+    if (i >= length) break;
+    //
+    uint8_t c = value[i];
+    //
+    if (c < 128) {
+      if (c == 0 || (rejectwildcards && (c == '+' || c == '#'))) return false;
+      //
+      i++;
+      continue;
+    }
+    //
+    size_t n;
+    uint32_t codepoint;
+    uint32_t minimum; // shorter encodings are overlong
+    //
+    if ((c & 0xE0) == 0xC0) {
+      n = 1;
+      codepoint = c & 0x1F;
+      minimum = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+      n = 2;
+      codepoint = c & 0x0F;
+      minimum = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+      n = 3;
+      codepoint = c & 0x07;
+      minimum = 0x10000;
+    } else {
+      return false;
+    }
+    //
+    if (n >= length - i) return false;
+    //
+    for (size_t k = 1; k <= n; k++) {
+      uint8_t b = value[i + k];
+      //
+      if ((b & 0xC0) != 0x80) return false;
+      //
+      codepoint = (codepoint << 6) | (b & 0x3F);
+    }
+    //
+    if (codepoint < minimum || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) return false;
+    //
+    i += n + 1;
+  }
+  //
+  return true;
+}
+
+bool mqttIsValidUtf8(const uint8_t* value, size_t length) {
+  return isValid(value, length, false);
+}
+
+bool mqttIsValidTopicName(const char* topic, size_t length) {
+  if (length == 0 || length > 65535) return false;
+  //
+  return isValid((const uint8_t*) topic, length, true);
+}
+
+bool mqttIsValidTopicFilter(const char* filter, size_t length) {
+  if (length == 0 || length > 65535 || !isValid((const uint8_t*) filter, length, false)) return false;
+  //
+  for (size_t i = 0; i < length; i++) {
+    if (filter[i] != '+' && filter[i] != '#') continue;
+    //
+    bool levelstart = i == 0 || filter[i - 1] == '/';
+    bool levelend = i + 1 == length || filter[i + 1] == '/';
+    //
+    if (!levelstart || !levelend) return false;
+    //
+    if (filter[i] == '#' && i + 1 != length) return false;
+  }
+  //
+  return true;
+}
+
+bool mqttTopicMatches(const char* filter, const char* topic, size_t length) {
+  if (length > 0 && topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) return false;
+  //
+  size_t i = 0;
+  //
+  for (; *filter; filter++) {
+    if (*filter == '#') return true;
+    //
+    if (*filter == '+') {
+      while (i < length && topic[i] != '/') i++;
+      //
+      continue;
+    }
+    //
+    if (i < length && topic[i] == *filter) {
+      i++;
+      continue;
+    }
+    // "a/#" matches "a" too
+    return i == length && filter[0] == '/' && filter[1] == '#';
+  }
+  //
+  return i == length;
+}
@@ -0,0 +1,20 @@
+/*
+@Brief : UTF-8 and topic validation for outgoing and incoming MQTT strings
+ */
+
+#ifndef MQTTValidate_h
+#define MQTTValidate_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// well-formed UTF-8 without U+0000, as MQTT 1.5.3 requires for every string
+bool mqttIsValidUtf8(const uint8_t* value, size_t length);
+// a topic name to PUBLISH to: 1 to 65535 bytes, no wildcards
+bool mqttIsValidTopicName(const char* topic, size_t length);
+// a topic filter to SUBSCRIBE to: '+' fills a whole level, '#' the last one
+bool mqttIsValidTopicFilter(const char* filter, size_t length);
+// a topic name against a valid, zero terminated filter; wildcards in the first level do not match $SYS and the like
+bool mqttTopicMatches(const char* filter, const char* topic, size_t length);
+
+#endif
@@ -1,120 +1,198 @@
-#include <Client.h>
-#include <WiFi.h>
-#include "Multitasking.h"
-#include "MQTTClient.h"
-
-#define _DEBUG_ 1
-#define USER_BUTTON 0
-bool Wifi_Connect();
-
-char ssid[] = "TP-Link_EE70";
-char pass[] = "dung01021994";
-char host[] = "broker.hivemq.com";//broker.hivemq.com
-// char host[] = "192.168.0.102";//broker.hivemq.com
-uint16_t port = 1883;//1883
-char clientid[] = "1234";
-char username[] = "Dev1";
-char password[] = "1234";
-char topicname1[] = "dung/hello";
-char topicname2[] = "dung/allo";
-char topicname3[] = "dung/hallo";
-
-CooperativeMultitasking tasks;
-WiFiClient wificlient;
-MQTTClient mqttclient(&tasks, &wificlient, host, port, clientid, username, password);
-// MQTTTopic topic(&mqttclient, topicname);
-
-Guard isPressed;
-Continuation check_connection;
-Continuation publish_task;
-
-void setup() {
-  Serial.begin(115200);
-  pinMode(USER_BUTTON, INPUT_PULLUP);
-  Wifi_Connect();
-  tasks.now(task_schedule);
-}
-
-void loop() {
-  tasks.run(); // receive connect acknowledgement, send publish, receive publish acknowledgement
-}
-
-bool Wifi_Connect(){
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(ssid, pass);
-    for (int i=0; i<50; i++){
-      if (WiFi.status() != WL_CONNECTED) {
-          delay(500);
-          Serial.print(".");
-      }
-      else{
-          break;
-      }
-    }
-
-    // Make sure that we're actually connected, otherwise go to deep sleep
-    if(WiFi.status() != WL_CONNECTED){
-        Serial.println("");
-        Serial.println("OPPS!!!");
-        /* Epaper_Display_Error_WiFi(); */
-        return false;
-        //goToDeepSleep();
-    }
-    #if _DEBUG_
-        Serial.println("");
-        Serial.println("WiFi connected");
-        Serial.println("IP address: ");
-        Serial.println(WiFi.localIP());
-    #endif
-}
-
-bool isPressed(){
-  return (!digitalRead(USER_BUTTON));
-}
-
-void publish_task(){
-  Serial.println("mqtt publish!");
-  if (mqttclient.connect()) {
-    // delay(100);
-    String str1 = "Hi, this is msg no.1";
-    const char *c1 = str1.c_str();
-    mqttclient.publish(true, topicname1,c1);
-
-    String str2 = "Hi, this is msg no.2";
-    const char *c2 = str2.c_str();
-    mqttclient.publish(true, topicname2,c2);
-
-    String str3 = "Hi, this is msg no.3";
-    const char *c3 = str3.c_str();
-    mqttclient.publish(true, topicname3,c3);
-
-    while (tasks.available()) {
-      tasks.run();
-    }
-  }
-  else{
-    Serial.println("Can not connect to broker!");
-    Serial.println();
-  }
-  mqttclient.disconnect();
-  Serial.println("Disconnected broker!");
-  tasks.now(task_schedule);
-}
-
-void check_connection(){
-  Serial.println("Check connection...");
-  switch (WiFi.status()) {
-    case WL_CONNECT_FAILED:
-    case WL_CONNECTION_LOST:
-    case WL_DISCONNECTED: WiFi.begin(ssid, pass); // reconnect WiFi if necessary
-  }
-  tasks.now(task_schedule);
-}
-
-void task_schedule() {
-  Serial.println("Main");
-  auto task1 = tasks.after(10000, check_connection); // call on() in 10000 ms
-  auto task2 = tasks.ifThen(isPressed, publish_task); // if isPressed() then call publish_task()
-  // auto task3 = tasks.ifThen(isSerial, check);
-  tasks.onlyOneOf(task1, task2); // do either task1 or task2
+#include <Client.h>
+#include <WiFi.h>
+#include "Multitasking.h"
+#include "MQTTClient.h"
+#include "user_debug.h"
+#include "MQTTDNSCache.h"
+// #define USE_TLS // broker on port 8883
+#ifdef USE_TLS
+#include "MQTTTLSClient.h"
+#endif
+#ifdef RUN_CODEC_BENCHMARK
+#include "MQTTCodecBenchmark.h"
+#endif
+#ifdef RUN_LINK_SIMULATION
+#include "MQTTSimulation.h"
+#endif
+#ifdef RUN_LOAD_GENERATOR
+#include "MQTTLoadGenerator.h"
+#endif
+#ifdef RUN_FOOTPRINT_REPORT
+#include "MQTTSocket.h"
+#endif
+
+#define _DEBUG_ 1
+#define USER_BUTTON 0
+bool Wifi_Connect();
+void IRAM_ATTR on_press(); // attached to the button interrupt
+
+char ssid[] = "TP-Link_EE70";
+char pass[] = "dung01021994";
+char host[] = "broker.hivemq.com";//broker.hivemq.com
+// char host[] = "192.168.0.102";//broker.hivemq.com
+#ifdef USE_TLS
+uint16_t port = 8883;
+#else
+uint16_t port = 1883;//1883
+#endif
+char clientid[] = "1234";
+char username[] = "Dev1";
+char password[] = "1234";
+char topicname1[] = "dung/hello";
+char topicname2[] = "dung/allo";
+char topicname3[] = "dung/hallo";
+
+#ifdef COOPERATIVE_MULTITASKING_STATIC
+StaticMultitasking<32> tasks;
+#else
+CooperativeMultitasking tasks;
+#endif
+#ifdef MQTT_STATIC_MEMORY
+typedef StaticMQTTClient<16, 128> SketchClient; // 16 queued publishes of up to 128 bytes
+#else
+typedef MQTTClient SketchClient;
+#endif
+WiFiClient wificlient;
+#ifdef USE_TLS
+MQTTTLSClient tlsclient(&wificlient); // keeps the TLS session, reconnects resume it
+SketchClient mqttclient(&tasks, &tlsclient, host, port, clientid, username, password);
+#else
+SketchClient mqttclient(&tasks, &wificlient, host, port, clientid, username, password);
+#endif
+// MQTTTopic topic(&mqttclient, topicname);
+
+CooperativeMultitasking::Event pressed; // signalled by the button interrupt, nothing is polled
+Continuation check_connection;
+Continuation publish_task;
+
+void setup() {
+  Serial.begin(115200);
+#ifdef RUN_CODEC_BENCHMARK
+  runCodecBenchmark(Serial, 10000);
+#endif
+#ifdef RUN_LINK_SIMULATION
+  runLinkSimulation(Serial, 3600000, 10); // an hour losing 10% of the packets, in virtual time
+  runSimulationChecks(Serial);
+#endif
+#ifdef RUN_LOAD_GENERATOR
+  {
+    // 50 simulated devices publishing 64 bytes every 5 s for 10 virtual minutes
+    MQTTLoadProfile profile = { 50, NULL, 1883, NULL, NULL, "fleet/%u/telemetry", 64, 5000, 600000, 40, 1 };
+    MQTTLoadReport report;
+    //
+    if (runLoadGenerator(profile, report)) {
+      printLoadReport(Serial, report);
+      printLoadReportJson(Serial, report);
+    }
+  }
+#endif
+#ifdef RUN_FOOTPRINT_REPORT
+  Serial.print("scheduler ");
+  Serial.print(tasks.getFootprint());
+  Serial.print(" bytes, ");
+  Serial.print(tasks.getCapacity());
+  Serial.println(" tasks");
+  mqttclient.printFootprint(Serial);
+  Serial.print("mqtt socket ");
+  Serial.print(sizeof(MQTTSocket));
+  Serial.println(" bytes");
+#endif
+  pinMode(USER_BUTTON, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(USER_BUTTON), on_press, FALLING);
+#ifdef USE_TLS
+  tlsclient.setInsecure(); // or tlsclient.setCACert(pem) with the broker's CA
+  tlsclient.setHostname(host); // MQTTClient connects by the resolved address
+#endif
+  Wifi_Connect();
+#if defined(USE_TLS) && defined(RUN_TLS_HANDSHAKE_REPORT)
+  runTLSHandshakeReport(Serial, tlsclient, host, port, 5); // full, then resumed handshake times
+#endif
+  // the broker address is looked up once per DNS_CACHE_TTL, not on every connect
+  mqttSetResolver([] (const char* name, IPAddress& address) -> bool { return WiFi.hostByName(name, address) == 1; });
+  tasks.now(task_schedule);
+}
+
+void loop() {
+  tasks.run(); // receive connect acknowledgement, send publish, receive publish acknowledgement
+  user_debug_drain(4); // format the library's log records off the hot path
+}
+
+bool Wifi_Connect(){
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(ssid, pass);
+    for (int i=0; i<50; i++){
+      if (WiFi.status() != WL_CONNECTED) {
+          delay(500);
+          Serial.print(".");
+      }
+      else{
+          break;
+      }
+    }
+
+    // Make sure that we're actually connected, otherwise go to deep sleep
+    if(WiFi.status() != WL_CONNECTED){
+        Serial.println("");
+        Serial.println("OPPS!!!");
+        /* Epaper_Display_Error_WiFi(); */
+        return false;
+        //goToDeepSleep();
+    }
+    #if _DEBUG_
+        Serial.println("");
+        Serial.println("WiFi connected");
+        Serial.println("IP address: ");
+        Serial.println(WiFi.localIP());
+    #endif
+}
+
+void IRAM_ATTR on_press(){
+  tasks.signalFromInterrupt(&pressed);
+}
+
+void publish_task(){
+  Serial.println("mqtt publish!");
+  if (mqttclient.connect()) {
+    // delay(100);
+    String str1 = "Hi, this is msg no.1";
+    const char *c1 = str1.c_str();
+    mqttclient.publish(true, topicname1,c1);
+
+    String str2 = "Hi, this is msg no.2";
+    const char *c2 = str2.c_str();
+    mqttclient.publish(true, topicname2,c2);
+
+    String str3 = "Hi, this is msg no.3";
+    const char *c3 = str3.c_str();
+    mqttclient.publish(true, topicname3,c3);
+
+    while (tasks.available()) {
+      tasks.run();
+    }
+  }
+  else{
+    Serial.println("Can not connect to broker!");
+    Serial.println();
+  }
+  mqttclient.disconnect();
+  Serial.println("Disconnected broker!");
+  tasks.now(task_schedule);
+}
+
+void check_connection(){
+  Serial.println("Check connection...");
+  switch (WiFi.status()) {
+    case WL_CONNECT_FAILED:
+    case WL_CONNECTION_LOST:
+    case WL_DISCONNECTED: WiFi.begin(ssid, pass); // reconnect WiFi if necessary
+  }
+  tasks.now(task_schedule);
+}
+
+void task_schedule() {
+  Serial.println("Main");
+  auto task1 = tasks.after(10000, check_connection); // call on() in 10000 ms
+  auto task2 = tasks.onEvent(&pressed, publish_task); // when the button is pressed call publish_task()
+  // auto task3 = tasks.ifThen(isSerial, check);
+  tasks.onlyOneOf(task1, task2); // do either task1 or task2
 }
\ No newline at end of file
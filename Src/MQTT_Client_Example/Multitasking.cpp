@@ -1,325 +1,810 @@
-/*
- * Copyright (C) 2018 Andreas Motzek andreas-motzek@t-online.de
- *
- * This file is part of the Cooperative Multitasking package.
- *
- * You can use, redistribute and/or modify this file under the terms of the Modified Artistic License.
- * See http://simplysomethings.de/open+source/modified+artistic+license.html for details.
- *
- * This file is distributed in the hope that it will be useful, but without any warranty; without even
- * the implied warranty of merchantability or fitness for a particular purpose.
- */
-
-#include "Multitasking.h"
-
-CooperativeMultitasking::CooperativeMultitasking(int _capacity) {
-  capacity = _capacity;
-  heap = new Task*[capacity + 1];
-  count = 0;
-  cycle = 100 >> 1;
-}
-
-CooperativeMultitasking::~CooperativeMultitasking() {
-  for (int i = 1; i < count; i++) {
-    delete heap[i];
-    heap[i] = NULL;
-  }
-  //
-  delete[] heap;
-  heap = NULL;
-  capacity = 0;
-  count = 0;
-}
-
-CooperativeMultitasking::Task* CooperativeMultitasking::now(Continuation* continuation, int priority) {
-  if (!continuation || isFull()) return NULL;
-  //
-  Task* task = create(millis() >> 1, priority, continuation);
-  add(task);
-  //
-  return task;
-}
-
-CooperativeMultitasking::Task* CooperativeMultitasking::after(unsigned long duration, Continuation* continuation, int priority) {
-  if (!continuation || isFull()) return NULL;
-  //
-  Task* task = create((millis() >> 1) + (duration >> 1), priority, continuation);
-  add(task);
-  //
-  return task;
-}
-
-CooperativeMultitasking::Task* CooperativeMultitasking::ifForThen(Guard* guard, unsigned long duration, Continuation* continuation, int priority) {
-  if (!guard || !continuation || isFull()) return NULL;
-  //
-  Task* task = create(millis() >> 1, priority, continuation, guard, duration >> 1, duration >> 1);
-  add(task);
-  //
-  return task;
-}
-
-CooperativeMultitasking::Task* CooperativeMultitasking::ifThen(Guard* guard, Continuation* continuation, int priority) {
-  return ifForThen(guard, 0, continuation, priority);
-}
-
-void CooperativeMultitasking::onlyOneOf(Task* task1, Task* task2) {
-  if (task1 && task2) {
-    task1->sibling1 = task2;
-    task2->sibling1 = task1;
-  }
-}
-
-void CooperativeMultitasking::onlyOneOf(Task* task1, Task* task2, Task* task3) {
-  if (task1 && task2 && task3) {
-    task1->sibling1 = task2;
-    task1->sibling2 = task3;
-    task2->sibling1 = task1;
-    task2->sibling2 = task3;
-    task3->sibling1 = task1;
-    task3->sibling2 = task2;
-  } else {
-    onlyOneOf(task1, task2);
-    onlyOneOf(task1, task3);
-    onlyOneOf(task2, task3);
-  }
-}
-
-void CooperativeMultitasking::onlyOneOf(Task* task1, Task* task2, Task* task3, Task* task4) {
-  if (task1 && task2 && task3 && task4) {
-    task1->sibling1 = task2;
-    task1->sibling2 = task3;
-    task1->sibling3 = task4;
-    task2->sibling1 = task1;
-    task2->sibling2 = task3;
-    task2->sibling3 = task4;
-    task3->sibling1 = task1;
-    task3->sibling2 = task2;
-    task3->sibling3 = task4;
-    task4->sibling1 = task1;
-    task4->sibling2 = task2;
-    task4->sibling3 = task3;
-  } else {
-    onlyOneOf(task1, task2, task3);
-    onlyOneOf(task1, task2, task4);
-    onlyOneOf(task1, task3, task4);
-    onlyOneOf(task2, task3, task4);
-  }
-}
-
-int CooperativeMultitasking::available() {
-  return count;
-}
-
-void CooperativeMultitasking::run() {
-  unsigned long now = millis() >> 1;
-  //
-  if (last > now) handleOverflow();
-  //
-  last = now;
-  Task* task = extract(1);
-  //
-  if (!task) {
-    wait(cycle);
-    //
-    return;
-  }
-  //
-  if (now < task->when) wait(task->when - now);
-  //
-  if (task->guard) {
-    bool result = task->guard();
-    //
-    if (result) {
-      if (task->remaining > cycle) {
-        task->remaining -= cycle;
-        task->when = now + cycle;
-        add(task);
-        //
-        return;
-      }
-    } else {
-      task->remaining = task->duration;
-      task->when = now + cycle;
-      add(task);
-      //
-      return;
-    }
-  }
-  //
-  if (task->sibling1) {
-    remove(task->sibling1);
-    delete task->sibling1;
-  }
-  //
-  if (task->sibling2) {
-    remove(task->sibling2);
-    delete task->sibling2;
-  }
-  //
-  if (task->sibling3) {
-    remove(task->sibling3);
-    delete task->sibling3;
-  }
-  //
-  Continuation* continuation = task->continuation;
-  delete task;
-  continuation();
-}
-
-void CooperativeMultitasking::handleOverflow() {
-  for (int i = 1; i <= count; i++) {
-    Task* task = heap[i];
-    //
-    if (task->when & 0x80000000) {
-      task->when &= 0x7fffffff; // clear overflow
-    } else {
-      task->when = 0; // was due before the overflow
-    }
-  }
-  //
-  for (int i = 1; i <= count; i++) {
-    bottomUp(i); // restore heap
-  }
-}
-
-CooperativeMultitasking::Task* CooperativeMultitasking::create(unsigned long when, int priority, Continuation* continuation, Guard* guard, unsigned long duration, unsigned long remaining) {
-  Task* task = new Task(); // std::nothrow is default
-  //
-  if (task) {
-    task->when = when;
-    task->priority = priority;
-    task->continuation = continuation;
-    task->guard = guard;
-    task->duration = duration;
-    task->remaining = remaining;
-    task->sibling1 = NULL;
-    task->sibling2 = NULL;
-    task->sibling3 = NULL;
-  }
-  //
-  return task;
-}
-
-void CooperativeMultitasking::add(Task* task) {
-  if (task) {
-    heap[++count] = task;
-    bottomUp(count);
-  }
-}
-
-CooperativeMultitasking::Task* CooperativeMultitasking::extract(int i) {
-  if (isOutside(i)) return NULL;
-  //
-  Task* task = heap[i];
-  topDown(i);
-  //
-  return task;
-}
-
-void CooperativeMultitasking::remove(const Task* task) {
-  int i = find(task);
-  //
-  if (isInside(i)) topDown(i);
-}
-
-int CooperativeMultitasking::find(const Task* task, int i) {
-  while (!isLeaf(i)) {
-    if (heap[i] == task) return i;
-    //
-    if (isBefore(task, heap[i])) return 0;
-    //
-    int r = rightChild(i);
-    //
-    if (isInside(r))
-    {
-      int j = find(task, r);
-      //
-      if (isInside(j)) return j;
-    }
-    //
-    i = leftChild(i);
-  }
-  //
-  if (heap[i] == task) return i;
-  //
-  return 0;
-}
-
-void CooperativeMultitasking::bottomUp(int i) {
-  while (hasParent(i)) {
-    int p = parent(i);
-    //
-    if (isBefore(heap[i], heap[p])) {
-      Task* task = heap[i];
-      heap[i] = heap[p];
-      heap[p] = task;
-      i = p;
-    } else {
-      return;
-    }
-  }
-}
-
-void CooperativeMultitasking::topDown(int i) {
-  while (!isLeaf(i)) {
-    int l = leftChild(i);
-    int r = rightChild(i);
-    //
-    if (isInside(r) && isBefore(heap[r], heap[l])) {
-      heap[i] = heap[r];
-      i = r;
-    } else {
-      heap[i] = heap[l];
-      i = l;
-    }
-  }
-  //
-  if (i == count) {
-    heap[i] = NULL;
-    count--;
-  } else {
-    heap[i] = heap[count];
-    heap[count--] = NULL;
-    bottomUp(i);
-  }
-}
-
-bool CooperativeMultitasking::isBefore(const Task* task1, const Task* task2) {
-  if (task1->when < task2->when) return true;
-  //
-  if (task1->when == task2->when && task1->priority > task2->priority) return true;
-  //
-  return false;
-}
-
-inline bool CooperativeMultitasking::isFull() {
-  return count >= capacity;
-}
-
-inline bool CooperativeMultitasking::isOutside(int i) {
-  return i < 1 || i > count;
-}
-
-inline bool CooperativeMultitasking::isInside(int i) {
-  return i >= 1 && i <= count;
-}
-
-inline bool CooperativeMultitasking::isLeaf(int i) {
-  return i > (count >> 1);
-}
-
-inline bool CooperativeMultitasking::hasParent(int i) {
-  return i > 1;
-}
-
-inline int CooperativeMultitasking::parent(int i) {
-  return i >> 1;
-}
-
-inline int CooperativeMultitasking::leftChild(int i) {
-  return i << 1;
-}
-
-inline int CooperativeMultitasking::rightChild(int i) {
-  return (i << 1) + 1;
+/*
+ * Copyright (C) 2018 Andreas Motzek andreas-motzek@t-online.de
+ *
+ * This file is part of the Cooperative Multitasking package.
+ *
+ * You can use, redistribute and/or modify this file under the terms of the Modified Artistic License.
+ * See http://simplysomethings.de/open+source/modified+artistic+license.html for details.
+ *
+ * This file is distributed in the hope that it will be useful, but without any warranty; without even
+ * the implied warranty of merchantability or fitness for a particular purpose.
+ */
+
+#include "Multitasking.h"
+
+#ifndef COOPERATIVE_MULTITASKING_STATIC
+CooperativeMultitasking::CooperativeMultitasking(int _capacity) {
+  capacity = _capacity;
+  slots = new Task[capacity];
+  heap = new Task*[capacity + 1];
+  owned = true;
+  footprint = sizeof(CooperativeMultitasking) + capacity * sizeof(Task) + (capacity + 1) * sizeof(Task*);
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+  trace = new TraceRecord[COOPERATIVE_MULTITASKING_TRACE_SIZE];
+  footprint += COOPERATIVE_MULTITASKING_TRACE_SIZE * sizeof(TraceRecord);
+#endif
+  initialize();
+}
+#endif
+
+CooperativeMultitasking::CooperativeMultitasking(int _capacity, Task* _slots, Task** _heap) {
+  capacity = _capacity;
+  slots = _slots;
+  heap = _heap;
+  owned = false;
+  footprint = sizeof(CooperativeMultitasking); // the StaticMultitasking knows its size
+#if defined(COOPERATIVE_MULTITASKING_TRACE) && !defined(COOPERATIVE_MULTITASKING_STATIC)
+  trace = new TraceRecord[COOPERATIVE_MULTITASKING_TRACE_SIZE];
+#endif
+  initialize();
+}
+
+void CooperativeMultitasking::initialize() {
+  freeslots = NULL;
+  //
+  for (int i = capacity - 1; i >= 0; i--) {
+    slots[i].generation = 0;
+    slots[i].continuation = NULL;
+    slots[i].bound = NULL;
+    slots[i].nextwaiter = freeslots;
+    freeslots = &slots[i];
+  }
+  //
+  count = 0;
+  overflows = 0;
+  pendingevents = NULL;
+  cycle = ticks(100);
+  timesource = NULL;
+#ifdef COOPERATIVE_MULTITASKING_MICROS
+  lastmicros = micros();
+  elapsed = lastmicros; // the low 32 bits stay equal to micros()
+#else
+  last = 0;
+#endif
+  woken = false;
+  onwake = NULL;
+  memset(wakelisteners, 0, sizeof wakelisteners);
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+  tracecount = 0;
+  memset(names, 0, sizeof names);
+#endif
+}
+
+CooperativeMultitasking::~CooperativeMultitasking() {
+#ifndef COOPERATIVE_MULTITASKING_STATIC
+  if (owned) {
+    delete[] slots;
+    delete[] heap;
+  }
+  //
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+  delete[] trace;
+  trace = NULL;
+#endif
+#endif
+  slots = NULL;
+  heap = NULL;
+  capacity = 0;
+  count = 0;
+}
+
+TaskHandle CooperativeMultitasking::now(Continuation* continuation, int priority) {
+  if (!continuation || isFull()) return 0;
+  //
+  return schedule(create(clock(), priority, continuation));
+}
+
+TaskHandle CooperativeMultitasking::after(unsigned long duration, Continuation* continuation, int priority) {
+  if (!continuation || isFull()) return 0;
+  //
+  return schedule(create(clock() + ticks(duration), priority, continuation));
+}
+
+TaskHandle CooperativeMultitasking::afterMicros(unsigned long duration, Continuation* continuation, int priority) {
+  if (!continuation || isFull()) return 0;
+  //
+#ifdef COOPERATIVE_MULTITASKING_MICROS
+  return schedule(create(clock() + duration, priority, continuation));
+#else
+  return schedule(create(clock() + ((duration + 1999) / 2000), priority, continuation));
+#endif
+}
+
+TaskHandle CooperativeMultitasking::ifForThen(Guard* guard, unsigned long duration, Continuation* continuation, int priority) {
+  if (!guard || !continuation || isFull()) return 0;
+  //
+  return schedule(create(clock(), priority, continuation, guard, ticks(duration), ticks(duration)));
+}
+
+TaskHandle CooperativeMultitasking::ifThen(Guard* guard, Continuation* continuation, int priority) {
+  return ifForThen(guard, 0, continuation, priority);
+}
+
+// onlyOneOf() works with a parked task, e.g. against an after() timeout
+TaskHandle CooperativeMultitasking::onEvent(Event* event, Continuation* continuation, int priority) {
+  if (!event || !continuation || isFull()) return 0;
+  //
+  Task* task = create(0, priority, continuation);
+  task->event = event;
+  //
+  if (event->waiterstail) event->waiterstail->nextwaiter = task;
+  else event->waiters = task;
+  //
+  event->waiterstail = task;
+  //
+  return handleOf(task);
+}
+
+TaskHandle CooperativeMultitasking::now(ContextContinuation* continuation, void* context, int priority) {
+  if (!continuation || isFull()) return 0;
+  //
+  return schedule(bind(create(clock(), priority, NULL), continuation, context));
+}
+
+TaskHandle CooperativeMultitasking::after(unsigned long duration, ContextContinuation* continuation, void* context, int priority) {
+  if (!continuation || isFull()) return 0;
+  //
+  return schedule(bind(create(clock() + ticks(duration), priority, NULL), continuation, context));
+}
+
+TaskHandle CooperativeMultitasking::ifThen(ContextGuard* guard, ContextContinuation* continuation, void* context, int priority) {
+  if (!guard || !continuation || isFull()) return 0;
+  //
+  Task* task = bind(create(clock(), priority, NULL), continuation, context);
+  task->boundguard = guard;
+  //
+  return schedule(task);
+}
+
+TaskHandle CooperativeMultitasking::onEvent(Event* event, ContextContinuation* continuation, void* context, int priority) {
+  if (!event || !continuation || isFull()) return 0;
+  //
+  Task* task = bind(create(0, priority, NULL), continuation, context);
+  task->event = event;
+  //
+  if (event->waiterstail) event->waiterstail->nextwaiter = task;
+  else event->waiters = task;
+  //
+  event->waiterstail = task;
+  //
+  return handleOf(task);
+}
+
+// O(waiters), nothing else is looked at
+void CooperativeMultitasking::signal(Event* event) {
+  if (!event) return;
+  //
+  Task* task = event->waiters;
+  event->waiters = NULL;
+  event->waiterstail = NULL;
+  TaskTime now = clock();
+  //
+  while (task) {
+    Task* next = task->nextwaiter;
+    task->event = NULL;
+    task->nextwaiter = NULL;
+    task->when = now;
+    add(task);
+    task = next;
+  }
+}
+
+void IRAM_ATTR CooperativeMultitasking::signalFromInterrupt(Event* event) {
+  if (!event || __atomic_exchange_n(&event->pending, true, __ATOMIC_ACQ_REL)) return;
+  //
+  Event* head = __atomic_load_n(&pendingevents, __ATOMIC_ACQUIRE);
+  //
+  do {
+    event->nextpending = head;
+  } while (!__atomic_compare_exchange_n(&pendingevents, &head, event, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  //
+  wake();
+}
+
+void CooperativeMultitasking::signalPending() {
+  Event* event = __atomic_exchange_n(&pendingevents, (Event*) NULL, __ATOMIC_ACQ_REL);
+  //
+  while (event) {
+    Event* next = event->nextpending;
+    event->nextpending = NULL;
+    __atomic_store_n(&event->pending, false, __ATOMIC_RELEASE);
+    signal(event);
+    event = next;
+  }
+}
+
+int CooperativeMultitasking::cancelAll(void* context) {
+  int cancelled = 0;
+  //
+  for (int i = 0; i < capacity; i++) {
+    Task* task = &slots[i];
+    //
+    if (!task->bound || task->context != context) continue;
+    //
+    leave(task);
+    discard(task);
+    cancelled++;
+  }
+  //
+  return cancelled;
+}
+
+bool CooperativeMultitasking::cancel(TaskHandle handle) {
+  Task* task = resolve(handle);
+  //
+  if (!task) return false;
+  //
+  leave(task);
+  discard(task);
+  //
+  return true;
+}
+
+// O(log n), the task keeps its handle and its onlyOneOf group
+bool CooperativeMultitasking::reschedule(TaskHandle handle, unsigned long duration) {
+  Task* task = resolve(handle);
+  //
+  if (!task || !task->position) return false;
+  //
+  task->when = clock() + ticks(duration);
+  bottomUp(task->position);
+  topDown(task->position);
+  //
+  return true;
+}
+
+void CooperativeMultitasking::onlyOneOf(const TaskHandle* handles, int n) {
+  Task* first = NULL;
+  //
+  for (int i = 0; i < n; i++) {
+    Task* task = resolve(handles[i]);
+    //
+    if (!task) continue;
+    //
+    if (first) join(first, task);
+    else first = task;
+  }
+}
+
+void IRAM_ATTR CooperativeMultitasking::wake() {
+  // a burst of wakes signals once
+  if (__atomic_exchange_n(&woken, true, __ATOMIC_ACQ_REL)) return;
+  //
+#ifdef COOPERATIVE_MULTITASKING_THREADS
+  std::lock_guard<std::mutex> lock(mutex);
+  condition.notify_one();
+#endif
+}
+
+void CooperativeMultitasking::setCycle(unsigned long duration) {
+  cycle = duration > 0 ? ticks(duration) : 1;
+}
+
+void CooperativeMultitasking::setClock(SchedulerClock* source) {
+  timesource = source;
+#ifdef COOPERATIVE_MULTITASKING_MICROS
+  lastmicros = micros();
+  elapsed = lastmicros;
+#else
+  last = 0;
+#endif
+}
+
+// run() checks the deadline again, a wait may end early
+void CooperativeMultitasking::wait(TaskTime duration) {
+#ifdef COOPERATIVE_MULTITASKING_MICROS
+  unsigned long microseconds = duration < 0x7fffffffUL ? (unsigned long) duration : 0x7fffffffUL;
+#else
+  unsigned long microseconds = duration < 0x7fffffffUL / 2000 ? duration * 2000 : 0x7fffffffUL;
+#endif
+  // simulated time, wake() is not waited for
+  if (timesource) {
+    timesource->sleep(microseconds);
+    //
+    return;
+  }
+  //
+#if defined(COOPERATIVE_MULTITASKING_THREADS)
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait_for(lock, std::chrono::microseconds(microseconds), [this] () -> bool { return __atomic_load_n(&woken, __ATOMIC_ACQUIRE); });
+#elif defined(_ARDUINO_LOW_POWER_H_)
+  LowPower.idle(microseconds / 1000); // any interrupt ends it, and wake() is called from one
+#else
+  unsigned long start = micros();
+  // sleep whole milliseconds, then spin out the rest to meet the deadline
+  while (micros() - start + 1000 < microseconds) {
+    if (__atomic_load_n(&woken, __ATOMIC_ACQUIRE)) return;
+    //
+    delay(1);
+  }
+  //
+  unsigned long spent = micros() - start;
+  //
+  if (spent < microseconds) delayMicroseconds(microseconds - spent);
+#endif
+}
+
+int CooperativeMultitasking::available() {
+  return count;
+}
+
+bool CooperativeMultitasking::onWake(ContextContinuation* continuation, void* context) {
+  WakeListener* unused = NULL;
+  //
+  for (int i = 0; i < COOPERATIVE_MULTITASKING_WAKE_LISTENERS; i++) {
+    WakeListener& listener = wakelisteners[i];
+    // again for the same context replaces it
+    if (listener.continuation && listener.context == context) {
+      listener.continuation = continuation;
+      //
+      return true;
+    }
+    //
+    if (!listener.continuation && !unused) unused = &listener;
+  }
+  //
+  if (!unused) return false;
+  //
+  unused->continuation = continuation;
+  unused->context = context;
+  //
+  return true;
+}
+
+void CooperativeMultitasking::cancelWake(void* context) {
+  for (int i = 0; i < COOPERATIVE_MULTITASKING_WAKE_LISTENERS; i++) {
+    if (wakelisteners[i].context == context) wakelisteners[i].continuation = NULL;
+  }
+}
+
+void CooperativeMultitasking::run() {
+  if (__atomic_exchange_n(&woken, false, __ATOMIC_ACQ_REL)) {
+    signalPending();
+    //
+    if (onwake) onwake();
+    //
+    for (int i = 0; i < COOPERATIVE_MULTITASKING_WAKE_LISTENERS; i++) {
+      if (wakelisteners[i].continuation) wakelisteners[i].continuation(wakelisteners[i].context);
+    }
+  }
+  //
+  TaskTime now = clock();
+#ifndef COOPERATIVE_MULTITASKING_MICROS
+  //
+  if (last > now) handleOverflow();
+  //
+  last = now;
+#endif
+  Task* task = extract(1);
+  //
+  if (!task) {
+    wait(cycle);
+    //
+    return;
+  }
+  //
+  if (now < task->when) {
+    wait(task->when - now);
+    now = clock();
+    // woken early, the task is not due yet
+    if (now < task->when || __atomic_load_n(&woken, __ATOMIC_ACQUIRE)) {
+      add(task);
+      //
+      return;
+    }
+  }
+  //
+  if (task->guard || task->boundguard) {
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+    unsigned long started = micros();
+    bool result = task->guard ? task->guard() : task->boundguard(task->context);
+    task->guardmicros += micros() - started;
+    task->guardcount++;
+#else
+    bool result = task->guard ? task->guard() : task->boundguard(task->context);
+#endif
+    // the guard cancelled its own task, e.g. through cancelAll()
+    if (isReleased(task)) return;
+    //
+    if (result) {
+      if (task->remaining > cycle) {
+        task->remaining -= cycle;
+        task->when = now + cycle;
+        add(task);
+        //
+        return;
+      }
+    } else {
+      task->remaining = task->duration;
+      task->when = now + cycle;
+      add(task);
+      //
+      return;
+    }
+  }
+  //
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+  TraceRecord record;
+  memset(&record, 0, sizeof record);
+  record.task = handleOf(task);
+  record.continuation = functionOf(task);
+  record.scheduled = microsOf(task->when);
+  record.guardcount = task->guardcount;
+  record.guardmicros = task->guardmicros;
+  //
+  for (int i = 0; task->sibling != task; ) cancelSibling(task->sibling, record, i);
+  //
+  Continuation* continuation = task->continuation;
+  ContextContinuation* bound = task->bound;
+  void* context = task->context;
+  release(task);
+  record.start = micros();
+  //
+  if (bound) bound(context);
+  else continuation();
+  record.duration = micros() - record.start;
+  trace[tracecount++ % COOPERATIVE_MULTITASKING_TRACE_SIZE] = record;
+#else
+  while (task->sibling != task) {
+    Task* sibling = task->sibling;
+    leave(sibling);
+    discard(sibling);
+  }
+  // the slot may be reused by the continuation, the handle no longer resolves
+  Continuation* continuation = task->continuation;
+  ContextContinuation* bound = task->bound;
+  void* context = task->context;
+  release(task);
+  //
+  if (bound) bound(context);
+  else continuation();
+#endif
+}
+
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+void CooperativeMultitasking::cancelSibling(Task* sibling, TraceRecord& record, int& i) {
+  if (i < 3) record.losers[i++] = functionOf(sibling); // the first three are named
+  //
+  record.siblingguardcount += sibling->guardcount;
+  leave(sibling);
+  discard(sibling);
+}
+
+void CooperativeMultitasking::nameTask(Continuation* continuation, const char* name) {
+  for (int i = 0; i < COOPERATIVE_MULTITASKING_TRACE_NAMES; i++) {
+    if (!names[i].continuation || names[i].continuation == continuation) {
+      names[i].continuation = continuation;
+      names[i].name = name;
+      //
+      return;
+    }
+  }
+}
+
+const char* CooperativeMultitasking::nameOf(Continuation* continuation) {
+  for (int i = 0; i < COOPERATIVE_MULTITASKING_TRACE_NAMES && names[i].continuation; i++) {
+    if (names[i].continuation == continuation) return names[i].name;
+  }
+  //
+  return NULL;
+}
+
+static void printContinuation(Print& out, const char* name, Continuation* continuation) {
+  out.print('"');
+  //
+  if (name) {
+    out.print(name);
+  } else {
+    out.print("0x");
+    out.print((unsigned long) (uintptr_t) continuation, HEX);
+  }
+  //
+  out.print('"');
+}
+
+void CooperativeMultitasking::dumpTrace(Print& out) {
+  unsigned long first = tracecount > COOPERATIVE_MULTITASKING_TRACE_SIZE ? tracecount - COOPERATIVE_MULTITASKING_TRACE_SIZE : 0;
+  out.print("{\"traceEvents\":[");
+  //
+  for (unsigned long i = first; i < tracecount; i++) {
+    const TraceRecord& record = trace[i % COOPERATIVE_MULTITASKING_TRACE_SIZE];
+    //
+    if (i > first) out.print(",\n");
+    //
+    out.print("{\"name\":");
+    printContinuation(out, nameOf(record.continuation), record.continuation);
+    out.print(",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":");
+    out.print(record.start);
+    out.print(",\"dur\":");
+    out.print(record.duration);
+    out.print(",\"args\":{\"slot\":");
+    out.print((unsigned long) (record.task & 0xffff) - 1);
+    out.print(",\"generation\":");
+    out.print((unsigned long) (uint32_t) (record.task >> 16));
+    out.print(",\"scheduled\":");
+    out.print(record.scheduled);
+    out.print(",\"lateness\":");
+    out.print((long) (record.start - record.scheduled));
+    out.print(",\"guards\":");
+    out.print(record.guardcount);
+    out.print(",\"guardus\":");
+    out.print(record.guardmicros);
+    out.print(",\"siblingguards\":");
+    out.print(record.siblingguardcount);
+    out.print(",\"wonover\":[");
+    //
+    for (int k = 0, n = 0; k < 3; k++) {
+      if (!record.losers[k]) continue;
+      //
+      if (n++ > 0) out.print(',');
+      //
+      printContinuation(out, nameOf(record.losers[k]), record.losers[k]);
+    }
+    //
+    out.print("]}}");
+  }
+  //
+  out.print("]}\n");
+}
+#endif
+
+#ifdef COOPERATIVE_MULTITASKING_MICROS
+// extends micros() as long as it is read once per 71 minutes, run() does at least every cycle
+TaskTime CooperativeMultitasking::clock() {
+  unsigned long sample = micros();
+  elapsed += (unsigned long) (sample - lastmicros);
+  lastmicros = sample;
+  //
+  return elapsed;
+}
+
+TaskTime CooperativeMultitasking::ticks(unsigned long milliseconds) {
+  return (TaskTime) milliseconds * 1000;
+}
+
+unsigned long CooperativeMultitasking::microsOf(TaskTime when) {
+  return (unsigned long) when;
+}
+#else
+TaskTime CooperativeMultitasking::clock() {
+  return millis() >> 1;
+}
+
+TaskTime CooperativeMultitasking::ticks(unsigned long milliseconds) {
+  return milliseconds >> 1;
+}
+
+unsigned long CooperativeMultitasking::microsOf(TaskTime when) {
+  return (when << 1) * 1000UL;
+}
+
+void CooperativeMultitasking::handleOverflow() {
+  for (int i = 1; i <= count; i++) {
+    Task* task = heap[i];
+    //
+    if (task->when & 0x80000000) {
+      task->when &= 0x7fffffff; // clear overflow
+    } else {
+      task->when = 0; // was due before the overflow
+    }
+  }
+  //
+  for (int i = 1; i <= count; i++) {
+    bottomUp(i); // restore heap
+  }
+}
+#endif
+
+CooperativeMultitasking::Task* CooperativeMultitasking::create(TaskTime when, int priority, Continuation* continuation, Guard* guard, TaskTime duration, TaskTime remaining) {
+  Task* task = freeslots; // the callers checked isFull()
+  freeslots = task->nextwaiter;
+  task->when = when;
+  task->priority = priority;
+  task->continuation = continuation;
+  task->guard = guard;
+  task->bound = NULL;
+  task->boundguard = NULL;
+  task->context = NULL;
+  task->duration = duration;
+  task->remaining = remaining;
+  task->sibling = task;
+  task->event = NULL;
+  task->nextwaiter = NULL;
+  task->position = 0;
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+  task->guardcount = 0;
+  task->guardmicros = 0;
+#endif
+  //
+  return task;
+}
+
+void CooperativeMultitasking::release(Task* task) {
+  task->generation++;
+  task->continuation = NULL;
+  task->bound = NULL;
+  task->nextwaiter = freeslots;
+  freeslots = task;
+}
+
+CooperativeMultitasking::Task* CooperativeMultitasking::bind(Task* task, ContextContinuation* continuation, void* context) {
+  task->bound = continuation;
+  task->context = context;
+  //
+  return task;
+}
+
+TaskHandle CooperativeMultitasking::handleOf(const Task* task) const {
+  return ((TaskHandle) task->generation << 16) | (TaskHandle) (task - slots + 1);
+}
+
+// O(1)
+CooperativeMultitasking::Task* CooperativeMultitasking::resolve(TaskHandle handle) const {
+  int i = (int) (handle & 0xffff) - 1;
+  //
+  if (i < 0 || i >= capacity) return NULL;
+  //
+  Task* task = &slots[i];
+  //
+  if (isReleased(task) || task->generation != (uint32_t) (handle >> 16)) return NULL;
+  //
+  return task;
+}
+
+TaskHandle CooperativeMultitasking::schedule(Task* task) {
+  add(task);
+  //
+  return handleOf(task);
+}
+
+// splices two circular lists into one, unless they are one already
+void CooperativeMultitasking::join(Task* task1, Task* task2) {
+  for (Task* task = task1->sibling; task != task1; task = task->sibling) {
+    if (task == task2) return;
+  }
+  //
+  Task* next = task1->sibling;
+  task1->sibling = task2->sibling;
+  task2->sibling = next;
+}
+
+void CooperativeMultitasking::leave(Task* task) {
+  Task* previous = task;
+  //
+  while (previous->sibling != task) previous = previous->sibling;
+  //
+  previous->sibling = task->sibling;
+  task->sibling = task;
+}
+
+void CooperativeMultitasking::add(Task* task) {
+  heap[++count] = task;
+  task->position = count;
+  bottomUp(count);
+}
+
+CooperativeMultitasking::Task* CooperativeMultitasking::extract(int i) {
+  if (isOutside(i)) return NULL;
+  //
+  Task* task = heap[i];
+  remove(task);
+  //
+  return task;
+}
+
+// O(log n), every task knows its position
+void CooperativeMultitasking::remove(Task* task) {
+  int i = task->position;
+  //
+  if (isOutside(i) || heap[i] != task) return;
+  //
+  task->position = 0;
+  Task* last = heap[count];
+  heap[count--] = NULL;
+  //
+  if (i > count) return;
+  //
+  heap[i] = last;
+  last->position = i;
+  bottomUp(i);
+  topDown(last->position);
+}
+
+void CooperativeMultitasking::discard(Task* task) {
+  if (task->event) unpark(task);
+  else remove(task);
+  //
+  release(task);
+}
+
+void CooperativeMultitasking::unpark(Task* task) {
+  Event* event = task->event;
+  Task* previous = NULL;
+  //
+  for (Task* waiter = event->waiters; waiter; previous = waiter, waiter = waiter->nextwaiter) {
+    if (waiter != task) continue;
+    //
+    if (previous) previous->nextwaiter = task->nextwaiter;
+    else event->waiters = task->nextwaiter;
+    //
+    if (event->waiterstail == task) event->waiterstail = previous;
+    //
+    break;
+  }
+  //
+  task->event = NULL;
+  task->nextwaiter = NULL;
+}
+
+void CooperativeMultitasking::swap(int i, int j) {
+  Task* task = heap[i];
+  heap[i] = heap[j];
+  heap[j] = task;
+  heap[i]->position = i;
+  heap[j]->position = j;
+}
+
+void CooperativeMultitasking::bottomUp(int i) {
+  while (hasParent(i)) {
+    int p = parent(i);
+    //
+    if (!isBefore(heap[i], heap[p])) return;
+    //
+    swap(i, p);
+    i = p;
+  }
+}
+
+void CooperativeMultitasking::topDown(int i) {
+  while (true) {
+    int l = leftChild(i);
+    int r = rightChild(i);
+    int first = i;
+    //
+    if (l <= count && isBefore(heap[l], heap[first])) first = l;
+    //
+    if (r <= count && isBefore(heap[r], heap[first])) first = r;
+    //
+    if (first == i) return;
+    //
+    swap(i, first);
+    i = first;
+  }
+}
+
+bool CooperativeMultitasking::isBefore(const Task* task1, const Task* task2) {
+  if (task1->when < task2->when) return true;
+  //
+  if (task1->when == task2->when && task1->priority > task2->priority) return true;
+  //
+  return false;
+}
+
+// counts the refusals, a full scheduler is the one way to lose a task
+inline bool CooperativeMultitasking::isFull() {
+  if (freeslots) return false;
+  //
+  overflows++;
+  //
+  return true;
+}
+
+inline bool CooperativeMultitasking::isOutside(int i) {
+  return i < 1 || i > count;
+}
+
+inline bool CooperativeMultitasking::hasParent(int i) {
+  return i > 1;
+}
+
+inline int CooperativeMultitasking::parent(int i) {
+  return i >> 1;
+}
+
+inline int CooperativeMultitasking::leftChild(int i) {
+  return i << 1;
+}
+
+inline int CooperativeMultitasking::rightChild(int i) {
+  return (i << 1) + 1;
 }
\ No newline at end of file
@@ -1,80 +1,279 @@
-/*
- * Copyright (C) 2018 Andreas Motzek andreas-motzek@t-online.de
- *
- * This file is part of the Cooperative Multitasking package.
- *
- * You can use, redistribute and/or modify this file under the terms of the Modified Artistic License.
- * See http://simplysomethings.de/open+source/modified+artistic+license.html for details.
- *
- * This file is distributed in the hope that it will be useful, but without any warranty; without even
- * the implied warranty of merchantability or fitness for a particular purpose.
- */
-
-#ifndef CooperativeMultitasking_h
-#define CooperativeMultitasking_h
-
-#include "Arduino.h"
-
-typedef void Continuation(); // Continuation task; void task() { ... }
-
-typedef bool Guard(); // Guard test; bool test() { return false; }
-
-class CooperativeMultitasking {
-  private:
-    struct Task {
-      unsigned long when;
-      int priority;
-      Continuation* continuation;
-      Guard* guard;
-      unsigned long duration;
-      unsigned long remaining;
-      Task* sibling1;
-      Task* sibling2;
-      Task* sibling3;
-    };
-
-    int capacity;
-    Task** heap;
-    int count;
-    unsigned long cycle;
-    unsigned long last;
-
-    void handleOverflow();
-    static Task* create(unsigned long when, int priority, Continuation* continuation, Guard* guard = NULL, unsigned long duration = 0, unsigned long remaining = 0);
-    void add(Task* task);
-    Task* extract(int index);
-    void remove(const Task* task);
-    int find(const Task* task, int index = 1);
-    void bottomUp(int index);
-    void topDown(int index);
-    static bool isBefore(const Task* task1, const Task* task2);
-    inline bool isFull();
-    inline bool isOutside(int index);
-    inline bool isInside(int index);
-    inline bool isLeaf(int index);
-    static inline bool hasParent(int index);
-    static inline int parent(int index);
-    static inline int leftChild(int index);
-    static inline int rightChild(int index);
-
-#ifdef _ARDUINO_LOW_POWER_H_
-    static void wait(unsigned long duration) { LowPower.idle(duration << 1); }
-#else
-    static void wait(unsigned long duration) { delay(duration << 1); }
-#endif
-
-  public:
-    CooperativeMultitasking(int capacity = 32);
-    virtual ~CooperativeMultitasking();
-    Task* now(Continuation continuation, int priority = 0);
-    Task* after(unsigned long duration, Continuation* continuation, int priority = 0);
-    Task* ifForThen(Guard* guard, unsigned long duration, Continuation* continuation, int priority = 0);
-    Task* ifThen(Guard* guard, Continuation* continuation, int priority = 0);
-    void onlyOneOf(Task* task1, Task* task2);
-    void onlyOneOf(Task* task1, Task* task2, Task* task3);
-    void onlyOneOf(Task* task1, Task* task2, Task* task3, Task* task4);
-    int available();
-    void run();
-};
-
+/*
+ * Copyright (C) 2018 Andreas Motzek andreas-motzek@t-online.de
+ *
+ * This file is part of the Cooperative Multitasking package.
+ *
+ * You can use, redistribute and/or modify this file under the terms of the Modified Artistic License.
+ * See http://simplysomethings.de/open+source/modified+artistic+license.html for details.
+ *
+ * This file is distributed in the hope that it will be useful, but without any warranty; without even
+ * the implied warranty of merchantability or fitness for a particular purpose.
+ */
+
+#ifndef CooperativeMultitasking_h
+#define CooperativeMultitasking_h
+
+#include "Arduino.h"
+
+// the interrupt path, signalFromInterrupt() and wake(), is kept in RAM: on the ESP32 it may run while the flash cache is off
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+// #define COOPERATIVE_MULTITASKING_THREADS // wake() may be called from other threads, idle blocks on a condition variable
+#ifdef COOPERATIVE_MULTITASKING_THREADS
+#include <condition_variable>
+#include <mutex>
+#endif
+
+// #define COOPERATIVE_MULTITASKING_MICROS // 64 bit microsecond deadlines, no wraparound, see afterMicros()
+#ifdef COOPERATIVE_MULTITASKING_MICROS
+typedef uint64_t TaskTime; // micros() extended to 64 bits
+#else
+typedef unsigned long TaskTime; // millis() >> 1, wraps after 49 days
+#endif
+
+typedef void Continuation(); // Continuation task; void task() { ... }
+
+typedef bool Guard(); // Guard test; bool test() { return false; }
+
+// the same with the object they work on, e.g. [] (void* client) -> void { ((MQTTClient*) client)->flush(); }
+typedef void ContextContinuation(void* context);
+
+typedef bool ContextGuard(void* context);
+
+typedef uint64_t TaskHandle; // slot + 1 in the low 16 bits, generation in the next 32 bits, 0 is no task
+
+// The scheduler's time source, see setClock(). Without one it reads millis() and micros() and really waits.
+class SchedulerClock {
+  public:
+    virtual ~SchedulerClock() { }
+    virtual unsigned long millis() = 0;
+    virtual unsigned long micros() = 0;
+    virtual void sleep(unsigned long microseconds) = 0; // nothing is due before then
+};
+
+// Simulated time: an idle scheduler jumps to the next deadline, an hour of retries runs in milliseconds
+class VirtualClock : public SchedulerClock {
+  private:
+    uint64_t now; // microseconds
+
+  public:
+    VirtualClock(unsigned long start = 0) : now((uint64_t) start * 1000) { }
+    unsigned long millis() { return (unsigned long) (now / 1000); }
+    unsigned long micros() { return (unsigned long) now; }
+    void sleep(unsigned long microseconds) { now += microseconds; }
+    void advance(unsigned long milliseconds) { now += (uint64_t) milliseconds * 1000; }
+};
+
+// #define COOPERATIVE_MULTITASKING_STATIC // no heap, schedulers are StaticMultitasking<capacity>
+// #define COOPERATIVE_MULTITASKING_TRACE // record every task run, see dumpTrace()
+#define COOPERATIVE_MULTITASKING_TRACE_SIZE 128 // records, the oldest are overwritten
+#define COOPERATIVE_MULTITASKING_TRACE_NAMES 16
+#define COOPERATIVE_MULTITASKING_WAKE_LISTENERS 8 // onWake() with a context, e.g. one per MQTT client ingress
+
+class CooperativeMultitasking {
+  template<int CAPACITY> friend class StaticMultitasking;
+
+  public:
+    class Event;
+
+  private:
+    struct Task {
+      TaskTime when;
+      int priority;
+      Continuation* continuation;
+      Guard* guard;
+      ContextContinuation* bound; // instead of continuation
+      ContextGuard* boundguard; // instead of guard
+      void* context;
+      TaskTime duration;
+      TaskTime remaining;
+      Task* sibling; // circular list of the onlyOneOf group, the task itself if alone
+      Event* event; // the task is parked on it, else the task is in the heap
+      Task* nextwaiter; // also links the free slots
+      int position; // in the heap, 0 if not in it
+      uint32_t generation; // counts the reuses of the slot, handles of earlier uses do not resolve until it wraps
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+      unsigned long guardcount; // guard evaluations
+      unsigned long guardmicros; // time spent in the guard
+#endif
+    };
+
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+    struct TraceRecord {
+      TaskHandle task; // while it was scheduled
+      Continuation* continuation; // or the bound continuation, see functionOf()
+      unsigned long scheduled; // micros, 2 ms resolution unless COOPERATIVE_MULTITASKING_MICROS
+      unsigned long start; // micros
+      unsigned long duration; // micros
+      unsigned long guardcount;
+      unsigned long guardmicros;
+      unsigned long siblingguardcount; // spent by the onlyOneOf siblings that lost
+      Continuation* losers[3];
+    };
+
+    struct TraceName {
+      Continuation* continuation;
+      const char* name;
+    };
+
+#ifdef COOPERATIVE_MULTITASKING_STATIC
+    TraceRecord trace[COOPERATIVE_MULTITASKING_TRACE_SIZE];
+#else
+    TraceRecord* trace;
+#endif
+    unsigned long tracecount; // records written so far
+    TraceName names[COOPERATIVE_MULTITASKING_TRACE_NAMES];
+
+    void cancelSibling(Task* sibling, TraceRecord& record, int& i);
+    const char* nameOf(Continuation* continuation);
+    static Continuation* functionOf(const Task* task) { return task->continuation ? task->continuation : (Continuation*) task->bound; }
+#endif
+
+  public:
+    // Tasks parked by onEvent() wait outside the heap, signal() makes exactly them due.
+    // Not latched: a signal without waiters is lost, test the state before waiting on it.
+    class Event {
+      friend class CooperativeMultitasking;
+
+      private:
+        Task* waiters;
+        Task* waiterstail; // signalled in the order they started waiting
+        bool pending; // signalFromInterrupt() was called, run() signals
+        Event* nextpending;
+
+      public:
+        Event() : waiters(NULL), waiterstail(NULL), pending(false), nextpending(NULL) { }
+        bool hasWaiters() const { return waiters != NULL; }
+    };
+
+  private:
+    int capacity;
+    Task* slots; // every task lives here, no allocation per task
+    Task* freeslots;
+    Task** heap;
+    int count;
+    bool owned; // slots and heap were allocated by the constructor
+    size_t footprint;
+    unsigned long overflows;
+    Event* pendingevents; // pushed by signalFromInterrupt()
+    TaskTime cycle; // guards are tested, and idle waits end, at this interval
+#ifdef COOPERATIVE_MULTITASKING_MICROS
+    unsigned long lastmicros;
+    TaskTime elapsed;
+#else
+    TaskTime last;
+#endif
+    SchedulerClock* timesource; // NULL for millis() and micros()
+    bool woken; // set by wake(), cleared by run()
+    Continuation* onwake;
+    struct WakeListener {
+      ContextContinuation* continuation;
+      void* context;
+    };
+    WakeListener wakelisteners[COOPERATIVE_MULTITASKING_WAKE_LISTENERS];
+#ifdef COOPERATIVE_MULTITASKING_THREADS
+    std::mutex mutex;
+    std::condition_variable condition;
+#endif
+
+    CooperativeMultitasking(int capacity, Task* slots, Task** heap); // storage of a StaticMultitasking
+    void initialize();
+    TaskTime clock();
+    static TaskTime ticks(unsigned long milliseconds);
+    static unsigned long microsOf(TaskTime when);
+#ifndef COOPERATIVE_MULTITASKING_MICROS
+    void handleOverflow();
+#endif
+    Task* create(TaskTime when, int priority, Continuation* continuation, Guard* guard = NULL, TaskTime duration = 0, TaskTime remaining = 0);
+    void release(Task* task);
+    static Task* bind(Task* task, ContextContinuation* continuation, void* context);
+    static bool isReleased(const Task* task) { return !task->continuation && !task->bound; }
+    TaskHandle handleOf(const Task* task) const;
+    Task* resolve(TaskHandle handle) const;
+    TaskHandle schedule(Task* task);
+    void join(Task* task1, Task* task2);
+    void leave(Task* task);
+    void add(Task* task);
+    Task* extract(int index);
+    void remove(Task* task);
+    void discard(Task* task);
+    void unpark(Task* task);
+    void signalPending();
+    void swap(int index1, int index2);
+    void bottomUp(int index);
+    void topDown(int index);
+    static bool isBefore(const Task* task1, const Task* task2);
+    inline bool isFull();
+    inline bool isOutside(int index);
+    static inline bool hasParent(int index);
+    static inline int parent(int index);
+    static inline int leftChild(int index);
+    static inline int rightChild(int index);
+
+    void wait(TaskTime duration); // returns early on wake()
+
+  public:
+#ifndef COOPERATIVE_MULTITASKING_STATIC
+    CooperativeMultitasking(int capacity = 32);
+#endif
+    virtual ~CooperativeMultitasking();
+    TaskHandle now(Continuation continuation, int priority = 0);
+    TaskHandle after(unsigned long duration, Continuation* continuation, int priority = 0);
+    TaskHandle afterMicros(unsigned long duration, Continuation* continuation, int priority = 0); // rounded up to 2 ms unless COOPERATIVE_MULTITASKING_MICROS
+    TaskHandle ifForThen(Guard* guard, unsigned long duration, Continuation* continuation, int priority = 0);
+    TaskHandle ifThen(Guard* guard, Continuation* continuation, int priority = 0);
+    TaskHandle onEvent(Event* event, Continuation* continuation, int priority = 0);
+    TaskHandle now(ContextContinuation* continuation, void* context, int priority = 0);
+    TaskHandle after(unsigned long duration, ContextContinuation* continuation, void* context, int priority = 0);
+    TaskHandle ifThen(ContextGuard* guard, ContextContinuation* continuation, void* context, int priority = 0);
+    TaskHandle onEvent(Event* event, ContextContinuation* continuation, void* context, int priority = 0);
+    int cancelAll(void* context); // every task bound to the context, O(capacity)
+    void signal(Event* event); // scheduler only
+    void signalFromInterrupt(Event* event); // any thread or interrupt, run() signals
+    // a handle stops resolving once its task ran or was cancelled, these return false then
+    bool isScheduled(TaskHandle task) const { return resolve(task) != NULL; }
+    bool cancel(TaskHandle task);
+    bool reschedule(TaskHandle task, unsigned long duration); // not for tasks parked on an event
+    // when one of the tasks runs the others are cancelled, handles that are 0 are ignored
+    void onlyOneOf(const TaskHandle* tasks, int count);
+    template<typename... Handles> void onlyOneOf(TaskHandle task1, Handles... tasks) {
+      const TaskHandle handles[] = { task1, tasks... };
+      onlyOneOf(handles, (int) (sizeof...(Handles) + 1));
+    }
+    void setCycle(unsigned long duration); // milliseconds, 100 by default
+    // before the first task is scheduled; the members below hide ::millis() and ::micros() in here
+    void setClock(SchedulerClock* source);
+    unsigned long millis() { return timesource ? timesource->millis() : ::millis(); }
+    unsigned long micros() { return timesource ? timesource->micros() : ::micros(); }
+    int available();
+    int getCapacity() const { return capacity; }
+    unsigned long getOverflows() const { return overflows; } // tasks refused, their handle was 0
+    size_t getFootprint() const { return footprint; } // bytes of the scheduler, heap included
+    void run();
+    // the continuation runs on the scheduler at the start of the next run() after a wake()
+    void onWake(Continuation* continuation) { onwake = continuation; }
+    // the same for each context, false when COOPERATIVE_MULTITASKING_WAKE_LISTENERS are taken; scheduler only
+    bool onWake(ContextContinuation* continuation, void* context);
+    void cancelWake(void* context);
+    void wake(); // any thread or interrupt
+#ifdef COOPERATIVE_MULTITASKING_TRACE
+    void nameTask(Continuation* continuation, const char* name);
+    void nameTask(ContextContinuation* continuation, const char* name) { nameTask((Continuation*) continuation, name); }
+    void dumpTrace(Print& out); // Chrome trace event JSON, load it in chrome://tracing or Perfetto
+    void clearTrace() { tracecount = 0; }
+#endif
+};
+
+// Every task slot in the instance: StaticMultitasking<16> tasks; schedules at most 16 tasks at a time.
+template<int CAPACITY> class StaticMultitasking : public CooperativeMultitasking {
+  private:
+    Task storage[CAPACITY];
+    Task* order[CAPACITY + 1]; // the heap, 1 based
+
+  public:
+    StaticMultitasking() : CooperativeMultitasking(CAPACITY, storage, order) { footprint = sizeof(StaticMultitasking<CAPACITY>); }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include "Arduino.h"
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+
+// monotonic, wraps like the core's after 49 days and 71 minutes
+unsigned long millis() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  //
+  return (unsigned long) (uint32_t) ((uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+unsigned long micros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  //
+  return (unsigned long) (uint32_t) ((uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+void delay(unsigned long ms) {
+  usleep((useconds_t) ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  usleep(us);
+}
+
+size_t HardwareSerial::write(uint8_t value) {
+  return fwrite(&value, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  return fwrite(buffer, 1, size, stdout);
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t count = 0;
+  //
+  while (size-- > 0 && write(*buffer++) == 1) count++;
+  //
+  return count;
+}
+
+size_t Print::printNumber(unsigned long value, int base) {
+  char digits[8 * sizeof(long) + 1];
+  char* p = digits + sizeof digits - 1;
+  *p = 0;
+  //
+  if (base < 2) base = DEC;
+  //
+  do {
+    int digit = value % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    value /= base;
+  } while (value > 0);
+  //
+  return write(p);
+}
+
+size_t Print::print(long value, int base) {
+  if (base != DEC || value >= 0) return printNumber((unsigned long) value, base);
+  //
+  size_t n = print('-');
+  //
+  return n + printNumber(0UL - (unsigned long) value, base);
+}
+
+size_t Print::print(double value, int digits) {
+  char text[64];
+  int n = snprintf(text, sizeof text, "%.*f", digits, value);
+  //
+  return n > 0 ? write(text) : 0;
+}
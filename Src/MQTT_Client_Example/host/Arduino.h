@@ -0,0 +1,33 @@
+/*
+@Brief : the part of the Arduino core the library uses, for host builds such as the load generator, see mqtt_load_generator.cpp
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// standard output, what the sketch prints to the UART
+class HardwareSerial : public Print {
+  public:
+    void begin(unsigned long) { }
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* buffer, size_t size);
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,21 @@
+/*
+@Brief : an IPv4 address as Arduino's IPAddress holds it, for host builds
+ */
+
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+
+class IPAddress {
+  private:
+    uint8_t bytes[4];
+
+  public:
+    IPAddress() { bytes[0] = bytes[1] = bytes[2] = bytes[3] = 0; }
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth) { bytes[0] = first; bytes[1] = second; bytes[2] = third; bytes[3] = fourth; }
+    uint8_t operator[](int index) const { return bytes[index]; }
+    uint8_t& operator[](int index) { return bytes[index]; }
+};
+
+#endif
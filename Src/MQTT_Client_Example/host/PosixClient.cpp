@@ -0,0 +1,149 @@
+#include "PosixClient.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+int PosixClient::open(const struct sockaddr* address, unsigned int length) {
+  stop();
+  //
+  int s = ::socket(address->sa_family, SOCK_STREAM, 0);
+  //
+  if (s < 0) return 0;
+  //
+  if (::connect(s, address, length) != 0) {
+    ::close(s);
+    //
+    return 0;
+  }
+  // MQTT packets are small, they go out when written
+  int one = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  socket = s;
+  clearWriteError();
+  //
+  return 1;
+}
+
+int PosixClient::connect(IPAddress ip, uint16_t port) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof address);
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  uint8_t* bytes = (uint8_t*) &address.sin_addr.s_addr;
+  //
+  for (int i = 0; i < 4; i++) bytes[i] = ip[i];
+  //
+  return open((const struct sockaddr*) &address, sizeof address);
+}
+
+int PosixClient::connect(const char* host, uint16_t port) {
+  struct addrinfo hints;
+  struct addrinfo* results = NULL;
+  char service[8];
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof service, "%u", port);
+  //
+  if (getaddrinfo(host, service, &hints, &results) != 0) return 0;
+  //
+  int result = 0;
+  //
+  for (struct addrinfo* info = results; info && !result; info = info->ai_next) {
+    result = open(info->ai_addr, info->ai_addrlen);
+  }
+  //
+  freeaddrinfo(results);
+  //
+  return result;
+}
+
+// all of it or an error, as the core's clients do
+size_t PosixClient::write(const uint8_t* buffer, size_t size) {
+  size_t written = 0;
+  //
+  while (socket >= 0 && written < size) {
+    ssize_t n = send(socket, buffer + written, size - written, MSG_NOSIGNAL);
+    //
+    if (n < 0 && errno == EINTR) continue;
+    //
+    if (n <= 0) {
+      setWriteError();
+      //
+      break;
+    }
+    //
+    written += n;
+  }
+  //
+  return written;
+}
+
+int PosixClient::available() {
+  if (socket < 0) return 0;
+  //
+  int count = 0;
+  //
+  if (ioctl(socket, FIONREAD, &count) != 0) return 0;
+  //
+  return count + (peeked >= 0 ? 1 : 0);
+}
+
+int PosixClient::read() {
+  uint8_t value;
+  //
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int PosixClient::read(uint8_t* buffer, size_t size) {
+  if (socket < 0 || size == 0) return -1;
+  //
+  size_t count = 0;
+  //
+  if (peeked >= 0) {
+    buffer[count++] = (uint8_t) peeked;
+    peeked = -1;
+  }
+  //
+  ssize_t n = count < size ? recv(socket, buffer + count, size - count, MSG_DONTWAIT) : 0;
+  //
+  if (n > 0) count += n;
+  //
+  return count > 0 ? (int) count : -1;
+}
+
+int PosixClient::peek() {
+  if (peeked < 0) peeked = read();
+  //
+  return peeked;
+}
+
+void PosixClient::stop() {
+  if (socket >= 0) ::close(socket);
+  //
+  socket = -1;
+  peeked = -1;
+}
+
+// still connected while there is something to read, as the core's clients are
+uint8_t PosixClient::connected() {
+  if (socket < 0) return 0;
+  //
+  if (available() > 0) return 1;
+  //
+  uint8_t value;
+  ssize_t n = recv(socket, &value, 1, MSG_PEEK | MSG_DONTWAIT);
+  //
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    stop();
+    //
+    return 0;
+  }
+  //
+  return 1;
+}
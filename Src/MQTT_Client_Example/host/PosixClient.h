@@ -0,0 +1,37 @@
+/*
+@Brief : a Client over a POSIX TCP socket, blocking connect and write, reads never block
+ */
+
+#ifndef PosixClient_h
+#define PosixClient_h
+
+#include "Client.h"
+
+struct sockaddr;
+
+class PosixClient final : public Client {
+  private:
+    int socket; // -1 while not connected
+    int peeked; // a byte read by peek(), -1 if none
+
+    int open(const struct sockaddr* address, unsigned int length);
+
+  public:
+    PosixClient() : socket(-1), peeked(-1) { }
+    ~PosixClient() { stop(); }
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char* host, uint16_t port);
+    size_t write(uint8_t value) { return write(&value, 1); }
+    size_t write(const uint8_t* buffer, size_t size);
+    int available();
+    int read();
+    int read(uint8_t* buffer, size_t size);
+    int peek();
+    void flush() { }
+    void stop();
+    uint8_t connected();
+    operator bool() { return socket >= 0; }
+    using Print::write;
+};
+
+#endif
@@ -0,0 +1,44 @@
+/*
+@Brief : Arduino's Print for host builds, numbers are formatted as the core does
+ */
+
+#ifndef Print_h
+#define Print_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define DEC 10
+#define HEX 16
+
+class Print {
+  private:
+    int writeerror;
+    size_t printNumber(unsigned long value, int base);
+
+  public:
+    Print() : writeerror(0) { }
+    virtual ~Print() { }
+    int getWriteError() { return writeerror; }
+    void clearWriteError() { writeerror = 0; }
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* text) { return text ? write((const uint8_t*) text, strlen(text)) : 0; }
+    size_t print(const char* text) { return write(text); }
+    size_t print(char value) { return write((uint8_t) value); }
+    size_t print(unsigned char value, int base = DEC) { return printNumber(value, base); }
+    size_t print(int value, int base = DEC) { return print((long) value, base); }
+    size_t print(unsigned int value, int base = DEC) { return printNumber(value, base); }
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC) { return printNumber(value, base); }
+    size_t print(double value, int digits = 2);
+    size_t println() { return write("\r\n"); }
+    template<typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    template<typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+
+  protected:
+    void setWriteError(int error = 1) { writeerror = error; }
+};
+
+#endif
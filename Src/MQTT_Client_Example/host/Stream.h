@@ -0,0 +1,17 @@
+/*
+@Brief : Arduino's Stream for host builds, without the parsing helpers
+ */
+
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+#endif
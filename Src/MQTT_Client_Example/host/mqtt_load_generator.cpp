@@ -0,0 +1,107 @@
+/*
+@Brief : the load generator as a host command, e.g. 5000 devices against a broker or simulated in virtual time
+
+Built from the sketch folder with the shim in host/ in front of the Arduino headers, without the TLS client:
+
+  g++ -O2 -std=gnu++11 -Ihost -I. -o mqtt_load_generator host/Arduino.cpp host/PosixClient.cpp host/mqtt_load_generator.cpp \
+      $(ls *.cpp | grep -v MQTTTLSClient)
+
+  ./mqtt_load_generator -n 5000 -i 1000 -d 60000                 simulated brokers, 60 virtual seconds
+  ./mqtt_load_generator -n 500 -b localhost:1883 -t "fleet/%u/t"  a real broker, in real time
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "MQTTLoadGenerator.h"
+#include "MQTTPackets.h"
+#include "PosixClient.h"
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-n devices] [-b host:port] [-t topic pattern] [-s payload bytes] [-i interval ms] [-d duration ms]\n"
+                  "       [-l simulated latency ms] [-p simulated loss %%] [-u user name] [-P password]\n"
+                  "without -b every device talks to its own simulated broker in virtual time\n", name);
+  exit(2);
+}
+
+static unsigned long number(const char* text, unsigned long max, const char* name) {
+  char* end;
+  errno = 0;
+  unsigned long value = strtoul(text, &end, 10);
+  //
+  if (errno || end == text || *end || value > max) {
+    fprintf(stderr, "bad %s: %s\n", name, text);
+    exit(2);
+  }
+  //
+  return value;
+}
+
+static Client* openTransport(uint16_t) {
+  return new PosixClient();
+}
+
+// a socket per device, more than the usual soft limit of 1024 descriptors
+static void raiseDescriptorLimit(unsigned long devices) {
+  struct rlimit limit;
+  //
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= devices + 64) return;
+  //
+  limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > devices + 64 ? devices + 64 : limit.rlim_max;
+  //
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < devices + 64) fprintf(stderr, "warning: only %lu descriptors for %lu devices\n", (unsigned long) limit.rlim_cur, devices);
+}
+
+int main(int argc, char** argv) {
+  MQTTLoadProfile profile = { 50, NULL, 1883, NULL, NULL, "fleet/%u/telemetry", 64, 1000, 60000, 40, 0 };
+  char host[256];
+  int option;
+  //
+  while ((option = getopt(argc, argv, "n:b:t:s:i:d:l:p:u:P:")) != -1) {
+    switch (option) {
+      case 'n': profile.devices = number(optarg, LOAD_MAX_DEVICES, "device count"); break;
+      case 'b': {
+        const char* colon = strrchr(optarg, ':');
+        size_t length = colon ? (size_t) (colon - optarg) : strlen(optarg);
+        //
+        if (length == 0 || length >= sizeof host) usage(argv[0]);
+        //
+        memcpy(host, optarg, length);
+        host[length] = 0;
+        profile.host = host;
+        profile.port = colon ? number(colon + 1, 65535, "port") : 1883;
+        break;
+      }
+      case 't': profile.topic = optarg; break;
+      case 's': profile.payloadsize = number(optarg, MQTT_MAX_PACKET_LENGTH, "payload size"); break;
+      case 'i': profile.interval = number(optarg, 86400000UL, "interval"); break;
+      case 'd': profile.duration = number(optarg, 86400000UL, "duration"); break;
+      case 'l': profile.latency = number(optarg, 60000, "latency"); break;
+      case 'p': profile.loss = number(optarg, 100, "loss"); break;
+      case 'u': profile.username = optarg; break;
+      case 'P': profile.password = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  //
+  if (optind != argc) usage(argv[0]);
+  //
+  if (profile.host) raiseDescriptorLimit(profile.devices);
+  //
+  MQTTLoadReport report;
+  //
+  if (!runLoadGenerator(profile, report, profile.host ? openTransport : NULL)) {
+    fprintf(stderr, "cannot run the profile: devices 1 to %u, a nonzero interval, a topic with at most one %%u\n", LOAD_MAX_DEVICES);
+    //
+    return 1;
+  }
+  //
+  printLoadReport(Serial, report);
+  printLoadReportJson(Serial, report);
+  //
+  return report.connected == report.devices ? 0 : 1;
+}
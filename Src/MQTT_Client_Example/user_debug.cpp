@@ -1,149 +1,315 @@
-/*
-@Date  : 8/11/2021
-@Author: Tan Dung, Tran
-@Brief : debug utils
- */
-
-
-#include <stdarg.h>
-#include <stdio.h>
-
-// hw dependencies
-#include "Arduino.h"
-#define UART_DEBUG  Serial.print
-#define UART_DEBUGX Serial.println
-#define BAUDRATE_DEBUG 115200
-// Sem/mutex lock
-// SemaphoreHandle_t dbgSem_id;
-
-void user_debug_init(void)
-{
-    // Serial.begin(BAUDRATE_DEBUG);
-}
-
-/* ---------------- For ITM debug ---------------- */
-
-//#define ITM_Port8(n)    (*((volatile unsigned char *)(0xE0000000+4*n)))
-//#define ITM_Port16(n)   (*((volatile unsigned short*)(0xE0000000+4*n)))
-//#define ITM_Port32(n)   (*((volatile unsigned long *)(0xE0000000+4*n)))
-
-//#define DEMCR           (*((volatile unsigned long *)(0xE000EDFC)))
-//#define TRCENA          0x01000000
-
-//struct __FILE { int handle; /* Add whatever needed */ };
-//FILE __stdout;
-//FILE __stdin;
-
-// Retarget to ITM debug
-/*
-int fputc(int ch, FILE *f) {
-//  if (DEMCR & TRCENA) {
-//    while (ITM_Port32(0) == 0);
-//    ITM_Port8(0) = ch;
-//  }
-//  return(ch);
-	return( ITM_SendChar(ch ) );
-}
-*/
-
-
-// Retarget to serial 
-/*
-int fputc(int ch, FILE *f) {
-	UART_DMA_TX_SendByte(&huart3_dma,(uint8_t)ch);
-	return(ch);
-}
-*/
-
-
-// Using serial with DMA optimize
-static  uint8_t  buffer[256];
-static void uart_printf(const char *fmt, ...)
-{
-	uint32_t len;
-	va_list vArgs;
-	va_start(vArgs, fmt);
-	len = vsprintf((char *)&buffer[0], (char const *)fmt, vArgs);
-	va_end(vArgs);
-    for (size_t i = 0; i < len; i++)
-    {
-        UART_DEBUG(buffer[i]);
-    }	
-}
-// Du`.. fat hien ra chan ly :D
-static void uart_vprintf(const char *fmt, va_list vArgs)
-{
-	uint32_t len;
-	len = vsprintf((char *)&buffer[0], (char const *)fmt, vArgs);
-	for (size_t i = 0; i < len; i++)
-    {
-        UART_DEBUG(buffer[i]);
-    }	
-}
-
-/* ############### Actual debug redirect ################# */
-#define __debug_printf(fmt, ...) uart_printf(fmt, __VA_ARGS__)
-#define __debug_vprintf(fmt, vArgs) uart_vprintf(fmt, vArgs)
-
-/* ------------------- MAIN DEBUG I/O -------------- */
-void user_debug_print(int level, const char* module, int line, const char* fmt, ...)
-{
-  // osSemaphoreWait(dbgSem_id , osWaitForever);
-
-	#if 0
-	switch(level)
-	{
-		default:
-		case 1:
-		__printf("[ERROR]");
-		break;
-		case 2:
-		__printf("[WARN]");
-		break;
-		case 3:
-		__printf("[INFO]");
-		break;
-		case 4:
-		__printf("[DBG]");
-		break;
-	}
-	#endif
-	
-  	if (level == 1)
-		{
-			UART_DEBUGX("[ERROR]");
-		}
-  	else if (level == 2){
-			UART_DEBUGX("[WARN]");
-		}
-		
- 	// __debug_printf("%d@%s: ", line, module);
-  	__debug_printf("->%s: ", module);
-	
-	va_list     vArgs;		    
-	va_start(vArgs, fmt);
-	__debug_vprintf((char const *)fmt, vArgs);
-	va_end(vArgs);
-	
-  	// osSemaphoreRelease(dbgSem_id);
-}
-
-void dbg_error(const char* module, int line, int ret)
-{
-  // osSemaphoreWait(dbgSem_id , osWaitForever);
-  __debug_printf("[RC] Module %s - Line %d : Error %d\n", module, line, ret);
-  // osSemaphoreRelease(dbgSem_id);
-}
-
-void user_debug_print_exact(const char* fmt, ...)
-{
-  // osSemaphoreWait(dbgSem_id , osWaitForever);
-
-	va_list     vArgs;		    
-	va_start(vArgs, fmt);
-	__debug_vprintf((char const *)fmt, vArgs);
-	va_end(vArgs);
-	
-  // osSemaphoreRelease(dbgSem_id);
-}
-
+/*
+@Date  : 8/11/2021
+@Author: Tan Dung, Tran
+@Brief : debug utils
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// hw dependencies
+#include "Arduino.h"
+#define __MODULE__ "user_debug"
+#include "user_debug.h" // after Arduino.h, its log() macro would break <math.h>
+#define UART_DEBUG  Serial.print
+#define UART_DEBUGX Serial.println
+#define BAUDRATE_DEBUG 115200
+// Sem/mutex lock
+// SemaphoreHandle_t dbgSem_id;
+
+void user_debug_init(void)
+{
+    // Serial.begin(BAUDRATE_DEBUG);
+}
+
+/* ---------------- For ITM debug ---------------- */
+
+//#define ITM_Port8(n)    (*((volatile unsigned char *)(0xE0000000+4*n)))
+//#define ITM_Port16(n)   (*((volatile unsigned short*)(0xE0000000+4*n)))
+//#define ITM_Port32(n)   (*((volatile unsigned long *)(0xE0000000+4*n)))
+
+//#define DEMCR           (*((volatile unsigned long *)(0xE000EDFC)))
+//#define TRCENA          0x01000000
+
+//struct __FILE { int handle; /* Add whatever needed */ };
+//FILE __stdout;
+//FILE __stdin;
+
+// Retarget to ITM debug
+/*
+int fputc(int ch, FILE *f) {
+//  if (DEMCR & TRCENA) {
+//    while (ITM_Port32(0) == 0);
+//    ITM_Port8(0) = ch;
+//  }
+//  return(ch);
+	return( ITM_SendChar(ch ) );
+}
+*/
+
+
+// Retarget to serial 
+/*
+int fputc(int ch, FILE *f) {
+	UART_DMA_TX_SendByte(&huart3_dma,(uint8_t)ch);
+	return(ch);
+}
+*/
+
+
+// Using serial with DMA optimize
+// the buffer is on the stack, so tasks and interrupts may print at the same time
+static void uart_vprintf(const char *fmt, va_list vArgs)
+{
+	char buffer[256];
+	int len = vsnprintf(buffer, sizeof buffer, fmt, vArgs);
+	if (len <= 0) return;
+	if ((size_t) len >= sizeof buffer) len = sizeof buffer - 1;
+	Serial.write((const uint8_t *) buffer, len);
+}
+// Du`.. fat hien ra chan ly :D
+static void uart_printf(const char *fmt, ...)
+{
+	va_list vArgs;
+	va_start(vArgs, fmt);
+	uart_vprintf(fmt, vArgs);
+	va_end(vArgs);
+}
+
+/* ############### Actual debug redirect ################# */
+#define __debug_printf(fmt, ...) uart_printf(fmt, __VA_ARGS__)
+#define __debug_vprintf(fmt, vArgs) uart_vprintf(fmt, vArgs)
+
+/* ------------------- MAIN DEBUG I/O -------------- */
+void user_debug_print(int level, const char* module, int line, const char* fmt, ...)
+{
+  // osSemaphoreWait(dbgSem_id , osWaitForever);
+
+	#if 0
+	switch(level)
+	{
+		default:
+		case 1:
+		__printf("[ERROR]");
+		break;
+		case 2:
+		__printf("[WARN]");
+		break;
+		case 3:
+		__printf("[INFO]");
+		break;
+		case 4:
+		__printf("[DBG]");
+		break;
+	}
+	#endif
+	
+  	if (level == 1)
+		{
+			UART_DEBUGX("[ERROR]");
+		}
+  	else if (level == 2){
+			UART_DEBUGX("[WARN]");
+		}
+		
+ 	// __debug_printf("%d@%s: ", line, module);
+  	__debug_printf("->%s: ", module);
+	
+	va_list     vArgs;		    
+	va_start(vArgs, fmt);
+	__debug_vprintf((char const *)fmt, vArgs);
+	va_end(vArgs);
+	
+  	// osSemaphoreRelease(dbgSem_id);
+}
+
+void dbg_error(const char* module, int line, int ret)
+{
+  // osSemaphoreWait(dbgSem_id , osWaitForever);
+  __debug_printf("[RC] Module %s - Line %d : Error %d\n", module, line, ret);
+  // osSemaphoreRelease(dbgSem_id);
+}
+
+void user_debug_print_exact(const char* fmt, ...)
+{
+  // osSemaphoreWait(dbgSem_id , osWaitForever);
+
+	va_list     vArgs;		    
+	va_start(vArgs, fmt);
+	__debug_vprintf((char const *)fmt, vArgs);
+	va_end(vArgs);
+	
+  // osSemaphoreRelease(dbgSem_id);
+}
+
+/* ------------------- DEFERRED LOGGING -------------- */
+// Bounded multi-producer ring after D. Vyukov: a slot is free for the producer when its
+// sequence equals the position, and holds a record for the consumer when it is position + 1.
+#define RING_UNINITIALIZED 0
+#define RING_INITIALIZING 1
+#define RING_READY 2
+#define RING_INIT_SPINS 10000 // then the record is dropped
+static user_debug_record_t ring[USER_DEBUG_RING_SIZE];
+static uint32_t ring_head = 0; // next position to write
+static uint32_t ring_tail = 0; // next position to read, consumer only
+static uint32_t ring_dropped = 0;
+static uint8_t ring_state = RING_UNINITIALIZED;
+
+// the first record sets up the slots, ready is published only once all of them are stored
+static bool ring_init(void)
+{
+	uint8_t expected = RING_UNINITIALIZED;
+	if (__atomic_compare_exchange_n(&ring_state, &expected, RING_INITIALIZING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		for (uint32_t i = 0; i < USER_DEBUG_RING_SIZE; i++) {
+			__atomic_store_n(&ring[i].sequence, i, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&ring_state, RING_READY, __ATOMIC_RELEASE);
+		return true;
+	}
+	// another producer initializes; bounded, an interrupt that preempted it on the same core would wait forever
+	for (int i = 0; i < RING_INIT_SPINS; i++) {
+		if (__atomic_load_n(&ring_state, __ATOMIC_ACQUIRE) == RING_READY) return true;
+	}
+	return false;
+}
+
+void user_debug_record(int level, const char* module, int line, const char* fmt, int argc, const uintptr_t* args, unsigned strings)
+{
+	if (__atomic_load_n(&ring_state, __ATOMIC_ACQUIRE) != RING_READY && !ring_init()) {
+		__atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	uint32_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	user_debug_record_t* record;
+	while (true) {
+		record = &ring[pos & (USER_DEBUG_RING_SIZE - 1)];
+		int32_t diff = (int32_t) (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if (diff < 0) {
+			// full, never block the caller
+			__atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+		}
+	}
+	record->time = millis();
+	record->fmt = fmt;
+	record->module = module;
+	record->line = line;
+	record->level = level;
+	record->argc = argc > USER_DEBUG_MAX_ARGS ? USER_DEBUG_MAX_ARGS : argc;
+	memcpy(record->args, args, record->argc * sizeof(uintptr_t));
+	// strings go into the text one after another, a full text leaves the rest empty
+	size_t used = 0;
+	record->strings = 0;
+	for (int i = 0; i < record->argc; i++) {
+		if (!(strings & (1u << i)) || !args[i]) continue;
+		const char* text = (const char*) args[i];
+		size_t room = USER_DEBUG_TEXT_SIZE - used;
+		if (room) {
+			size_t n = strnlen(text, room - 1);
+			memcpy(record->text + used, text, n);
+			record->text[used + n] = 0;
+			record->args[i] = used;
+			used += n + 1;
+		} else {
+			record->args[i] = USER_DEBUG_TEXT_SIZE - 1; // empty, the last terminator
+		}
+		record->strings |= 1u << i;
+	}
+	__atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+// single consumer
+int user_debug_pop(user_debug_record_t* out)
+{
+	if (__atomic_load_n(&ring_state, __ATOMIC_ACQUIRE) != RING_READY) return 0;
+	user_debug_record_t* record = &ring[ring_tail & (USER_DEBUG_RING_SIZE - 1)];
+	if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != ring_tail + 1) return 0;
+	memcpy(out, record, sizeof *out);
+	__atomic_store_n(&record->sequence, ring_tail + USER_DEBUG_RING_SIZE, __ATOMIC_RELEASE);
+	ring_tail++;
+	return 1;
+}
+
+uint32_t user_debug_dropped(void)
+{
+	return __atomic_load_n(&ring_dropped, __ATOMIC_RELAXED);
+}
+
+// formats one record, every conversion takes its raw slot with the type it names
+static size_t format_record(char* out, size_t size, const user_debug_record_t* record)
+{
+	size_t len = 0;
+	int arg = 0;
+	const char* p = record->fmt;
+	while (*p && len + 1 < size) {
+		if (*p != '%') { out[len++] = *p++; continue; }
+		if (p[1] == '%') { out[len++] = '%'; p += 2; continue; }
+		char spec[16];
+		size_t n = 0;
+		int longs = 0;
+		spec[n++] = *p++;
+		while (*p && strchr("-+ #0123456789.", *p) && n < sizeof spec - 4) spec[n++] = *p++;
+		while (*p == 'l' || *p == 'h' || *p == 'z') { if (*p == 'l') longs++; p++; }
+		char conversion = *p ? *p++ : 'd';
+		uintptr_t value = arg < record->argc ? record->args[arg] : 0;
+		bool copied = arg < record->argc && (record->strings & (1u << arg));
+		arg++;
+		int written;
+		if (strchr("fFeEgG", conversion)) {
+			float f;
+			uint32_t bits = (uint32_t) value;
+			memcpy(&f, &bits, sizeof f);
+			spec[n++] = conversion;
+			spec[n] = 0;
+			written = snprintf(out + len, size - len, spec, (double) f);
+		} else if (conversion == 's' || conversion == 'p') {
+			spec[n++] = conversion;
+			spec[n] = 0;
+			const char* text = copied ? record->text + value : value ? (const char*) value : "(null)";
+			written = conversion == 's' ? snprintf(out + len, size - len, spec, text) : snprintf(out + len, size - len, spec, (void*) value);
+		} else {
+			// integers travel as long long, whatever their size was
+			spec[n++] = 'l';
+			spec[n++] = 'l';
+			spec[n++] = conversion;
+			spec[n] = 0;
+			if (strchr("di", conversion)) {
+				long long v = longs ? (long long) (intptr_t) value : (long long) (int) value;
+				written = snprintf(out + len, size - len, spec, v);
+			} else if (conversion == 'c') {
+				spec[n - 3] = 'c';
+				spec[n - 2] = 0;
+				written = snprintf(out + len, size - len, spec, (int) value);
+			} else {
+				unsigned long long v = longs ? (unsigned long long) value : (unsigned long long) (unsigned int) value;
+				written = snprintf(out + len, size - len, spec, v);
+			}
+		}
+		if (written < 0) break;
+		len += (size_t) written < size - len ? (size_t) written : size - len - 1;
+	}
+	out[len] = 0;
+	return len;
+}
+
+int user_debug_drain(int max)
+{
+	user_debug_record_t record;
+	char buffer[256];
+	int count = 0;
+	while (count < max && user_debug_pop(&record)) {
+		if (record.level == 1) UART_DEBUGX("[ERROR]");
+		else if (record.level == 2) UART_DEBUGX("[WARN]");
+		uart_printf("->%s: ", record.module);
+		size_t len = format_record(buffer, sizeof buffer, &record);
+		Serial.write((const uint8_t *) buffer, len);
+		count++;
+	}
+	return count;
+}
@@ -1,90 +1,149 @@
-/*
-@Date  : 8/11/2021
-@Author: Tan Dung, Tran
-@Brief : debug utils
- */
-
-
-#ifndef _USER_DEBUG_
-#define _USER_DEBUG_
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-// #define __DEBUG__ 4
-
-void user_debug_init(void);
-void user_debug_print(int level, const char* module, int line, const char* fmt, ...);
-void user_debug_print_error(const char* module, int line, int ret);
-void user_debug_print_exact(const char* fmt, ...);
-
-// test only
-void __printf(const char *format, ...);
-
-#if __DEBUG__ > 0
-#ifndef __MODULE__
-#error "__MODULE__ must be defined"
-#endif
-#endif
-
-#if __DEBUG__ >= 1
-#define ERR(...) do{ user_debug_print(1, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define error(...) do{ user_debug_print(1, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#else
-#define ERR(...) do{ }while(0)
-#define error(...) do{ }while(0)
-#endif
-
-#if __DEBUG__ >= 2
-#define WARN(...) do{ user_debug_print(2, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define warn(...) do{ user_debug_print(2, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#else
-#define WARN(...) do{ }while(0)
-#define warn(...) do{ }while(0)
-#endif
-
-#if __DEBUG__ >= 3
-#define INFO(...) do{ user_debug_print(3, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define info(...) do{ user_debug_print(3, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define LOG(...) do{ user_debug_print(3, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define log(...) do{ user_debug_print(3, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define CHECK(ret) do{ if(ret){ user_debug_print_error(__MODULE__, __LINE__, ret); } }while(0)
-#define check(ret) do{ if(ret){ user_debug_print_error(__MODULE__, __LINE__, ret); } }while(0)
-#else
-#define INFO(...) do{ }while(0)
-#define info(...) do{ }while(0)
-#define LOG(...) do{ }while(0)
-#define log(...) do{ }while(0)
-#define CHECK(ret) do{ }while(0)
-#define check(ret) do{ }while(0)
-#endif
-
-#if __DEBUG__ >= 4
-#define DBG(...) do{ user_debug_print(4, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define DBGX(...) do{ user_debug_print_exact(__VA_ARGS__); }while(0)
-#define dbg(...) do{ user_debug_print(4, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define dbgx(...) do{ user_debug_print_exact(__VA_ARGS__); }while(0)
-#define debug(...) do{ user_debug_print(4, __MODULE__, __LINE__, __VA_ARGS__); }while(0)
-#define debugx(...) do{ user_debug_print_exact(__VA_ARGS__); }while(0)
-#define debug_strn(x, n) do {user_debug_print(4, __MODULE__, __LINE__, ""); \
-							for (int i = 0; i < n; ++i) \
-								if (x[i] != 0) debugx("%c", x[i]); \
-								else break; \
-						} while(0)
-#else
-#define DBG(...) do{ }while(0)
-#define DBGX(...) do{ }while(0)
-#define dbg(...) do{ }while(0)
-#define dbgx(...) do{ }while(0)
-#define debug(...) do{ }while(0)
-#define debugx(...) do{ }while(0)
-#define debug_strn(x, n)
-#endif
-
-#ifdef __cplusplus
-}
-#endif
- 
-#endif /* _USER_DEBUG_ */
-
+/*
+@Date  : 8/11/2021
+@Author: Tan Dung, Tran
+@Brief : debug utils
+ */
+
+
+#ifndef _USER_DEBUG_
+#define _USER_DEBUG_
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// #define __DEBUG__ 4
+
+/*
+ * Deferred logging: the macros below only store the format string pointer (the format id)
+ * and the raw arguments into a lock-free ring. user_debug_drain() formats them later,
+ * e.g. from a low priority task, user_debug_pop() hands the raw records to an offline decoder.
+ * Strings are copied into the record (truncated to USER_DEBUG_TEXT_SIZE in total),
+ * so stack buffers can be logged with %s.
+ */
+#define USER_DEBUG_RING_SIZE 64 // records, power of 2
+#define USER_DEBUG_MAX_ARGS 6
+#define USER_DEBUG_TEXT_SIZE 24 // bytes for all string arguments of one record
+
+typedef struct {
+	volatile uint32_t sequence; // ring slot state
+	uint32_t time; // millis()
+	const char* fmt; // format id
+	const char* module;
+	uint16_t line;
+	uint8_t level;
+	uint8_t argc;
+	uint8_t strings; // bit i set: args[i] is an offset into text
+	uintptr_t args[USER_DEBUG_MAX_ARGS]; // integers, pointers or float bits
+	char text[USER_DEBUG_TEXT_SIZE]; // copied strings, each NUL terminated
+} user_debug_record_t;
+
+void user_debug_init(void);
+void user_debug_print(int level, const char* module, int line, const char* fmt, ...);
+void user_debug_print_error(const char* module, int line, int ret);
+void user_debug_print_exact(const char* fmt, ...);
+void user_debug_record(int level, const char* module, int line, const char* fmt, int argc, const uintptr_t* args, unsigned strings);
+int user_debug_pop(user_debug_record_t* record);
+int user_debug_drain(int max);
+uint32_t user_debug_dropped(void);
+
+// test only
+void __printf(const char *format, ...);
+
+#if __DEBUG__ > 0
+#ifndef __MODULE__
+#error "__MODULE__ must be defined"
+#endif
+#endif
+
+#ifdef __cplusplus
+#define USER_DEBUG_LOG(level, ...) user_debug_log(level, __MODULE__, __LINE__, __VA_ARGS__)
+#else
+#define USER_DEBUG_LOG(level, ...) user_debug_print(level, __MODULE__, __LINE__, __VA_ARGS__)
+#endif
+
+#if __DEBUG__ >= 1
+#define ERR(...) do{ USER_DEBUG_LOG(1, __VA_ARGS__); }while(0)
+#define error(...) do{ USER_DEBUG_LOG(1, __VA_ARGS__); }while(0)
+#else
+#define ERR(...) do{ }while(0)
+#define error(...) do{ }while(0)
+#endif
+
+#if __DEBUG__ >= 2
+#define WARN(...) do{ USER_DEBUG_LOG(2, __VA_ARGS__); }while(0)
+#define warn(...) do{ USER_DEBUG_LOG(2, __VA_ARGS__); }while(0)
+#else
+#define WARN(...) do{ }while(0)
+#define warn(...) do{ }while(0)
+#endif
+
+#if __DEBUG__ >= 3
+#define INFO(...) do{ USER_DEBUG_LOG(3, __VA_ARGS__); }while(0)
+#define info(...) do{ USER_DEBUG_LOG(3, __VA_ARGS__); }while(0)
+#define LOG(...) do{ USER_DEBUG_LOG(3, __VA_ARGS__); }while(0)
+#define log(...) do{ USER_DEBUG_LOG(3, __VA_ARGS__); }while(0)
+#define CHECK(ret) do{ if(ret){ user_debug_print_error(__MODULE__, __LINE__, ret); } }while(0)
+#define check(ret) do{ if(ret){ user_debug_print_error(__MODULE__, __LINE__, ret); } }while(0)
+#else
+#define INFO(...) do{ }while(0)
+#define info(...) do{ }while(0)
+#define LOG(...) do{ }while(0)
+#define log(...) do{ }while(0)
+#define CHECK(ret) do{ }while(0)
+#define check(ret) do{ }while(0)
+#endif
+
+#if __DEBUG__ >= 4
+#define DBG(...) do{ USER_DEBUG_LOG(4, __VA_ARGS__); }while(0)
+#define DBGX(...) do{ user_debug_print_exact(__VA_ARGS__); }while(0)
+#define dbg(...) do{ USER_DEBUG_LOG(4, __VA_ARGS__); }while(0)
+#define dbgx(...) do{ user_debug_print_exact(__VA_ARGS__); }while(0)
+#define debug(...) do{ USER_DEBUG_LOG(4, __VA_ARGS__); }while(0)
+#define debugx(...) do{ user_debug_print_exact(__VA_ARGS__); }while(0)
+#define debug_strn(x, n) do {user_debug_print(4, __MODULE__, __LINE__, ""); \
+							for (int i = 0; i < n; ++i) \
+								if (x[i] != 0) debugx("%c", x[i]); \
+								else break; \
+						} while(0)
+#else
+#define DBG(...) do{ }while(0)
+#define DBGX(...) do{ }while(0)
+#define dbg(...) do{ }while(0)
+#define dbgx(...) do{ }while(0)
+#define debug(...) do{ }while(0)
+#define debugx(...) do{ }while(0)
+#define debug_strn(x, n)
+#endif
+
+#ifdef __cplusplus
+}
+
+// packs every argument into one slot, at compile time there is no formatting at all
+inline uintptr_t user_debug_arg(float value) { uint32_t bits; memcpy(&bits, &value, sizeof bits); return bits; }
+inline uintptr_t user_debug_arg(double value) { return user_debug_arg((float) value); }
+inline uintptr_t user_debug_arg(const void* value) { return (uintptr_t) value; }
+template<typename T> inline uintptr_t user_debug_arg(T value) { return (uintptr_t) value; }
+
+// which arguments are strings, those are copied instead of kept as pointers
+template<typename T> struct user_debug_is_string { enum { value = 0 }; };
+template<> struct user_debug_is_string<const char*> { enum { value = 1 }; };
+template<> struct user_debug_is_string<char*> { enum { value = 1 }; };
+template<typename... Args> struct user_debug_strings { enum { value = 0 }; };
+template<typename T, typename... Args> struct user_debug_strings<T, Args...> {
+	enum { value = user_debug_is_string<T>::value | (user_debug_strings<Args...>::value << 1) };
+};
+
+template<typename... Args>
+inline void user_debug_log(int level, const char* module, int line, const char* fmt, Args... args) {
+	static_assert(sizeof...(Args) <= USER_DEBUG_MAX_ARGS, "too many log arguments");
+	const uintptr_t packed[sizeof...(Args) + 1] = { user_debug_arg(args)..., 0 };
+	user_debug_record(level, module, line, fmt, sizeof...(Args), packed, user_debug_strings<Args...>::value);
+}
+#endif
+ 
+#endif /* _USER_DEBUG_ */
+